@@ -26,17 +26,50 @@ fi
 cat > Makefile << 'EOF'
 CC=gcc
 CFLAGS=-I./include -Wall -Wextra -D_FILE_OFFSET_BITS=64
-LIBS=-lm -lfuse -lpthread
+LIBS=-lm -lfuse -lpthread -lz
+# libstego: the hide/extract core without FUSE or the CLI
+LIB_CFLAGS=$(CFLAGS) -DSTEGO_LIBRARY -fPIC -fvisibility=hidden
+LIB_LIBS=-lm -lpthread
 
-all: build/steganography
+all: build/steganography build/libstego.a build/libstego.so
 
-build/steganography: src/steganography.c
-	$(CC) $(CFLAGS) $^ -o $@ $(LIBS)
+build/steganography: src/steganography.c src/stego.h
+	$(CC) $(CFLAGS) src/steganography.c -o $@ $(LIBS)
+
+build/libstego.o: src/steganography.c src/stego.h
+	$(CC) $(LIB_CFLAGS) -c src/steganography.c -o $@
+
+build/libstego.a: build/libstego.o
+	ar rcs $@ $^
+
+build/libstego.so: build/libstego.o
+	$(CC) -shared $^ -o $@ $(LIB_LIBS)
+
+# Stage and end-to-end throughput on synthetic covers; not part of `all`
+build/bench: src/bench.c src/steganography.c src/stego.h
+	$(CC) $(CFLAGS) -O2 src/bench.c -o $@ $(LIB_LIBS)
+
+# e.g. make bench BENCH_ARGS="--compare=baseline.json --threshold=5"
+bench: build/bench
+	./build/bench $(BENCH_ARGS)
+
+# Mount operations driven in-process, no /dev/fuse needed
+build/fsbench: src/fsbench.c src/steganography.c src/stego.h
+	$(CC) $(CFLAGS) -O2 src/fsbench.c -o $@ $(LIBS)
+
+bench-fs: build/fsbench
+	./build/fsbench
+
+# The CLI with every allocation tracked per stage, reported at exit
+build/steganography-allocprof: src/steganography.c src/stego.h
+	$(CC) $(CFLAGS) -DSTEGO_ALLOC_PROFILE src/steganography.c -o $@ $(LIBS)
+
+allocprof: build/steganography-allocprof
 
 clean:
-	rm -f build/steganography
+	rm -f build/steganography build/libstego.o build/libstego.a build/libstego.so build/bench build/fsbench build/steganography-allocprof
 
-.PHONY: all clean
+.PHONY: all bench bench-fs allocprof clean
 EOF
 
 echo "Setup complete!"
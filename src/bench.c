@@ -0,0 +1,453 @@
+// Benchmark harness, run with `make bench`. The library core is compiled
+// into this program so every stage can be timed on its own: PNG decode,
+// payload embed, payload extract and PNG encode, the CRC32C and Reed-Solomon
+// kernels, plus end-to-end hide and extract through the in-memory API.
+// Covers are synthesized with Perlin noise and payloads are generated, so
+// runs are repeatable across machines.
+//
+// --json=<file> saves the results; --compare=<file> checks this run against
+// such a baseline and exits non-zero when a stage regressed.
+#define STEGO_LIBRARY
+#include "steganography.c"
+#define STB_PERLIN_IMPLEMENTATION
+#include "stb_perlin.h"
+#include <time.h>
+
+#define BENCH_MIN_ITERATIONS 3
+#define BENCH_MAX_ITERATIONS 50
+#define BENCH_MIN_SECONDS 0.25
+#define BENCH_FORMAT_VERSION 1
+#define BENCH_MAX_RESULTS 128
+#define BENCH_ECC_PARITY 32
+
+typedef struct
+{
+    int width;
+    int height;
+} bench_size_t;
+
+static const bench_size_t bench_sizes[] = {{512, 512}, {1024, 1024}, {2048, 2048}};
+
+// Everything one cover size and payload kind needs, prepared up front
+typedef struct
+{
+    int width;
+    int height;
+    unsigned char *pixels;    // clean cover
+    unsigned char *work;      // embed target
+    unsigned char *cover_png; // encoded cover
+    int cover_png_len;
+    unsigned char *stego_png;
+    size_t stego_png_len;
+    unsigned char *stego_pixels;
+    unsigned char *payload;
+    size_t payload_len;
+    unsigned char *ecc_out;
+    stego_options_t opts;
+    stego_ctx_t *ctx;
+} bench_case_t;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t bench_rand(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Smooth fractal structure per channel plus a little sensor grain, which is
+// what real photos look like to both the PNG filter and the LSB plane
+static unsigned char *make_cover(int width, int height, int seed)
+{
+    unsigned char *pixels = malloc((size_t)width * height * 3);
+    if (!pixels)
+        return NULL;
+    uint64_t grain = 0x9E3779B97F4A7C15ULL ^ seed;
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            for (int c = 0; c < 3; c++)
+            {
+                float n = stb_perlin_fbm_noise3(x / 256.0f, y / 256.0f, seed + c * 7.3f, 2.0f, 0.5f, 4);
+                int v = (int)(128 + n * 110) + (int)(bench_rand(&grain) % 7) - 3;
+                pixels[((size_t)y * width + x) * 3 + c] = v < 0 ? 0 : v > 255 ? 255 : v;
+            }
+        }
+    }
+    return pixels;
+}
+
+// Random bytes, or text-like data from a small vocabulary
+static unsigned char *make_payload(size_t len, int compressible)
+{
+    static const char *words[] = {"stego ", "image ", "payload ", "header ", "bit ", "carrier ", "the ", "of ",
+                                  "and ", "block ", "pixel ", "channel ", "\n"};
+    unsigned char *payload = malloc(len ? len : 1);
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+    for (size_t i = 0; payload && i < len;)
+    {
+        if (!compressible)
+        {
+            payload[i++] = bench_rand(&state);
+            continue;
+        }
+        const char *w = words[bench_rand(&state) % (sizeof(words) / sizeof(words[0]))];
+        for (; *w && i < len; w++)
+            payload[i++] = *w;
+    }
+    return payload;
+}
+
+typedef int (*bench_fn)(bench_case_t *bc);
+
+static int bench_decode(bench_case_t *bc)
+{
+    int width, height, channels;
+    unsigned char *pixels = stbi_load_from_memory(bc->cover_png, bc->cover_png_len, &width, &height, &channels, 3);
+    stbi_image_free(pixels);
+    return pixels ? 0 : 1;
+}
+
+static int bench_embed(bench_case_t *bc)
+{
+    file_metadata_t base = {0};
+    return embed_payload(bc->work, bc->width, bc->height, "bench", bc->payload, bc->payload_len, &base, &bc->opts);
+}
+
+static int bench_extract(bench_case_t *bc)
+{
+    file_metadata_t metadata;
+    unsigned char *data = NULL;
+    int r = decode_payload(bc->stego_pixels, bc->width, bc->height, &bc->opts, &metadata, &data);
+    free(data);
+    return r;
+}
+
+static int bench_encode(bench_case_t *bc)
+{
+    int len;
+    unsigned char *png = stbi_write_png_to_mem(bc->pixels, bc->width * 3, bc->width, bc->height, 3, &len);
+    STBIW_FREE(png);
+    return png ? 0 : 1;
+}
+
+static int bench_crc32c(bench_case_t *bc)
+{
+    volatile uint32_t crc = crc32c_update(0, bc->payload, bc->payload_len);
+    (void)crc;
+    return 0;
+}
+
+static int bench_rs_encode(bench_case_t *bc)
+{
+    uint32_t crc = 0;
+    ecc_encode(bc->payload, bc->payload_len, BENCH_ECC_PARITY, bc->ecc_out, &crc);
+    return 0;
+}
+
+static int bench_hide(bench_case_t *bc)
+{
+    void *png;
+    size_t len;
+    if (stego_hide_memory(bc->ctx, bc->cover_png, bc->cover_png_len, bc->payload, bc->payload_len, "bin", &png,
+                          &len) != 0)
+        return 1;
+    stego_buffer_free(bc->ctx, png);
+    return 0;
+}
+
+static int bench_unhide(bench_case_t *bc)
+{
+    void *data;
+    size_t len;
+    if (stego_extract_memory(bc->ctx, bc->stego_png, bc->stego_png_len, &data, &len, NULL) != 0)
+        return 1;
+    stego_buffer_free(bc->ctx, data);
+    return 0;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double median_of_sorted(const double *v, int n)
+{
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+// One timed stage on one cover and payload; times in nanoseconds
+typedef struct
+{
+    char stage[32];
+    char image[16];
+    char payload[16];
+    size_t bytes;
+    int iterations;
+    double median_ns;
+    double mad_ns; // median absolute deviation of the iterations
+} bench_result_t;
+
+// Runs fn until it has both the minimum iterations and the minimum time and
+// fills in the median and MAD of the iteration times
+static int time_stage(bench_fn fn, bench_case_t *bc, bench_result_t *result)
+{
+    double samples[BENCH_MAX_ITERATIONS], deviations[BENCH_MAX_ITERATIONS];
+    double total = 0;
+    int n = 0;
+    while (n < BENCH_MAX_ITERATIONS && (n < BENCH_MIN_ITERATIONS || total < BENCH_MIN_SECONDS))
+    {
+        double start = now_seconds();
+        if (fn(bc) != 0)
+            return 1;
+        samples[n] = now_seconds() - start;
+        total += samples[n++];
+    }
+    qsort(samples, n, sizeof(double), compare_doubles);
+    double median = median_of_sorted(samples, n);
+    for (int i = 0; i < n; i++)
+        deviations[i] = samples[i] > median ? samples[i] - median : median - samples[i];
+    qsort(deviations, n, sizeof(double), compare_doubles);
+    result->iterations = n;
+    result->median_ns = median * 1e9;
+    result->mad_ns = median_of_sorted(deviations, n) * 1e9;
+    return 0;
+}
+
+// Results file: a header line, then one result object per line, so the
+// baseline can be read back without a JSON parser
+static int save_results(const char *path, const bench_result_t *results, int count)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+    {
+        fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    fprintf(f, "{\"format\":\"stego-bench\",\"version\":%d,\"timestamp\":%ld,\"results\":[\n", BENCH_FORMAT_VERSION,
+            (long)time(NULL));
+    for (int i = 0; i < count; i++)
+    {
+        const bench_result_t *r = &results[i];
+        fprintf(f,
+                "{\"stage\":\"%s\",\"image\":\"%s\",\"payload\":\"%s\",\"bytes\":%zu,\"iterations\":%d,"
+                "\"median_ns\":%.0f,\"mad_ns\":%.0f,\"mb_per_s\":%.3f}%s\n",
+                r->stage, r->image, r->payload, r->bytes, r->iterations, r->median_ns, r->mad_ns,
+                r->bytes / r->median_ns * 1e3, i + 1 < count ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    return fclose(f) != 0;
+}
+
+static int load_results(const char *path, bench_result_t *results, int max)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        fprintf(stderr, "Cannot read %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char line[512];
+    int version = 0, count = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        bench_result_t r;
+        memset(&r, 0, sizeof(r));
+        if (sscanf(line, "{\"format\":\"stego-bench\",\"version\":%d", &version) == 1)
+            continue;
+        if (count < max &&
+            sscanf(line,
+                   "{\"stage\":\"%31[^\"]\",\"image\":\"%15[^\"]\",\"payload\":\"%15[^\"]\",\"bytes\":%zu,"
+                   "\"iterations\":%d,\"median_ns\":%lf,\"mad_ns\":%lf",
+                   r.stage, r.image, r.payload, &r.bytes, &r.iterations, &r.median_ns, &r.mad_ns) == 7)
+            results[count++] = r;
+    }
+    fclose(f);
+    if (version != BENCH_FORMAT_VERSION)
+    {
+        fprintf(stderr, "%s is not a version %d stego-bench results file\n", path, BENCH_FORMAT_VERSION);
+        return -1;
+    }
+    return count;
+}
+
+// A stage regressed when it is slower than the baseline by more than the
+// threshold and by more than three times the combined noise (scaled MADs),
+// so one noisy run does not fail the gate
+static int compare_results(const bench_result_t *base, int base_count, const bench_result_t *cur, int cur_count,
+                           double threshold)
+{
+    int regressions = 0;
+    printf("\n%-12s %-10s %-13s %12s %12s %9s  %s\n", "stage", "image", "payload", "base ms", "current ms",
+           "change", "verdict");
+    for (int i = 0; i < cur_count; i++)
+    {
+        const bench_result_t *c = &cur[i], *b = NULL;
+        for (int j = 0; j < base_count && !b; j++)
+        {
+            if (strcmp(base[j].stage, c->stage) == 0 && strcmp(base[j].image, c->image) == 0 &&
+                strcmp(base[j].payload, c->payload) == 0)
+                b = &base[j];
+        }
+        if (!b)
+        {
+            printf("%-12s %-10s %-13s %12s %12.3f %9s  new\n", c->stage, c->image, c->payload, "-",
+                   c->median_ns / 1e6, "-");
+            continue;
+        }
+        double change = (c->median_ns - b->median_ns) / b->median_ns;
+        double noise = 3 * 1.4826 * (c->mad_ns + b->mad_ns);
+        const char *verdict = "ok";
+        if (change > threshold && c->median_ns - b->median_ns > noise)
+        {
+            verdict = "REGRESSION";
+            regressions++;
+        }
+        else if (change < -threshold && b->median_ns - c->median_ns > noise)
+            verdict = "faster";
+        else if (fabs(change) > threshold)
+            verdict = "noisy";
+        printf("%-12s %-10s %-13s %12.3f %12.3f %+8.1f%%  %s\n", c->stage, c->image, c->payload,
+               b->median_ns / 1e6, c->median_ns / 1e6, change * 100, verdict);
+    }
+    printf("\n%d regression(s) beyond %.1f%%\n", regressions, threshold * 100);
+    return regressions;
+}
+
+static int prepare_case(bench_case_t *bc, int width, int height, int compressible)
+{
+    memset(bc, 0, sizeof(*bc));
+    bc->width = width;
+    bc->height = height;
+    bc->pixels = make_cover(width, height, width + height);
+    bc->work = malloc((size_t)width * height * 3);
+    bc->ctx = stego_ctx_new(NULL);
+    if (!bc->pixels || !bc->work || !bc->ctx)
+        return 1;
+    memcpy(bc->work, bc->pixels, (size_t)width * height * 3);
+    gf_init();
+    bc->cover_png = stbi_write_png_to_mem(bc->pixels, width * 3, width, height, 3, &bc->cover_png_len);
+
+    // Half the carrier: a realistic fill that leaves room for the header
+    file_metadata_t base = {0};
+    bc->payload_len = payload_capacity(width, height, &base, &bc->opts) / 2;
+    bc->payload = make_payload(bc->payload_len, compressible);
+    bc->ecc_out = malloc(ecc_encoded_size(bc->payload_len, BENCH_ECC_PARITY));
+    if (!bc->cover_png || !bc->payload || !bc->ecc_out)
+        return 1;
+    if (stego_hide_memory(bc->ctx, bc->cover_png, bc->cover_png_len, bc->payload, bc->payload_len, "bin",
+                          (void **)&bc->stego_png, &bc->stego_png_len) != 0)
+        return 1;
+    int channels;
+    bc->stego_pixels = stbi_load_from_memory(bc->stego_png, bc->stego_png_len, &width, &height, &channels, 3);
+    return bc->stego_pixels ? 0 : 1;
+}
+
+static void free_case(bench_case_t *bc)
+{
+    free(bc->pixels);
+    free(bc->work);
+    STBIW_FREE(bc->cover_png);
+    free(bc->payload);
+    free(bc->ecc_out);
+    stbi_image_free(bc->stego_pixels);
+    if (bc->ctx)
+    {
+        stego_buffer_free(bc->ctx, bc->stego_png);
+        stego_ctx_free(bc->ctx);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int sizes = sizeof(bench_sizes) / sizeof(bench_sizes[0]);
+    const char *json = NULL, *baseline = NULL;
+    double threshold = 0.05;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--quick") == 0) // smallest cover only, for a smoke run
+            sizes = 1;
+        else if (strncmp(argv[i], "--json=", 7) == 0)
+            json = argv[i] + 7;
+        else if (strncmp(argv[i], "--compare=", 10) == 0)
+            baseline = argv[i] + 10;
+        else if (strncmp(argv[i], "--threshold=", 12) == 0)
+            threshold = atof(argv[i] + 12) / 100;
+        else
+        {
+            fprintf(stderr, "Usage: bench [--quick] [--json=<file>] [--compare=<baseline>] [--threshold=<percent>]\n");
+            return 1;
+        }
+    }
+
+    static bench_result_t base[BENCH_MAX_RESULTS], results[BENCH_MAX_RESULTS];
+    int base_count = baseline ? load_results(baseline, base, BENCH_MAX_RESULTS) : 0;
+    if (base_count < 0)
+        return 1;
+
+    static const struct
+    {
+        const char *name;
+        bench_fn fn;
+        int per_pixel; // throughput over raw pixel bytes instead of payload bytes
+    } stages[] = {
+        {"decode", bench_decode, 1}, {"embed", bench_embed, 0},       {"extract", bench_extract, 0},
+        {"encode", bench_encode, 1}, {"crc32c", bench_crc32c, 0},     {"rs-encode", bench_rs_encode, 0},
+        {"hide-e2e", bench_hide, 0}, {"extract-e2e", bench_unhide, 0},
+    };
+
+    printf("decode/encode bytes are raw RGB pixel bytes; the other stages count payload bytes\n\n");
+    printf("%-12s %-10s %-13s %10s %6s %11s %9s %9s %9s\n", "stage", "image", "payload", "bytes", "iters",
+           "median ms", "MAD ms", "MB/s", "ns/byte");
+    int failed = 0, count = 0;
+    for (int s = 0; s < sizes; s++)
+    {
+        for (int compressible = 0; compressible < 2; compressible++)
+        {
+            bench_case_t bc;
+            char image[16];
+            snprintf(image, sizeof(image), "%dx%d", bench_sizes[s].width, bench_sizes[s].height);
+            if (prepare_case(&bc, bench_sizes[s].width, bench_sizes[s].height, compressible) != 0)
+            {
+                fprintf(stderr, "Failed to prepare %s: %s\n", image, stego_last_error());
+                free_case(&bc);
+                return 1;
+            }
+            for (size_t i = 0; i < sizeof(stages) / sizeof(stages[0]) && count < BENCH_MAX_RESULTS; i++)
+            {
+                bench_result_t *r = &results[count];
+                memset(r, 0, sizeof(*r));
+                snprintf(r->stage, sizeof(r->stage), "%s", stages[i].name);
+                snprintf(r->image, sizeof(r->image), "%s", image);
+                snprintf(r->payload, sizeof(r->payload), "%s", compressible ? "compressible" : "random");
+                r->bytes = stages[i].per_pixel ? (size_t)bc.width * bc.height * 3 : bc.payload_len;
+                if (time_stage(stages[i].fn, &bc, r) != 0)
+                {
+                    fprintf(stderr, "%s failed on %s: %s\n", stages[i].name, image, stego_last_error());
+                    failed = 1;
+                    continue;
+                }
+                printf("%-12s %-10s %-13s %10zu %6d %11.3f %9.3f %9.1f %9.2f\n", r->stage, r->image, r->payload,
+                       r->bytes, r->iterations, r->median_ns / 1e6, r->mad_ns / 1e6, r->bytes / r->median_ns * 1e3,
+                       r->median_ns / r->bytes);
+                count++;
+            }
+            free_case(&bc);
+        }
+    }
+
+    if (json && save_results(json, results, count) != 0)
+        failed = 1;
+    if (baseline && compare_results(base, base_count, results, count, threshold) > 0)
+        failed = 1;
+    return failed;
+}
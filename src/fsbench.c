@@ -0,0 +1,332 @@
+// Mount benchmark, run with `make bench-fs`. Calls the timed inode
+// operations behind the low-level FUSE callbacks from several threads, the
+// way the session loop would, so the mount path can be measured without
+// /dev/fuse or a kernel mount. The tool is compiled in whole; only its main()
+// is left out.
+#define STEGO_NO_MAIN
+#pragma GCC diagnostic ignored "-Wunused-function" // CLI commands this driver does not call
+#include "steganography.c"
+
+#define FSB_MAX_THREADS 64
+#define FSB_MAX_SAMPLES (1 << 20) // latencies kept per thread; later ops are counted only
+
+typedef enum
+{
+    FSB_SEQ_READ,
+    FSB_RAND_READ,
+    FSB_SEQ_WRITE,
+    FSB_RAND_WRITE,
+    FSB_CHURN,
+    FSB_META,
+    FSB_MIXED,
+    FSB_WORKLOADS
+} fsb_workload_t;
+
+static const char *const fsb_names[FSB_WORKLOADS] = {"seq-read", "rand-read", "seq-write", "rand-write",
+                                                     "churn",    "meta",      "mixed"};
+
+typedef struct
+{
+    int threads;
+    double seconds;
+    size_t io_size;
+    size_t file_size;
+    int width;
+    int height;
+} fsb_config_t;
+
+typedef struct
+{
+    const fsb_config_t *config;
+    fsb_workload_t workload;
+    int id;
+    volatile int *stop;
+    struct fuse_file_info file; // /bench, open for the whole run so reads get read-ahead
+    fuse_ino_t churn;           // the file churn last created
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t *samples;
+    size_t sample_count;
+} fsb_thread_t;
+
+static uint64_t fsb_rand(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static fuse_ino_t fsb_bench; // inode of /bench
+
+static int fsb_filler(void *ctx, const char *name, fuse_ino_t ino, mode_t mode)
+{
+    (void)name, (void)ino, (void)mode;
+    (*(int *)ctx)++;
+    return 0;
+}
+
+// One operation of the workload; returns the op's result
+static int fsb_step(fsb_thread_t *t, uint64_t n, uint64_t *rng, char *buf)
+{
+    const fsb_config_t *c = t->config;
+    struct fuse_file_info fi = {0};
+    size_t blocks = c->file_size / c->io_size;
+    fsb_workload_t w = t->workload;
+    if (w == FSB_MIXED)
+        w = t->id % 2 ? FSB_RAND_WRITE : FSB_RAND_READ;
+
+    switch (w)
+    {
+    case FSB_SEQ_READ:
+        return timed_read(fsb_bench, buf, c->io_size, (n % blocks) * c->io_size, &t->file);
+    case FSB_RAND_READ:
+        return timed_read(fsb_bench, buf, c->io_size, (fsb_rand(rng) % blocks) * c->io_size, &t->file);
+    case FSB_SEQ_WRITE:
+        return timed_write(fsb_bench, buf, c->io_size, (n % blocks) * c->io_size, &fi);
+    case FSB_RAND_WRITE:
+        return timed_write(fsb_bench, buf, c->io_size, (fsb_rand(rng) % blocks) * c->io_size, &fi);
+    case FSB_CHURN:
+    {
+        // create, write one block, unlink: three ops per name
+        char name[64];
+        struct stat st;
+        snprintf(name, sizeof(name), "churn%d", t->id);
+        if (n % 3 == 0)
+        {
+            int r = timed_create(FUSE_ROOT_ID, name, S_IFREG | 0644, &fi, &st);
+            t->churn = r == 0 ? st.st_ino : 0;
+            timed_release(t->churn, &fi);
+            return r;
+        }
+        if (n % 3 == 1)
+            return timed_write(t->churn, buf, c->io_size, 0, &fi);
+        return timed_unlink(FUSE_ROOT_ID, name);
+    }
+    case FSB_META:
+    {
+        struct stat st, attr = {0};
+        int entries = 0;
+        switch (n % 5)
+        {
+        case 0:
+            return timed_getattr(fsb_bench, &st);
+        case 1:
+            return timed_lookup(FUSE_ROOT_ID, "missing", &st) == -ENOENT ? 0 : -EIO;
+        case 2:
+            return timed_readdir(FUSE_ROOT_ID, &entries, fsb_filler);
+        case 3:
+            attr.st_mtime = (time_t)n;
+            return timed_setattr(fsb_bench, &attr, FUSE_SET_ATTR_MTIME, &st);
+        default:
+            attr.st_mode = S_IFREG | 0644;
+            return timed_setattr(fsb_bench, &attr, FUSE_SET_ATTR_MODE, &st);
+        }
+    }
+    default:
+        return -EINVAL;
+    }
+}
+
+static void *fsb_worker(void *arg)
+{
+    fsb_thread_t *t = arg;
+    char *buf = malloc(t->config->io_size);
+    uint64_t rng = 0x9E3779B97F4A7C15ULL * (t->id + 1);
+    if (!buf || timed_open(fsb_bench, &t->file) != 0)
+    {
+        free(buf);
+        return NULL;
+    }
+    memset(buf, 0xA5, t->config->io_size);
+    for (uint64_t n = 0; !*t->stop; n++)
+    {
+        uint64_t start = fs_now_ns();
+        int r = fsb_step(t, n, &rng, buf);
+        uint64_t ns = fs_now_ns() - start;
+        t->ops++;
+        t->errors += r < 0;
+        if (t->sample_count < FSB_MAX_SAMPLES)
+            t->samples[t->sample_count++] = ns;
+    }
+    timed_release(fsb_bench, &t->file);
+    free(buf);
+    return NULL;
+}
+
+static int fsb_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Writes a noise cover to a temporary PNG for the filesystem to live in
+static int fsb_make_cover(const fsb_config_t *c, char *path, size_t path_size)
+{
+    snprintf(path, path_size, "/tmp/stego_fsbench_%ld.png", (long)getpid());
+    size_t bytes = (size_t)c->width * c->height * 3;
+    unsigned char *pixels = malloc(bytes);
+    if (!pixels)
+        return 1;
+    uint64_t rng = 0x2545F4914F6CDD1DULL;
+    for (size_t i = 0; i < bytes; i++)
+        pixels[i] = fsb_rand(&rng);
+    int r = write_image(path, pixels, c->width, c->height, 0);
+    free(pixels);
+    return r;
+}
+
+// Mounts the cover in-process and creates the file the I/O workloads use
+static int fsb_setup(const fsb_config_t *c, const char *cover)
+{
+    stego_options_t opts;
+    memset(&opts, 0, sizeof(opts));
+    memset(&stego_fs, 0, sizeof(stego_fs));
+    stego_fs.image_path = strdup(cover);
+    if (!stego_fs.image_path || init_stego_fs(stego_fs.image_path, &opts) != 0)
+        return 1;
+    stego_init(NULL);
+
+    struct fuse_file_info fi = {0};
+    struct stat st;
+    char *buf = calloc(1, c->io_size);
+    int r = buf ? timed_create(FUSE_ROOT_ID, "bench", S_IFREG | 0644, &fi, &st) : -ENOMEM;
+    fsb_bench = r == 0 ? st.st_ino : 0;
+    for (size_t off = 0; r >= 0 && off < c->file_size; off += c->io_size)
+        r = timed_write(fsb_bench, buf, c->io_size, off, &fi);
+    if (buf)
+        timed_release(fsb_bench, &fi);
+    free(buf);
+    return r < 0;
+}
+
+static int fsb_run(const fsb_config_t *c, fsb_workload_t workload)
+{
+    fsb_thread_t threads[FSB_MAX_THREADS];
+    pthread_t tids[FSB_MAX_THREADS];
+    volatile int stop = 0;
+    memset(threads, 0, sizeof(threads));
+    for (int i = 0; i < c->threads; i++)
+    {
+        threads[i] = (fsb_thread_t){c, workload, i, &stop, {0}, 0, 0, 0, malloc(FSB_MAX_SAMPLES * sizeof(uint64_t)), 0};
+        if (!threads[i].samples)
+            return 1;
+    }
+
+    uint64_t start = fs_now_ns();
+    for (int i = 0; i < c->threads; i++)
+        pthread_create(&tids[i], NULL, fsb_worker, &threads[i]);
+    struct timespec sleep_for = {(time_t)c->seconds, (long)((c->seconds - (time_t)c->seconds) * 1e9)};
+    nanosleep(&sleep_for, NULL);
+    stop = 1;
+    for (int i = 0; i < c->threads; i++)
+        pthread_join(tids[i], NULL);
+    double elapsed = (fs_now_ns() - start) / 1e9;
+
+    uint64_t ops = 0, errors = 0;
+    size_t count = 0;
+    for (int i = 0; i < c->threads; i++)
+    {
+        ops += threads[i].ops;
+        errors += threads[i].errors;
+        count += threads[i].sample_count;
+    }
+    uint64_t *all = malloc((count ? count : 1) * sizeof(uint64_t));
+    if (!all)
+        return 1;
+    for (int i = 0, n = 0; i < c->threads; i++)
+    {
+        memcpy(all + n, threads[i].samples, threads[i].sample_count * sizeof(uint64_t));
+        n += threads[i].sample_count;
+        free(threads[i].samples);
+    }
+    qsort(all, count, sizeof(uint64_t), fsb_compare);
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    fprintf(stderr, "%-10s %7d %12llu %8llu %12.0f", fsb_names[workload], c->threads, (unsigned long long)ops,
+            (unsigned long long)errors, ops / elapsed);
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+        fprintf(stderr, " %10.2f", count ? all[(size_t)(quantiles[q] * (count - 1))] / 1e3 : 0.0);
+    fprintf(stderr, "\n");
+    free(all);
+    return 0;
+}
+
+static void fsb_usage(void)
+{
+    fprintf(stderr, "Usage: fsbench [--workload=<name>] [--threads=<n>] [--seconds=<s>] [--io-size=<bytes>]\n");
+    fprintf(stderr, "               [--file-size=<bytes>] [--image=<w>x<h>]\n\n");
+    fprintf(stderr, "Workloads:");
+    for (int w = 0; w < FSB_WORKLOADS; w++)
+        fprintf(stderr, " %s", fsb_names[w]);
+    fprintf(stderr, " (default: all)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    fsb_config_t c = {4, 1.0, 4096, 256 * 1024, 1024, 1024};
+    int only = -1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--workload=", 11) == 0)
+        {
+            for (int w = 0; w < FSB_WORKLOADS; w++)
+                if (strcmp(argv[i] + 11, fsb_names[w]) == 0)
+                    only = w;
+            if (only < 0)
+            {
+                fsb_usage();
+                return 1;
+            }
+        }
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+            c.threads = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--seconds=", 10) == 0)
+            c.seconds = atof(argv[i] + 10);
+        else if (strncmp(argv[i], "--io-size=", 10) == 0)
+            c.io_size = strtoul(argv[i] + 10, NULL, 10);
+        else if (strncmp(argv[i], "--file-size=", 12) == 0)
+            c.file_size = strtoul(argv[i] + 12, NULL, 10);
+        else if (strncmp(argv[i], "--image=", 8) == 0)
+            sscanf(argv[i] + 8, "%dx%d", &c.width, &c.height);
+        else
+        {
+            fsb_usage();
+            return 1;
+        }
+    }
+    if (c.threads < 1 || c.threads > FSB_MAX_THREADS || c.seconds <= 0 || c.io_size == 0 ||
+        c.file_size < c.io_size || c.width <= 0 || c.height <= 0)
+    {
+        fprintf(stderr, "Invalid configuration\n");
+        return 1;
+    }
+    if (c.file_size + 1024 > (size_t)c.width * c.height * 3 / 8)
+    {
+        fprintf(stderr, "A %dx%d image cannot hold a %zu byte file\n", c.width, c.height, c.file_size);
+        return 1;
+    }
+
+    char cover[64];
+    if (fsb_make_cover(&c, cover, sizeof(cover)) != 0)
+        return 1;
+
+    fprintf(stderr, "%-10s %7s %12s %8s %12s %10s %10s %10s %10s\n", "workload", "threads", "ops", "errors",
+            "ops/s", "p50_us", "p90_us", "p99_us", "p99.9_us");
+    int r = 0;
+    for (int w = 0; w < FSB_WORKLOADS && r == 0; w++)
+    {
+        if (only >= 0 && w != only)
+            continue;
+        // A fresh filesystem per workload, so churn and writes do not skew the next one
+        r = fsb_setup(&c, cover);
+        if (r == 0)
+            r = fsb_run(&c, w);
+        else
+            fprintf(stderr, "Failed to set up the filesystem\n");
+        stego_fs.dirty = 0; // nothing to save, the cover is scratch
+        stego_destroy(NULL);
+    }
+
+    unlink(cover);
+    return r;
+}
@@ -1,9 +1,6 @@
 #define FUSE_USE_VERSION 26
-#define STB_IMAGE_IMPLEMENTATION
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image.h"
-#include "stb_image_write.h"
-#include <fuse.h>
+#define _GNU_SOURCE // fallocate, O_DIRECT
+#include "stego.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,799 +9,6709 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <stddef.h>
+#include <stdarg.h>
 #include <pthread.h>
 #include <sys/statvfs.h>
+#include <sys/mman.h>
 #include <libgen.h>
+#include <dirent.h>
+#include <limits.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+// Stage profiling. The hot paths are bracketed with stage_begin() and
+// stage_end(); while profiling is on, each bracket adds its wall time and,
+// with counters enabled, the calling thread's cycles, instructions, cache
+// misses and branch misses to a per-stage total. Counters are opened per
+// thread, so concurrent stripe workers are attributed exactly, and a stage
+// nested in another (the file writes inside PNG encoding) is only counted
+// once, in the inner stage. With tracing on, each bracket is also logged as
+// a timeline event. With everything off a bracket is one branch.
+typedef enum
+{
+    STAGE_DECODE,
+    STAGE_EMBED,
+    STAGE_EXTRACT,
+    STAGE_ENCODE,
+    STAGE_READ,
+    STAGE_WRITE,
+    STAGE_COUNT
+} stego_stage_t;
+
+// Only the CLI reports and the allocation profile name stages
+static const char *const stage_names[STAGE_COUNT] __attribute__((unused)) = {
+    "decode", "embed", "extract", "encode", "read", "write"};
+
+enum
+{
+    PERF_WALL_NS,
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTERS
+};
 
-#define BYTE_LENGTH 8
-#define MAX_FILE_SIZE (1024 * 1024 * 10)
-#define MAX_FILENAME_LENGTH 255
-#define MAX_FILES 256
-#define METADATA_START_OFFSET 32
+#define STAGE_PROFILE_TIME 0x01
+#define STAGE_PROFILE_COUNTERS 0x02
+#define STAGE_PROFILE_TRACE 0x04
+#define STAGE_PROFILE_ALLOC 0x08 // allocation profiling build only, see below
+
+typedef struct stage_frame
+{
+    struct stage_frame *parent;
+    stego_stage_t stage;
+    uint64_t start[PERF_COUNTERS];
+    uint64_t nested[PERF_COUNTERS]; // spent in inner stages
+} stage_frame_t;
+
+static int stage_profiling; // STAGE_PROFILE_* bits, set once before any work starts
+static pthread_mutex_t stage_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t stage_totals[STAGE_COUNT][PERF_COUNTERS];
+static uint64_t stage_calls[STAGE_COUNT];
+static __thread stage_frame_t *stage_current;
+
+// Trace events go to a fixed buffer per thread that only that thread
+// appends to; buffers are linked into a list once, outlive their threads and
+// are written out at exit. A full buffer drops further events.
+#define TRACE_EVENTS_PER_THREAD (1 << 16)
 
 typedef struct
 {
-    char name[MAX_FILENAME_LENGTH];
-    size_t size;
-    size_t offset;
-    time_t mtime;
-    mode_t mode;
-} stego_file_t;
+    uint64_t begin_ns;
+    uint64_t end_ns;
+    int stage;
+} trace_event_t;
+
+typedef struct trace_buffer
+{
+    struct trace_buffer *next;
+    long tid;
+    size_t count;
+    size_t dropped;
+    trace_event_t events[TRACE_EVENTS_PER_THREAD];
+} trace_buffer_t;
+
+static trace_buffer_t *trace_buffers;
+static __thread trace_buffer_t *trace_mine;
+static __thread int trace_failed;
+
+static void trace_record(stego_stage_t stage, uint64_t begin_ns, uint64_t end_ns)
+{
+    trace_buffer_t *b = trace_mine;
+    if (!b)
+    {
+        if (trace_failed || !(b = calloc(1, sizeof(*b))))
+        {
+            trace_failed = 1;
+            return;
+        }
+#ifdef __linux__
+        b->tid = syscall(SYS_gettid);
+#else
+        b->tid = (long)(uintptr_t)pthread_self();
+#endif
+        b->next = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&trace_buffers, &b->next, b, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        trace_mine = b;
+    }
+    if (b->count == TRACE_EVENTS_PER_THREAD)
+    {
+        b->dropped++;
+        return;
+    }
+    b->events[b->count] = (trace_event_t){begin_ns, end_ns, stage};
+    __atomic_store_n(&b->count, b->count + 1, __ATOMIC_RELEASE);
+}
 
+// Run totals for --stats, kept while profiling is on
 typedef struct
 {
-    unsigned char *image_data;
-    int width;
-    int height;
-    int channels;
-    char *image_path;
-    stego_file_t files[MAX_FILES];
-    size_t file_count;
-    size_t total_data_size;
-    pthread_mutex_t mutex;
-    int dirty;
-} stego_fs_t;
+    uint64_t images;       // carriers embedded into or extracted from
+    uint64_t payload_bytes;
+    uint64_t carrier_bits; // LSBs available in those carriers
+    uint64_t used_bits;    // header, payload and ECC bits written or read
+    uint64_t output_bytes; // images or files written
+} stage_stats_t;
 
-static stego_fs_t stego_fs;
+static stage_stats_t stage_stats;
 
-// Common structure for metadata
+static void stats_count_carrier(size_t payload_bytes, size_t used_bits, size_t carrier_bits)
+{
+    if (!(stage_profiling & STAGE_PROFILE_TIME))
+        return;
+    __atomic_add_fetch(&stage_stats.images, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stage_stats.payload_bytes, payload_bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stage_stats.used_bits, used_bits, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stage_stats.carrier_bits, carrier_bits, __ATOMIC_RELAXED);
+}
+
+static void stats_count_output(size_t bytes)
+{
+    if (stage_profiling & STAGE_PROFILE_TIME)
+        __atomic_add_fetch(&stage_stats.output_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+#ifdef __linux__
+// One counter group per thread, read with a single read(); counters the
+// CPU or hypervisor does not offer are left out of the group
 typedef struct
 {
-    uint32_t file_size;
-    uint8_t ext_length;
-    char extension[10];
-} file_metadata_t;
+    int fds[PERF_COUNTERS];  // fds[PERF_CYCLES] leads the group
+    int slot[PERF_COUNTERS]; // position in the group read, -1 when missing
+    int count;
+} perf_group_t;
+
+static __thread perf_group_t *perf_group;
+static pthread_key_t perf_key;
+static pthread_once_t perf_key_once = PTHREAD_ONCE_INIT;
+static int perf_warned;
+static int perf_counting; // some thread got its counters
+
+static void perf_group_close(void *arg)
+{
+    perf_group_t *group = arg;
+    for (int c = 0; c < PERF_COUNTERS; c++)
+        if (group->fds[c] >= 0)
+            close(group->fds[c]);
+    free(group);
+}
 
-static const char *get_file_name(const char *filename)
+static void perf_key_init(void)
 {
-    char *bname = basename(filename);
-    return bname;
+    pthread_key_create(&perf_key, perf_group_close);
 }
 
-static const char *get_file_extension(const char *filename)
+static int perf_open(uint64_t config, int leader)
 {
-    const char *dot = strrchr(filename, '.');
-    if (!dot || dot == filename)
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0 && (errno == EACCES || errno == EPERM))
     {
-        return "";
+        // perf_event_paranoid >= 2 only allows user space counting
+        attr.exclude_kernel = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
     }
-    return dot + 1;
+    return fd;
 }
 
-static void get_metadata_extension(const char *filename, char *ext_buf, size_t buf_size, uint8_t *ext_len)
+static perf_group_t *perf_group_get(void)
 {
-    const char *dot = strrchr(filename, '.');
-    if (!dot || dot == filename)
+    if (perf_group)
+        return perf_group;
+    pthread_once(&perf_key_once, perf_key_init);
+    perf_group_t *group = malloc(sizeof(*group));
+    if (!group)
+        return NULL;
+    static const uint64_t configs[PERF_COUNTERS] = {0, PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    group->count = 0;
+    for (int c = 0; c < PERF_COUNTERS; c++)
     {
-        ext_buf[0] = '\0';
-        *ext_len = 0;
-        return;
+        group->fds[c] = -1;
+        group->slot[c] = -1;
+        if (c == PERF_WALL_NS || (c != PERF_CYCLES && group->fds[PERF_CYCLES] < 0))
+            continue;
+        group->fds[c] = perf_open(configs[c], c == PERF_CYCLES ? -1 : group->fds[PERF_CYCLES]);
+        if (group->fds[c] >= 0)
+            group->slot[c] = group->count++;
     }
+    if (group->count > 0)
+        __atomic_store_n(&perf_counting, 1, __ATOMIC_RELAXED);
+    else if (!__atomic_exchange_n(&perf_warned, 1, __ATOMIC_RELAXED))
+        fprintf(stderr, "Hardware counters unavailable (%s), profiling wall time only\n", strerror(errno));
+    pthread_setspecific(perf_key, group);
+    perf_group = group;
+    return group;
+}
+#endif
 
-    dot++; // Skip the dot
-    *ext_len = strlen(dot);
-    if (*ext_len >= buf_size)
+static void stage_sample(uint64_t sample[PERF_COUNTERS])
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    memset(sample, 0, PERF_COUNTERS * sizeof(uint64_t));
+    sample[PERF_WALL_NS] = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#ifdef __linux__
+    perf_group_t *group = (stage_profiling & STAGE_PROFILE_COUNTERS) ? perf_group_get() : NULL;
+    uint64_t buf[3 + PERF_COUNTERS]; // nr, time enabled, time running, values
+    if (!group || group->count == 0 || read(group->fds[PERF_CYCLES], buf, sizeof(buf)) <= 0)
+        return;
+    for (int c = 0; c < PERF_COUNTERS; c++)
     {
-        *ext_len = buf_size - 1;
+        if (group->slot[c] < 0)
+            continue;
+        // Scale up counts from a group the kernel had to multiplex
+        uint64_t value = buf[3 + group->slot[c]];
+        sample[c] = buf[2] && buf[2] < buf[1] ? (uint64_t)((double)value * buf[1] / buf[2]) : value;
     }
-    strncpy(ext_buf, dot, *ext_len);
-    ext_buf[*ext_len] = '\0';
+#endif
 }
 
-static void embed_bit(unsigned char *data, int width, int height, size_t position, int bit)
+static void stage_begin(stage_frame_t *frame, stego_stage_t stage)
 {
-    size_t max_bits = width * height * 3;
-    if (position >= max_bits)
-    {
-        fprintf(stderr, "Position %zu exceeds maximum bits %zu\n", position, max_bits);
+    if (!stage_profiling)
         return;
-    }
-
-    size_t pixel_pos = position / 3;
-    size_t channel = position % 3;
-    data[(pixel_pos * 3) + channel] = (data[(pixel_pos * 3) + channel] & 0xFE) | bit;
+    frame->stage = stage;
+    frame->parent = stage_current;
+    memset(frame->nested, 0, sizeof(frame->nested));
+    stage_current = frame;
+    stage_sample(frame->start);
 }
 
-static int extract_bit(unsigned char *data, int width, int height, size_t position)
+static void stage_end(stage_frame_t *frame)
 {
-    size_t max_bits = width * height * 3;
-    if (position >= max_bits)
+    if (!stage_profiling)
+        return;
+    stego_stage_t stage = frame->stage;
+    uint64_t now[PERF_COUNTERS], self[PERF_COUNTERS];
+    stage_sample(now);
+    for (int c = 0; c < PERF_COUNTERS; c++)
     {
-        fprintf(stderr, "Position %zu exceeds maximum bits %zu\n", position, max_bits);
-        return 0;
+        uint64_t delta = now[c] > frame->start[c] ? now[c] - frame->start[c] : 0;
+        self[c] = delta > frame->nested[c] ? delta - frame->nested[c] : 0;
+        if (frame->parent)
+            frame->parent->nested[c] += delta;
     }
+    stage_current = frame->parent;
+    if (stage_profiling & STAGE_PROFILE_TRACE)
+        trace_record(stage, frame->start[PERF_WALL_NS], now[PERF_WALL_NS]);
+    if (!(stage_profiling & STAGE_PROFILE_TIME))
+        return;
+    pthread_mutex_lock(&stage_lock);
+    for (int c = 0; c < PERF_COUNTERS; c++)
+        stage_totals[stage][c] += self[c];
+    stage_calls[stage]++;
+    pthread_mutex_unlock(&stage_lock);
+}
 
-    size_t pixel_pos = position / 3;
-    size_t channel = position % 3;
-    return data[(pixel_pos * 3) + channel] & 1;
+#ifdef STEGO_ALLOC_PROFILE
+// Allocation profiling build (make allocprof). Every malloc, calloc,
+// realloc and free in this file, stb's through stego_malloc() included, is
+// routed through stb_leakcheck, which tags each block with its size and call
+// site. Blocks are charged to the innermost stage running on the thread
+// ("other" outside any stage); at exit the tool reports, per stage, the
+// number of allocations, the bytes requested, the peak of live bytes and
+// the largest blocks, then the blocks that were live at the overall peak and
+// any still live at exit. Pointers handed out by libc itself (strdup,
+// realpath, scandir) are not tagged and go straight to the real free().
+// Allocator struct members are called as (x->free)(...) so these macros
+// leave them alone.
+#define STB_LEAKCHECK_IMPLEMENTATION
+#define STB_LEAKCHECK_OUTPUT_PIPE stderr
+#include "stb_leakcheck.h"
+#undef malloc
+#undef free
+#undef realloc
+
+#define ALLOC_OTHER STAGE_COUNT // allocations outside any stage
+#define ALLOC_TOP 4             // largest blocks kept per stage and at the peak
+
+typedef struct
+{
+    size_t size;
+    const char *file;
+    int line;
+    int stage;
+} alloc_block_t;
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t bytes;
+    size_t live;
+    size_t peak;
+    alloc_block_t largest[ALLOC_TOP];
+} alloc_stage_t;
+
+// Open-addressing set of the blocks stb_leakcheck handed out, mapping each
+// to the stage it is charged to; a free of anything else is libc's own
+typedef struct
+{
+    void *ptr;
+    int stage;
+} alloc_slot_t;
+
+#define ALLOC_TOMBSTONE ((void *)1)
+
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static alloc_stage_t alloc_stages[STAGE_COUNT + 1];
+static alloc_slot_t *alloc_slots;
+static size_t alloc_capacity, alloc_used; // slots, slots holding a pointer or tombstone
+static size_t alloc_live, alloc_peak, alloc_snapshot_peak;
+static alloc_block_t alloc_at_peak[ALLOC_TOP];
+static __thread const char *alloc_site_file; // call site inside stb, see stb_malloc_at()
+static __thread int alloc_site_line;
+
+static const char *alloc_stage_name(int stage)
+{
+    return stage == ALLOC_OTHER ? "other" : stage_names[stage];
 }
 
-static void write_bits(size_t value, size_t num_bits, size_t *current_position)
+static stb_leakcheck_malloc_info *alloc_info(void *ptr)
 {
-    for (int i = num_bits - 1; i >= 0; i--)
+    return (stb_leakcheck_malloc_info *)ptr - 1;
+}
+
+static size_t alloc_hash(const void *ptr)
+{
+    return (size_t)(((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL);
+}
+
+static alloc_slot_t *alloc_find(const void *ptr)
+{
+    if (!alloc_capacity)
+        return NULL;
+    for (size_t i = alloc_hash(ptr) & (alloc_capacity - 1);; i = (i + 1) & (alloc_capacity - 1))
     {
-        embed_bit(stego_fs.image_data, stego_fs.width, stego_fs.height, *current_position, (value >> i) & 1);
-        (*current_position)++;
+        if (alloc_slots[i].ptr == ptr)
+            return &alloc_slots[i];
+        if (!alloc_slots[i].ptr)
+            return NULL;
     }
 }
 
-static size_t read_bits(size_t num_bits, size_t *current_position)
+static int alloc_insert(void *ptr, int stage)
 {
-    size_t value = 0;
-    for (size_t i = 0; i < num_bits; i++)
+    if ((alloc_used + 1) * 2 > alloc_capacity)
     {
-        value = (value << 1) | extract_bit(stego_fs.image_data, stego_fs.width, stego_fs.height, *current_position);
-        (*current_position)++;
+        // Rehash at half load, dropping tombstones
+        size_t capacity = alloc_capacity ? alloc_capacity * 2 : 4096;
+        alloc_slot_t *slots = (calloc)(capacity, sizeof(*slots)), *old = alloc_slots;
+        if (!slots)
+            return 1;
+        size_t old_capacity = alloc_capacity;
+        alloc_slots = slots, alloc_capacity = capacity, alloc_used = 0;
+        for (size_t i = 0; i < old_capacity; i++)
+            if (old[i].ptr && old[i].ptr != ALLOC_TOMBSTONE)
+                alloc_insert(old[i].ptr, old[i].stage);
+        (free)(old);
     }
-    return value;
+    size_t i = alloc_hash(ptr) & (alloc_capacity - 1);
+    while (alloc_slots[i].ptr && alloc_slots[i].ptr != ALLOC_TOMBSTONE)
+        i = (i + 1) & (alloc_capacity - 1);
+    alloc_used += !alloc_slots[i].ptr;
+    alloc_slots[i] = (alloc_slot_t){ptr, stage};
+    return 0;
 }
 
-static void save_filesystem() {
-    if (!stego_fs.dirty) return;
-
-    size_t position = 0;
-    uint32_t magic = 0x5354454;
+// Keeps `top` as the ALLOC_TOP largest blocks, largest first
+static void alloc_rank(alloc_block_t top[ALLOC_TOP], alloc_block_t block)
+{
+    int i = ALLOC_TOP;
+    while (i > 0 && top[i - 1].size < block.size)
+        i--;
+    if (i == ALLOC_TOP)
+        return;
+    memmove(&top[i + 1], &top[i], (ALLOC_TOP - 1 - i) * sizeof(*top));
+    top[i] = block;
+}
 
-    // Write magic number
-    for (int i = 31; i >= 0; i--) {
-        embed_bit(stego_fs.image_data, stego_fs.width, stego_fs.height, 
-                 position++, (magic >> i) & 1);
+// Records the largest live blocks once the peak has grown by 1/16 since the
+// last snapshot, so steadily growing buffers do not walk the list each time
+static void alloc_snapshot(void)
+{
+    if (alloc_peak < alloc_snapshot_peak + alloc_snapshot_peak / 16)
+        return;
+    alloc_snapshot_peak = alloc_peak;
+    memset(alloc_at_peak, 0, sizeof(alloc_at_peak));
+    for (stb_leakcheck_malloc_info *mi = mi_head; mi; mi = mi->next)
+    {
+        alloc_slot_t *slot = alloc_find(mi + 1);
+        alloc_rank(alloc_at_peak, (alloc_block_t){mi->size, mi->file, mi->line, slot ? slot->stage : ALLOC_OTHER});
     }
+}
 
-    // Write file size
-    size_t file_size = stego_fs.files[0].size;
-    for (int i = 31; i >= 0; i--) {
-        embed_bit(stego_fs.image_data, stego_fs.width, stego_fs.height,
-                 position++, (file_size >> i) & 1);
+static void alloc_track(void *ptr, const char *file, int line)
+{
+    int stage = stage_current ? (int)stage_current->stage : ALLOC_OTHER;
+    stb_leakcheck_malloc_info *mi = alloc_info(ptr);
+    if (alloc_site_file)
+    {
+        // Attribute stb's blocks to the line in stb that asked for them
+        mi->file = file = alloc_site_file;
+        mi->line = line = alloc_site_line;
     }
-
-    // Write minimal extension info
-    uint8_t ext_length = 0;
-    for (int i = 7; i >= 0; i--) {
-        embed_bit(stego_fs.image_data, stego_fs.width, stego_fs.height,
-                 position++, 0);
+    alloc_insert(ptr, stage);
+    alloc_stage_t *s = &alloc_stages[stage];
+    s->count++;
+    s->bytes += mi->size;
+    s->live += mi->size;
+    if (s->live > s->peak)
+        s->peak = s->live;
+    alloc_rank(s->largest, (alloc_block_t){mi->size, file, line, stage});
+    alloc_live += mi->size;
+    if (alloc_live > alloc_peak)
+    {
+        alloc_peak = alloc_live;
+        alloc_snapshot();
     }
+}
 
-    printf("Saving file size: %zu bytes\n", file_size);
-    stbi_write_png(stego_fs.image_path, stego_fs.width, stego_fs.height, 
-                   3, stego_fs.image_data, stego_fs.width * 3);
-    stego_fs.dirty = 0;
+// Takes a tracked block out of the live totals; 0 if `ptr` is libc's own
+static int alloc_untrack(void *ptr)
+{
+    alloc_slot_t *slot = alloc_find(ptr);
+    if (!slot)
+        return 0;
+    size_t size = alloc_info(ptr)->size;
+    alloc_stages[slot->stage].live -= size;
+    alloc_live -= size;
+    slot->ptr = ALLOC_TOMBSTONE;
+    return 1;
 }
 
-static void *stego_init(struct fuse_conn_info *conn)
+static void *alloc_profile_malloc(size_t size, const char *file, int line)
 {
-    pthread_mutex_init(&stego_fs.mutex, NULL);
-    return NULL;
+    pthread_mutex_lock(&alloc_lock);
+    void *ptr = stb_leakcheck_malloc(size, file, line);
+    if (ptr)
+        alloc_track(ptr, file, line);
+    pthread_mutex_unlock(&alloc_lock);
+    return ptr;
 }
 
-static void stego_destroy(void *private_data)
+static void *alloc_profile_calloc(size_t count, size_t size, const char *file, int line)
 {
-    pthread_mutex_lock(&stego_fs.mutex);
-    save_filesystem();
-    stbi_image_free(stego_fs.image_data);
-    free(stego_fs.image_path);
-    pthread_mutex_unlock(&stego_fs.mutex);
-    pthread_mutex_destroy(&stego_fs.mutex);
+    if (size && count > SIZE_MAX / size)
+        return NULL;
+    void *ptr = alloc_profile_malloc(count * size, file, line);
+    if (ptr)
+        memset(ptr, 0, count * size);
+    return ptr;
 }
 
-static int stego_getattr(const char *path, struct stat *stbuf)
+static void alloc_profile_free(void *ptr)
 {
-    pthread_mutex_lock(&stego_fs.mutex);
-    memset(stbuf, 0, sizeof(struct stat));
+    if (!ptr)
+        return;
+    pthread_mutex_lock(&alloc_lock);
+    int tracked = alloc_untrack(ptr);
+    if (tracked)
+        stb_leakcheck_free(ptr);
+    pthread_mutex_unlock(&alloc_lock);
+    if (!tracked)
+        (free)(ptr);
+}
 
-    if (strcmp(path, "/") == 0)
+static void *alloc_profile_realloc(void *ptr, size_t size, const char *file, int line)
+{
+    if (!ptr)
+        return alloc_profile_malloc(size, file, line);
+    pthread_mutex_lock(&alloc_lock);
+    if (!alloc_find(ptr))
     {
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-        pthread_mutex_unlock(&stego_fs.mutex);
-        return 0;
+        pthread_mutex_unlock(&alloc_lock);
+        return (realloc)(ptr, size);
     }
-
-    path++;
-    for (size_t i = 0; i < stego_fs.file_count; i++)
+    // stb_leakcheck keeps a block that shrinks; one that grows is a new
+    // allocation at this call site
+    void *grown = ptr;
+    if (size > alloc_info(ptr)->size)
     {
-        if (strcmp(path, stego_fs.files[i].name) == 0)
+        grown = stb_leakcheck_malloc(size, file, line);
+        if (grown)
         {
-            stbuf->st_mode = stego_fs.files[i].mode;
-            stbuf->st_nlink = 1;
-            stbuf->st_size = stego_fs.files[i].size;
-            stbuf->st_mtime = stego_fs.files[i].mtime;
-            pthread_mutex_unlock(&stego_fs.mutex);
-            return 0;
+            memcpy(grown, ptr, alloc_info(ptr)->size);
+            alloc_untrack(ptr);
+            stb_leakcheck_free(ptr);
+            alloc_track(grown, file, line);
         }
     }
+    pthread_mutex_unlock(&alloc_lock);
+    return grown;
+}
 
-    pthread_mutex_unlock(&stego_fs.mutex);
-    return -ENOENT;
+static void alloc_profile_report(void)
+{
+    pthread_mutex_lock(&alloc_lock);
+    fprintf(stderr, "\n%-8s %10s %14s %14s  %s\n", "stage", "allocs", "bytes", "peak_live", "largest");
+    for (int s = 0; s <= STAGE_COUNT; s++)
+    {
+        alloc_stage_t *a = &alloc_stages[s];
+        if (!a->count)
+            continue;
+        fprintf(stderr, "%-8s %10llu %14llu %14zu ", alloc_stage_name(s), (unsigned long long)a->count,
+                (unsigned long long)a->bytes, a->peak);
+        for (int i = 0; i < ALLOC_TOP && a->largest[i].size; i++)
+            fprintf(stderr, " %zu (%s:%d)", a->largest[i].size, a->largest[i].file, a->largest[i].line);
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "\nPeak live: %zu bytes; largest blocks near the peak:\n", alloc_peak);
+    for (int i = 0; i < ALLOC_TOP && alloc_at_peak[i].size; i++)
+        fprintf(stderr, "  %14zu  %-8s %s:%d\n", alloc_at_peak[i].size, alloc_stage_name(alloc_at_peak[i].stage),
+                alloc_at_peak[i].file, alloc_at_peak[i].line);
+    size_t blocks = 0;
+    for (stb_leakcheck_malloc_info *mi = mi_head; mi; mi = mi->next)
+        blocks++;
+    fprintf(stderr, "Live at exit: %zu blocks, %zu bytes\n", blocks, alloc_live);
+    if (getenv("STEGO_ALLOC_LEAKS"))
+        stb_leakcheck_dumpmem();
+    pthread_mutex_unlock(&alloc_lock);
 }
 
-static int stego_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                         off_t offset, struct fuse_file_info *fi)
+#define malloc(size) alloc_profile_malloc(size, __FILE__, __LINE__)
+#define calloc(count, size) alloc_profile_calloc(count, size, __FILE__, __LINE__)
+#define realloc(ptr, size) alloc_profile_realloc(ptr, size, __FILE__, __LINE__)
+#define free(ptr) alloc_profile_free(ptr)
+#endif
+
+// Every buffer, stb's included, comes from the calling thread's allocator;
+// with none installed (the CLI) these are plain malloc/realloc/free
+static __thread const stego_allocator_t *stego_allocator;
+
+// A worker that runs job after job can also install an arena: one big
+// mapping carved up with a bump pointer and reset between jobs, so decoded
+// pixels, inflate buffers and PNG writer buffers reuse the same (already
+// faulted-in, optionally huge) pages instead of churning the heap. Blocks
+// carry a small size header; freeing or growing the newest block works in
+// place, anything else is reclaimed at reset. When the arena is full,
+// allocations fall through to the allocator above.
+#define ARENA_HEADER 16
+#define ARENA_DEFAULT_RESERVE ((size_t)1 << 30) // address space only, pages are touched on use
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+typedef struct
 {
-    if (strcmp(path, "/") != 0)
-        return -ENOENT;
+    unsigned char *base;
+    size_t size;
+    size_t used;
+    size_t last; // header offset of the newest block
+} stego_arena_t;
 
-    pthread_mutex_lock(&stego_fs.mutex);
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+static __thread stego_arena_t *stego_arena;
 
-    for (size_t i = 0; i < stego_fs.file_count; i++)
+static stego_arena_t *arena_create(size_t reserve, int huge_pages)
+{
+    stego_arena_t *arena = calloc(1, sizeof(*arena));
+    if (!arena)
+        return NULL;
+    reserve = (reserve + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    // hugetlb pages must be reserved up front (without MAP_NORESERVE a short
+    // pool fails here instead of raising SIGBUS on first touch)
+    void *base = MAP_FAILED;
+    if (huge_pages)
+        base = mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        // Otherwise ask for transparent huge pages
+        base = mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base != MAP_FAILED && huge_pages)
+            madvise(base, reserve, MADV_HUGEPAGE);
+    }
+    if (base == MAP_FAILED)
     {
-        filler(buf, stego_fs.files[i].name, NULL, 0);
+        free(arena);
+        return NULL;
     }
+    arena->base = base;
+    arena->size = reserve;
+    return arena;
+}
 
-    pthread_mutex_unlock(&stego_fs.mutex);
-    return 0;
+static void arena_destroy(void *arg)
+{
+    stego_arena_t *arena = arg;
+    if (!arena)
+        return;
+    munmap(arena->base, arena->size);
+    free(arena);
 }
 
-static int stego_open(const char *path, struct fuse_file_info *fi)
+static void arena_reset(stego_arena_t *arena)
 {
-    pthread_mutex_lock(&stego_fs.mutex);
-    path++;
+    arena->used = 0;
+}
 
-    for (size_t i = 0; i < stego_fs.file_count; i++)
-    {
-        if (strcmp(path, stego_fs.files[i].name) == 0)
-        {
-            pthread_mutex_unlock(&stego_fs.mutex);
-            return 0;
-        }
-    }
+static int arena_owns(const stego_arena_t *arena, const void *ptr)
+{
+    return arena && (const unsigned char *)ptr >= arena->base && (const unsigned char *)ptr < arena->base + arena->size;
+}
 
-    pthread_mutex_unlock(&stego_fs.mutex);
-    return -ENOENT;
+static void *arena_alloc(stego_arena_t *arena, size_t size)
+{
+    size_t need = ARENA_HEADER + ((size + 15) & ~(size_t)15);
+    if (size > arena->size || need > arena->size - arena->used)
+        return NULL;
+    unsigned char *block = arena->base + arena->used;
+    memcpy(block, &size, sizeof(size));
+    arena->last = arena->used;
+    arena->used += need;
+    return block + ARENA_HEADER;
 }
 
-static int stego_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+static size_t arena_block_size(const void *ptr)
 {
-    pthread_mutex_lock(&stego_fs.mutex);
+    size_t size;
+    memcpy(&size, (const unsigned char *)ptr - ARENA_HEADER, sizeof(size));
+    return size;
+}
 
-    if (stego_fs.file_count >= MAX_FILES)
-    {
-        pthread_mutex_unlock(&stego_fs.mutex);
-        return -ENOSPC;
-    }
+static int arena_is_last(const stego_arena_t *arena, const void *ptr)
+{
+    return arena->used > 0 && (const unsigned char *)ptr == arena->base + arena->last + ARENA_HEADER;
+}
 
-    const char *filename = path + 1;
-    stego_file_t *new_file = &stego_fs.files[stego_fs.file_count];
+static void *heap_malloc(size_t size)
+{
+    return stego_allocator ? (stego_allocator->malloc)(stego_allocator->user, size) : malloc(size);
+}
 
-    strncpy(new_file->name, filename, MAX_FILENAME_LENGTH - 1);
-    new_file->size = 0;
-    new_file->offset = stego_fs.total_data_size;
-    new_file->mtime = time(NULL);
-    new_file->mode = mode;
+static void *stego_malloc(size_t size)
+{
+    void *ptr = stego_arena ? arena_alloc(stego_arena, size) : NULL;
+    return ptr ? ptr : heap_malloc(size);
+}
 
-    stego_fs.file_count++;
-    stego_fs.dirty = 1;
+static void *stego_realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        return stego_malloc(size);
+    if (!arena_owns(stego_arena, ptr))
+        return stego_allocator ? (stego_allocator->realloc)(stego_allocator->user, ptr, size) : realloc(ptr, size);
 
-    pthread_mutex_unlock(&stego_fs.mutex);
-    return 0;
+    size_t old = arena_block_size(ptr);
+    if (arena_is_last(stego_arena, ptr))
+    {
+        // The newest block grows or shrinks in place
+        size_t start = stego_arena->last;
+        stego_arena->used = start;
+        if (arena_alloc(stego_arena, size))
+            return ptr;
+        stego_arena->used = start + ARENA_HEADER + ((old + 15) & ~(size_t)15);
+    }
+    void *grown = stego_malloc(size);
+    if (grown)
+        memcpy(grown, ptr, old < size ? old : size);
+    return grown;
 }
 
-static int stego_write(const char *path, const char *buf, size_t size, off_t offset,
-                      struct fuse_file_info *fi) {
-    pthread_mutex_lock(&stego_fs.mutex);
-    
-    path++;
-    stego_file_t *file = NULL;
-    
-    for (size_t i = 0; i < stego_fs.file_count; i++) {
-        if (strcmp(path, stego_fs.files[i].name) == 0) {
-            file = &stego_fs.files[i];
-            break;
-        }
-    }
-    
-    if (!file) {
-        pthread_mutex_unlock(&stego_fs.mutex);
-        return -ENOENT;
+static void stego_free(void *ptr)
+{
+    if (arena_owns(stego_arena, ptr))
+    {
+        if (arena_is_last(stego_arena, ptr))
+            stego_arena->used = stego_arena->last;
+        return;
     }
+    if (stego_allocator)
+        (stego_allocator->free)(stego_allocator->user, ptr);
+    else
+        free(ptr);
+}
 
-    printf("Writing %zu bytes at offset %ld\n", size, offset);
-    
-    // Calculate new file size
-    size_t new_size = offset + size;
-    file->size = new_size > file->size ? new_size : file->size;
+// Failures are kept per thread for stego_last_error(); the CLI also prints them
+static __thread char stego_error_message[256];
 
-    // Write data at correct bit position
-    size_t bit_position = METADATA_START_OFFSET + (offset * 8);
-    for (size_t i = 0; i < size; i++) {
-        for (int j = 7; j >= 0; j--) {
-            embed_bit(stego_fs.image_data, stego_fs.width, stego_fs.height,
-                     bit_position++, (buf[i] >> j) & 1);
-        }
-    }
-    
-    file->mtime = time(NULL);
-    stego_fs.dirty = 1;
-    
-    pthread_mutex_unlock(&stego_fs.mutex);
-    return size;
+static void stego_error(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(stego_error_message, sizeof(stego_error_message), fmt, ap);
+    va_end(ap);
+    size_t len = strlen(stego_error_message);
+    if (len && stego_error_message[len - 1] == '\n')
+        stego_error_message[len - 1] = '\0';
+#ifndef STEGO_LIBRARY
+    fprintf(stderr, "%s\n", stego_error_message);
+#endif
 }
 
-static int stego_read(const char *path, char *buf, size_t size, off_t offset,
-                      struct fuse_file_info *fi)
+#ifndef STEGO_LIBRARY
+// Progress goes to stderr instead when stdout carries an image or payload
+static FILE *stego_info_stream;
+#endif
+
+static void stego_info(const char *fmt, ...)
 {
-    pthread_mutex_lock(&stego_fs.mutex);
+#ifndef STEGO_LIBRARY
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stego_info_stream ? stego_info_stream : stdout, fmt, ap);
+    va_end(ap);
+#else
+    (void)fmt;
+#endif
+}
 
-    path++;
-    stego_file_t *file = NULL;
+#ifdef STEGO_ALLOC_PROFILE
+// Charges stb's blocks to the line in stb_image.h or stb_image_write.h that
+// asked for them rather than to stego_malloc()
+static void *stb_malloc_at(size_t size, const char *file, int line)
+{
+    alloc_site_file = file, alloc_site_line = line;
+    void *ptr = stego_malloc(size);
+    alloc_site_file = NULL;
+    return ptr;
+}
 
-    for (size_t i = 0; i < stego_fs.file_count; i++)
+static void *stb_realloc_at(void *ptr, size_t size, const char *file, int line)
+{
+    alloc_site_file = file, alloc_site_line = line;
+    ptr = stego_realloc(ptr, size);
+    alloc_site_file = NULL;
+    return ptr;
+}
+
+#define STBI_MALLOC(sz) stb_malloc_at(sz, __FILE__, __LINE__)
+#define STBI_REALLOC(p, newsz) stb_realloc_at(p, newsz, __FILE__, __LINE__)
+#define STBIW_MALLOC(sz) stb_malloc_at(sz, __FILE__, __LINE__)
+#define STBIW_REALLOC(p, newsz) stb_realloc_at(p, newsz, __FILE__, __LINE__)
+#else
+#define STBI_MALLOC(sz) stego_malloc(sz)
+#define STBI_REALLOC(p, newsz) stego_realloc(p, newsz)
+#define STBIW_MALLOC(sz) stego_malloc(sz)
+#define STBIW_REALLOC(p, newsz) stego_realloc(p, newsz)
+#endif
+#define STBI_FREE(p) stego_free(p)
+#define STBIW_FREE(p) stego_free(p)
+#ifdef STEGO_LIBRARY
+// Keep stb internal so a program linking libstego.a can bring its own copy;
+// the library only calls a few of its functions
+#define STB_IMAGE_STATIC
+#define STB_IMAGE_WRITE_STATIC
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#endif
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image.h"
+#include "stb_image_write.h"
+#ifdef STEGO_LIBRARY
+#pragma GCC diagnostic pop
+#endif
+#ifndef STEGO_LIBRARY
+#include <fuse_lowlevel.h>
+#include <zlib.h>
+#endif
+
+#define BYTE_LENGTH 8
+#define MAX_FILE_SIZE (1024 * 1024 * 10)
+#define MAX_FILENAME_LENGTH 255
+#define MAX_FILES 256
+#define METADATA_START_OFFSET 32
+
+#define STEGO_MAGIC 0x5354454     // Original header: no flags field
+#define STEGO_MAGIC_V2 0x53544732 // "STG2": header carries a flags byte
+#define STEGO_SALT_LENGTH 16
+#define STEGO_KDF_ITERATIONS 100000
+
+typedef struct
+{
+    int enabled;
+    uint32_t key[8];
+} stego_cipher_t;
+
+typedef struct
+{
+    int enabled;
+    uint64_t keys[4];
+    size_t domain;  // carrier bits available after the header
+    size_t nblocks; // full blocks; the remainder is permuted as one tail block
+} stego_scatter_t;
+
+// Common structure for metadata
+typedef struct
+{
+    uint32_t magic;
+    uint8_t flags;
+    uint8_t ecc_parity;
+    uint32_t checksum;
+    uint32_t file_size;
+    uint8_t ext_length;
+    char extension[11];
+    uint8_t salt[STEGO_SALT_LENGTH];
+    uint8_t stripe_index;
+    uint8_t stripe_count;
+    uint32_t total_size;
+    uint32_t set_id;
+    uint8_t parity_count;
+} file_metadata_t;
+
+#ifndef STEGO_LIBRARY
+typedef struct
+{
+    char name[MAX_FILENAME_LENGTH];
+    size_t size;
+    size_t offset;
+    time_t mtime;
+    mode_t mode;
+    uint64_t version; // changes whenever the contents do; read-ahead buffers check it
+    uint64_t id;      // fixed while the file exists; keys the page cache
+} stego_file_t;
+
+typedef struct png_bands png_bands_t;
+
+typedef struct
+{
+    unsigned char *image_data;
+    png_bands_t *bands; // decodes image_data on demand; NULL when stbi decoded it whole
+    int width;
+    int height;
+    int channels;
+    char *image_path;
+    stego_file_t files[MAX_FILES];
+    size_t file_count;
+    uint64_t versions; // source of stego_file_t.version and .id
+    pthread_mutex_t mutex;
+    int dirty;
+    file_metadata_t metadata;
+    stego_cipher_t cipher;
+    stego_scatter_t scatter;
+    const char *passphrase; // rekeys encrypted images on every save
+} stego_fs_t;
+
+static stego_fs_t stego_fs;
+#endif
+
+// Options shared by hide, extract and mount
+typedef struct
+{
+    const char *passphrase;
+    int scatter;
+    int ecc_parity;
+    int parity;
+    const char *pool;
+    const char *output;
+    int direct_io;
+    int huge_pages;
+    int perf;          // print per-stage hardware counters at exit
+    int stats;         // print a JSON summary of each hide/extract
+    const char *trace; // Chrome trace file written at exit
+} stego_options_t;
+
+#ifndef STEGO_LIBRARY
+static const char *get_file_name(const char *filename)
+{
+    char *bname = basename(filename);
+    return bname;
+}
+
+static const char *get_file_extension(const char *filename)
+{
+    const char *dot = strrchr(filename, '.');
+    if (!dot || dot == filename)
+    {
+        return "";
+    }
+    return dot + 1;
+}
+
+static void get_metadata_extension(const char *filename, char *ext_buf, size_t buf_size, uint8_t *ext_len)
+{
+    const char *dot = strrchr(filename, '.');
+    if (!dot || dot == filename)
+    {
+        ext_buf[0] = '\0';
+        *ext_len = 0;
+        return;
+    }
+
+    dot++; // Skip the dot
+    *ext_len = strlen(dot);
+    if (*ext_len >= buf_size)
+    {
+        *ext_len = buf_size - 1;
+    }
+    strncpy(ext_buf, dot, *ext_len);
+    ext_buf[*ext_len] = '\0';
+}
+#endif
+
+// SHA-256: the PRF behind the passphrase KDF, and the chunk store key
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} sha256_ctx_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha256_compress(uint32_t state[8], const unsigned char block[64])
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+static void sha256_init(sha256_ctx_t *ctx)
+{
+    static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+static void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    ctx->length += len;
+    while (len > 0)
+    {
+        size_t n = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, p, n);
+        ctx->used += n;
+        p += n;
+        len -= n;
+        if (ctx->used == 64)
+        {
+            sha256_compress(ctx->state, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+static void sha256_final(sha256_ctx_t *ctx, unsigned char digest[32])
+{
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad = 0x80;
+    sha256_update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->used != 56)
+    {
+        sha256_update(ctx, &pad, 1);
+    }
+    unsigned char len_be[8];
+    for (int i = 0; i < 8; i++)
+    {
+        len_be[i] = bits >> (56 - i * 8);
+    }
+    sha256_update(ctx, len_be, 8);
+    for (int i = 0; i < 8; i++)
+    {
+        digest[i * 4] = ctx->state[i] >> 24;
+        digest[i * 4 + 1] = ctx->state[i] >> 16;
+        digest[i * 4 + 2] = ctx->state[i] >> 8;
+        digest[i * 4 + 3] = ctx->state[i];
+    }
+}
+
+// PBKDF2-HMAC-SHA256 with a single output block (32 bytes)
+static void pbkdf2_sha256(const char *passphrase, const uint8_t *salt, size_t salt_len,
+                          unsigned iterations, unsigned char out[32])
+{
+    unsigned char key[64] = {0};
+    size_t pass_len = strlen(passphrase);
+    if (pass_len > 64)
+    {
+        sha256_ctx_t kc;
+        sha256_init(&kc);
+        sha256_update(&kc, passphrase, pass_len);
+        sha256_final(&kc, key);
+    }
+    else
+    {
+        memcpy(key, passphrase, pass_len);
+    }
+
+    unsigned char ipad[64], opad[64];
+    for (int i = 0; i < 64; i++)
+    {
+        ipad[i] = key[i] ^ 0x36;
+        opad[i] = key[i] ^ 0x5c;
+    }
+
+    // The padded key blocks are the same for every iteration, so hash them once
+    sha256_ctx_t inner_base, outer_base;
+    sha256_init(&inner_base);
+    sha256_update(&inner_base, ipad, 64);
+    sha256_init(&outer_base);
+    sha256_update(&outer_base, opad, 64);
+
+    const unsigned char block_index[4] = {0, 0, 0, 1};
+    unsigned char u[32];
+    sha256_ctx_t c = inner_base;
+    sha256_update(&c, salt, salt_len);
+    sha256_update(&c, block_index, 4);
+    sha256_final(&c, u);
+    c = outer_base;
+    sha256_update(&c, u, 32);
+    sha256_final(&c, u);
+    memcpy(out, u, 32);
+
+    for (unsigned it = 1; it < iterations; it++)
+    {
+        c = inner_base;
+        sha256_update(&c, u, 32);
+        sha256_final(&c, u);
+        c = outer_base;
+        sha256_update(&c, u, 32);
+        sha256_final(&c, u);
+        for (int i = 0; i < 32; i++)
+        {
+            out[i] ^= u[i];
+        }
+    }
+}
+
+static void cipher_init(stego_cipher_t *cipher, const char *passphrase, const uint8_t salt[STEGO_SALT_LENGTH])
+{
+    unsigned char key[32];
+    pbkdf2_sha256(passphrase, salt, STEGO_SALT_LENGTH, STEGO_KDF_ITERATIONS, key);
+    for (int i = 0; i < 8; i++)
+    {
+        cipher->key[i] = (uint32_t)key[i * 4] | ((uint32_t)key[i * 4 + 1] << 8) |
+                         ((uint32_t)key[i * 4 + 2] << 16) | ((uint32_t)key[i * 4 + 3] << 24);
+    }
+    cipher->enabled = 1;
+    memset(key, 0, sizeof(key));
+}
+
+static int random_bytes(uint8_t *buf, size_t len)
+{
+    FILE *f = fopen("/dev/urandom", "rb");
+    if (!f)
+        return -1;
+    size_t n = fread(buf, 1, len, f);
+    fclose(f);
+    return n == len ? 0 : -1;
+}
+
+#define CHACHA_QR(a, b, c, d) \
+    a += b;                   \
+    d = ROTL32(d ^ a, 16);    \
+    c += d;                   \
+    b = ROTL32(b ^ c, 12);    \
+    a += b;                   \
+    d = ROTL32(d ^ a, 8);     \
+    c += d;                   \
+    b = ROTL32(b ^ c, 7);
+
+// ChaCha20 (RFC 8439) keystream block. Every image, and every save of a
+// mounted one, gets a fresh salt and so a fresh key, which lets the nonce stay
+// zero; the block counter is the payload byte offset / 64, so any part of the
+// payload can be decrypted on its own.
+static void chacha20_block(const stego_cipher_t *cipher, uint32_t counter, uint32_t out[16])
+{
+    uint32_t x[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+                      cipher->key[0], cipher->key[1], cipher->key[2], cipher->key[3],
+                      cipher->key[4], cipher->key[5], cipher->key[6], cipher->key[7],
+                      counter, 0, 0, 0};
+    uint32_t s[16];
+    memcpy(s, x, sizeof(x));
+    for (int i = 0; i < 10; i++)
+    {
+        CHACHA_QR(x[0], x[4], x[8], x[12]);
+        CHACHA_QR(x[1], x[5], x[9], x[13]);
+        CHACHA_QR(x[2], x[6], x[10], x[14]);
+        CHACHA_QR(x[3], x[7], x[11], x[15]);
+        CHACHA_QR(x[0], x[5], x[10], x[15]);
+        CHACHA_QR(x[1], x[6], x[11], x[12]);
+        CHACHA_QR(x[2], x[7], x[8], x[13]);
+        CHACHA_QR(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        out[i] = x[i] + s[i];
+    }
+}
+
+// CRC32C (Castagnoli), updated incrementally by the embed/extract loops.
+// Uses the SSE4.2 crc32 instruction when available, slicing-by-8 otherwise.
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_tables(void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++)
+        {
+            c = (c >> 1) ^ (0x82f63b78 & -(c & 1));
+        }
+        crc32c_table[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        for (int t = 1; t < 8; t++)
+        {
+            uint32_t c = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (c >> 8) ^ crc32c_table[0][c & 0xff];
+        }
+    }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len >= 8)
+    {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+        uint32_t hi = (uint32_t)p[4] | ((uint32_t)p[5] << 8) | ((uint32_t)p[6] << 16) | ((uint32_t)p[7] << 24);
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+    {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t c = crc;
+    while (len >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = c;
+    while (len--)
+    {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+// CPU features, resolved once before any thread can ask for them
+static int has_sse42, has_ssse3;
+
+__attribute__((constructor)) static void cpu_features_init(void)
+{
+    __builtin_cpu_init();
+    has_sse42 = __builtin_cpu_supports("sse4.2");
+    has_ssse3 = __builtin_cpu_supports("ssse3");
+}
+#endif
+
+// Chainable: start from 0 and feed the result of the previous call
+static uint32_t crc32c_update(uint32_t crc, const unsigned char *p, size_t len)
+{
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (has_sse42)
+        return ~crc32c_hw(crc, p, len);
+#endif
+    pthread_once(&crc32c_once, crc32c_init_tables);
+    return ~crc32c_sw(crc, p, len);
+}
+
+// GF(256) over x^8 + x^4 + x^3 + x^2 + 1 with generator 2. gf_mul is a full
+// 64 KiB product table; gf_mul_add_region is the hot kernel of stripe parity
+// and rebuilds, and uses PSHUFB nibble tables when the CPU has SSSE3.
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_mul_table[256][256];
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+static void gf_init_tables(void)
+{
+    unsigned x = 1;
+    for (int i = 0; i < 255; i++)
+    {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= 0x11d;
+    }
+    for (int i = 255; i < 512; i++)
+    {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+    for (int a = 0; a < 256; a++)
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            gf_mul_table[a][b] = (a && b) ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+        }
+    }
+}
+
+static void gf_init(void)
+{
+    pthread_once(&gf_once, gf_init_tables);
+}
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    return gf_mul_table[a][b];
+}
+
+static inline uint8_t gf_div(uint8_t a, uint8_t b)
+{
+    return a ? gf_exp[gf_log[a] + 255 - gf_log[b]] : 0;
+}
+
+static inline uint8_t gf_pow(int e)
+{
+    e %= 255;
+    return gf_exp[e < 0 ? e + 255 : e];
+}
+
+#ifndef STEGO_LIBRARY
+static void gf_mul_add_region_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    const uint8_t *row = gf_mul_table[c];
+    for (size_t i = 0; i < len; i++)
+    {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("ssse3"))) static void gf_mul_add_region_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c,
+                                                                      size_t len)
+{
+    uint8_t lo[16], hi[16];
+    for (int i = 0; i < 16; i++)
+    {
+        lo[i] = gf_mul(c, i);
+        hi[i] = gf_mul(c, i << 4);
+    }
+    __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+    __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(tlo, _mm_and_si128(v, mask)),
+                                  _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(v, 4), mask)));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i)), p));
+    }
+    gf_mul_add_region_scalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+// dst[i] ^= c * src[i]
+static void gf_mul_add_region(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    if (c == 0)
+        return;
+#if defined(__x86_64__) || defined(__i386__)
+    if (has_ssse3 && len >= 16)
+    {
+        gf_mul_add_region_ssse3(dst, src, c, len);
+        return;
+    }
+#endif
+    gf_mul_add_region_scalar(dst, src, c, len);
+}
+#endif
+
+// Reed-Solomon over full 255-byte codewords: RS_DATA(nsym) data bytes followed
+// by nsym parity bytes, correcting up to nsym / 2 byte errors per codeword.
+// Codeword byte i is the coefficient of x^(254 - i); generator roots are
+// 2^0 .. 2^(nsym-1).
+#define RS_CODEWORD 255
+#define RS_DATA(nsym) (RS_CODEWORD - (nsym))
+#define RS_MAX_PARITY 128
+
+static void rs_generator(int nsym, uint8_t *gen)
+{
+    // gen[0..nsym] holds the monic generator, highest degree first
+    memset(gen, 0, nsym + 1);
+    gen[0] = 1;
+    for (int i = 0; i < nsym; i++)
+    {
+        uint8_t root = gf_pow(i);
+        for (int j = i + 1; j > 0; j--)
+        {
+            gen[j] ^= gf_mul(gen[j - 1], root);
+        }
+    }
+}
+
+// Encoder table rows are padded to whole 64-bit words
+#define RS_ROW(nsym) (((nsym) + 7) & ~7)
+
+// Row f of the encoder table (256 rows of RS_ROW(nsym) bytes) is
+// f * gen[1..nsym], the value each feedback byte XORs into the parity register
+static void rs_encode_table(int nsym, uint8_t *table)
+{
+    uint8_t gen[RS_MAX_PARITY + 1];
+    rs_generator(nsym, gen);
+    memset(table, 0, 256 * RS_ROW(nsym));
+    for (int f = 0; f < 256; f++)
+    {
+        for (int j = 0; j < nsym; j++)
+        {
+            table[f * RS_ROW(nsym) + j] = gf_mul(f, gen[j + 1]);
+        }
+    }
+}
+
+// Systematic encode: parity = (data * x^nsym) mod gen. Each data byte shifts
+// the register one byte and XORs in a table row, a word at a time; moving
+// forward, every word is read before it is overwritten, and the bytes past
+// nsym stay zero.
+static void rs_encode_block(const uint8_t *table, int nsym, const uint8_t *data, int k, uint8_t *parity)
+{
+    uint8_t reg[RS_MAX_PARITY + 8] = {0};
+    int row_bytes = RS_ROW(nsym);
+    for (int i = 0; i < k; i++)
+    {
+        const uint8_t *row = table + (data[i] ^ reg[0]) * row_bytes;
+        for (int j = 0; j < row_bytes; j += 8)
+        {
+            uint64_t a, b;
+            memcpy(&a, reg + j + 1, 8);
+            memcpy(&b, row + j, 8);
+            a ^= b;
+            memcpy(reg + j, &a, 8);
+        }
+    }
+    memcpy(parity, reg, nsym);
+}
+
+// Corrects cw in place; returns the number of corrected bytes or -1
+static int rs_decode_block(uint8_t *cw, int nsym)
+{
+    uint8_t synd[RS_MAX_PARITY];
+    int nonzero = 0;
+    for (int j = 0; j < nsym; j++)
+    {
+        uint8_t a = gf_pow(j), v = 0;
+        const uint8_t *row = gf_mul_table[a];
+        for (int i = 0; i < RS_CODEWORD; i++)
+        {
+            v = row[v] ^ cw[i];
+        }
+        synd[j] = v;
+        nonzero |= v;
+    }
+    if (!nonzero)
+        return 0;
+
+    // Berlekamp-Massey: error locator lambda (lowest degree first)
+    uint8_t lambda[RS_MAX_PARITY + 1] = {1}, prev[RS_MAX_PARITY + 1] = {1}, tmp[RS_MAX_PARITY + 1];
+    int L = 0, m = 1;
+    uint8_t b = 1;
+    for (int r = 0; r < nsym; r++)
+    {
+        uint8_t d = synd[r];
+        for (int i = 1; i <= L; i++)
+        {
+            d ^= gf_mul(lambda[i], synd[r - i]);
+        }
+        if (d == 0)
+        {
+            m++;
+            continue;
+        }
+        uint8_t coef = gf_div(d, b);
+        if (2 * L <= r)
+        {
+            memcpy(tmp, lambda, sizeof(tmp));
+            for (int i = 0; i + m <= nsym; i++)
+            {
+                lambda[i + m] ^= gf_mul(coef, prev[i]);
+            }
+            L = r + 1 - L;
+            memcpy(prev, tmp, sizeof(prev));
+            b = d;
+            m = 1;
+        }
+        else
+        {
+            for (int i = 0; i + m <= nsym; i++)
+            {
+                lambda[i + m] ^= gf_mul(coef, prev[i]);
+            }
+            m++;
+        }
+    }
+    if (2 * L > nsym)
+        return -1;
+
+    // omega = synd * lambda mod x^nsym
+    uint8_t omega[RS_MAX_PARITY] = {0};
+    for (int i = 0; i < nsym; i++)
+    {
+        for (int j = 0; j <= L && j <= i; j++)
+        {
+            omega[i] ^= gf_mul(synd[i - j], lambda[j]);
+        }
+    }
+
+    // Chien search for roots X^-1, Forney for the magnitudes
+    int found = 0;
+    for (int i = 0; i < RS_CODEWORD; i++)
+    {
+        int power = RS_CODEWORD - 1 - i;
+        uint8_t xinv = gf_pow(-power);
+        uint8_t v = 0, xp = 1;
+        for (int j = 0; j <= L; j++)
+        {
+            v ^= gf_mul(lambda[j], xp);
+            xp = gf_mul(xp, xinv);
+        }
+        if (v != 0)
+            continue;
+
+        uint8_t num = 0, den = 0;
+        xp = 1;
+        for (int j = 0; j < nsym; j++)
+        {
+            num ^= gf_mul(omega[j], xp);
+            if ((j & 1) == 0 && j + 1 <= L)
+                den ^= gf_mul(lambda[j + 1], xp);
+            xp = gf_mul(xp, xinv);
+        }
+        if (den == 0)
+            return -1;
+        cw[i] ^= gf_mul(gf_pow(power), gf_div(num, den));
+        found++;
+    }
+    return found == L ? found : -1;
+}
+
+static size_t ecc_codewords(size_t data_len, int nsym)
+{
+    return (data_len + RS_DATA(nsym) - 1) / RS_DATA(nsym);
+}
+
+static size_t ecc_encoded_size(size_t data_len, int nsym)
+{
+    return ecc_codewords(data_len, nsym) * RS_CODEWORD;
+}
+
+// Codeword c, byte t lives at stream byte t * codewords + c, so a run of
+// damaged carrier bytes is spread thinly over every codeword.
+static int ecc_encode(const unsigned char *data, size_t len, int nsym, unsigned char *out, uint32_t *crc)
+{
+    gf_init();
+    uint8_t *table = stego_malloc(256 * RS_ROW(nsym));
+    if (!table)
+        return -1;
+    rs_encode_table(nsym, table);
+    size_t ncw = ecc_codewords(len, nsym);
+    int k = RS_DATA(nsym);
+    uint8_t cw[RS_CODEWORD];
+    for (size_t c = 0; c < ncw; c++)
+    {
+        size_t n = len - c * k < (size_t)k ? len - c * k : (size_t)k;
+        memset(cw, 0, k);
+        memcpy(cw, data + c * k, n);
+        if (crc)
+            *crc = crc32c_update(*crc, cw, n);
+        rs_encode_block(table, nsym, cw, k, cw + k);
+        for (int t = 0; t < RS_CODEWORD; t++)
+        {
+            out[t * ncw + c] = cw[t];
+        }
+    }
+    stego_free(table);
+    return 0;
+}
+
+// Returns the number of corrected bytes, or -1 if any codeword was beyond repair
+static long ecc_decode(const unsigned char *in, size_t len, int nsym, unsigned char *out, uint32_t *crc)
+{
+    gf_init();
+    size_t ncw = ecc_codewords(len, nsym);
+    int k = RS_DATA(nsym);
+    uint8_t cw[RS_CODEWORD];
+    long corrected = 0;
+    int failed = 0;
+    for (size_t c = 0; c < ncw; c++)
+    {
+        for (int t = 0; t < RS_CODEWORD; t++)
+        {
+            cw[t] = in[t * ncw + c];
+        }
+        int r = rs_decode_block(cw, nsym);
+        if (r < 0)
+            failed = 1;
+        else
+            corrected += r;
+        size_t n = len - c * k < (size_t)k ? len - c * k : (size_t)k;
+        memcpy(out + c * k, cw, n);
+        if (crc)
+            *crc = crc32c_update(*crc, cw, n);
+    }
+    return failed ? -1 : corrected;
+}
+
+static void embed_bit(unsigned char *data, int width, int height, size_t position, int bit)
+{
+    size_t max_bits = width * height * 3;
+    if (position >= max_bits)
+    {
+        stego_error("Position %zu exceeds maximum bits %zu\n", position, max_bits);
+        return;
+    }
+
+    size_t pixel_pos = position / 3;
+    size_t channel = position % 3;
+    data[(pixel_pos * 3) + channel] = (data[(pixel_pos * 3) + channel] & 0xFE) | bit;
+}
+
+static int extract_bit(unsigned char *data, int width, int height, size_t position)
+{
+    size_t max_bits = width * height * 3;
+    if (position >= max_bits)
+    {
+        stego_error("Position %zu exceeds maximum bits %zu\n", position, max_bits);
+        return 0;
+    }
+
+    size_t pixel_pos = position / 3;
+    size_t channel = position % 3;
+    return data[(pixel_pos * 3) + channel] & 1;
+}
+
+static void write_bits(unsigned char *data, int width, int height, size_t value, size_t num_bits,
+                       size_t *current_position)
+{
+    for (int i = num_bits - 1; i >= 0; i--)
+    {
+        embed_bit(data, width, height, *current_position, (value >> i) & 1);
+        (*current_position)++;
+    }
+}
+
+static size_t read_bits(unsigned char *data, int width, int height, size_t num_bits, size_t *current_position)
+{
+    size_t value = 0;
+    for (size_t i = 0; i < num_bits; i++)
+    {
+        value = (value << 1) | extract_bit(data, width, height, *current_position);
+        (*current_position)++;
+    }
+    return value;
+}
+
+static size_t header_bits(const file_metadata_t *metadata)
+{
+    size_t bits = 32 + 32 + 8 + metadata->ext_length * 8;
+    if (metadata->magic == STEGO_MAGIC_V2)
+    {
+        bits += 8;
+        if (metadata->flags & STEGO_FLAG_ECC)
+            bits += 8;
+        if (metadata->flags & STEGO_FLAG_CHECKSUM)
+            bits += 32;
+        if (metadata->flags & STEGO_FLAG_STRIPED)
+            bits += 8 + 8 + 32 + 32;
+        if (metadata->flags & STEGO_FLAG_PARITY)
+            bits += 8;
+        if (metadata->flags & STEGO_FLAG_ENCRYPTED)
+            bits += STEGO_SALT_LENGTH * 8;
+    }
+    return bits;
+}
+
+// Writes the header at bit 0 and returns the first payload bit
+static size_t write_metadata(unsigned char *data, int width, int height, const file_metadata_t *metadata)
+{
+    size_t position = 0;
+    write_bits(data, width, height, metadata->magic, 32, &position);
+    if (metadata->magic == STEGO_MAGIC_V2)
+        write_bits(data, width, height, metadata->flags, 8, &position);
+    if (metadata->flags & STEGO_FLAG_ECC)
+        write_bits(data, width, height, metadata->ecc_parity, 8, &position);
+    if (metadata->flags & STEGO_FLAG_CHECKSUM)
+        write_bits(data, width, height, metadata->checksum, 32, &position);
+    if (metadata->flags & STEGO_FLAG_STRIPED)
+    {
+        write_bits(data, width, height, metadata->stripe_index, 8, &position);
+        write_bits(data, width, height, metadata->stripe_count, 8, &position);
+        write_bits(data, width, height, metadata->total_size, 32, &position);
+        write_bits(data, width, height, metadata->set_id, 32, &position);
+    }
+    if (metadata->flags & STEGO_FLAG_PARITY)
+        write_bits(data, width, height, metadata->parity_count, 8, &position);
+    write_bits(data, width, height, metadata->file_size, 32, &position);
+    write_bits(data, width, height, metadata->ext_length, 8, &position);
+    for (int i = 0; i < metadata->ext_length; i++)
+    {
+        write_bits(data, width, height, metadata->extension[i], 8, &position);
+    }
+    if (metadata->flags & STEGO_FLAG_ENCRYPTED)
+    {
+        for (int i = 0; i < STEGO_SALT_LENGTH; i++)
+        {
+            write_bits(data, width, height, metadata->salt[i], 8, &position);
+        }
+    }
+    return position;
+}
+
+// Returns 0 and the first payload bit in *position, or -1 if there is no valid header
+static int read_metadata(unsigned char *data, int width, int height, file_metadata_t *metadata, size_t *position)
+{
+    memset(metadata, 0, sizeof(*metadata));
+    *position = 0;
+    if ((size_t)width * height * 3 < 32 + 8 + 32 + 8)
+        return -1;
+
+    metadata->magic = read_bits(data, width, height, 32, position);
+    if (metadata->magic != STEGO_MAGIC && metadata->magic != STEGO_MAGIC_V2)
+        return -1;
+    if (metadata->magic == STEGO_MAGIC_V2)
+        metadata->flags = read_bits(data, width, height, 8, position);
+    if (metadata->flags & STEGO_FLAG_ECC)
+    {
+        metadata->ecc_parity = read_bits(data, width, height, 8, position);
+        if (metadata->ecc_parity < 2 || metadata->ecc_parity > RS_MAX_PARITY || (metadata->ecc_parity & 1))
+            return -1;
+    }
+    if (metadata->flags & STEGO_FLAG_CHECKSUM)
+        metadata->checksum = read_bits(data, width, height, 32, position);
+    if (metadata->flags & STEGO_FLAG_STRIPED)
+    {
+        metadata->stripe_index = read_bits(data, width, height, 8, position);
+        metadata->stripe_count = read_bits(data, width, height, 8, position);
+        metadata->total_size = read_bits(data, width, height, 32, position);
+        metadata->set_id = read_bits(data, width, height, 32, position);
+        if (metadata->stripe_index >= metadata->stripe_count)
+            return -1;
+    }
+    if (metadata->flags & STEGO_FLAG_PARITY)
+    {
+        metadata->parity_count = read_bits(data, width, height, 8, position);
+        if (!(metadata->flags & STEGO_FLAG_STRIPED) || metadata->parity_count >= metadata->stripe_count)
+            return -1;
+    }
+    metadata->file_size = read_bits(data, width, height, 32, position);
+    metadata->ext_length = read_bits(data, width, height, 8, position);
+    if (metadata->ext_length > 10)
+        return -1;
+    for (int i = 0; i < metadata->ext_length; i++)
+    {
+        metadata->extension[i] = read_bits(data, width, height, 8, position);
+    }
+    metadata->extension[metadata->ext_length] = '\0';
+    if (metadata->flags & STEGO_FLAG_ENCRYPTED)
+    {
+        for (int i = 0; i < STEGO_SALT_LENGTH; i++)
+        {
+            metadata->salt[i] = read_bits(data, width, height, 8, position);
+        }
+    }
+    return 0;
+}
+
+// Keyed scatter layout. Payload bit k is placed at carrier bit
+// base + scatter_position(k), a bijection over the carrier bits after the
+// header built from small Feistel permutations, so any payload byte can be
+// located in O(1) with no permutation table. The carrier is cut into blocks
+// of SCATTER_BLOCK_BITS channel bytes; runs of SCATTER_CHUNK_BITS consecutive
+// payload bits stay inside one block and consecutive runs are dealt across
+// all blocks. Each run's scattered writes therefore hit a single cache-sized
+// block while the payload as a whole still spreads over the entire image.
+
+#define SCATTER_BLOCK_BITS 65536 // a power of four, so slot permutations never cycle-walk
+#define SCATTER_CHUNK_BITS 4096
+#define SCATTER_TWEAK_BLOCKS 0xB10C000000000000ULL
+#define SCATTER_TWEAK_TAIL 0x7A11000000000000ULL
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static void scatter_init(stego_scatter_t *scatter, const stego_cipher_t *cipher, size_t domain)
+{
+    // Counter 0xFFFFFFFF is never reached by payload encryption (payloads are < 4 GiB)
+    uint32_t ks[16];
+    chacha20_block(cipher, UINT32_MAX, ks);
+    for (int i = 0; i < 4; i++)
+    {
+        scatter->keys[i] = ks[i * 2] | ((uint64_t)ks[i * 2 + 1] << 32);
+    }
+    scatter->domain = domain;
+    scatter->nblocks = domain / SCATTER_BLOCK_BITS;
+    scatter->enabled = 1;
+}
+
+// Four-round balanced Feistel network over the smallest even-width power of
+// two covering m, cycle-walked back into [0, m). The covering domain is at
+// most 4m, so the walk takes fewer than four passes on average.
+static uint64_t feistel_permute(const stego_scatter_t *scatter, uint64_t x, uint64_t m, uint64_t tweak)
+{
+    if (m <= 1)
+        return 0;
+
+    int bits = 64 - __builtin_clzll(m - 1);
+    bits += bits & 1;
+    int half = bits / 2;
+    uint64_t mask = (1ULL << half) - 1;
+    do
+    {
+        uint64_t l = x >> half, r = x & mask;
+        for (int round = 0; round < 4; round++)
+        {
+            uint64_t t = l ^ (mix64(r ^ scatter->keys[round] ^ tweak) & mask);
+            l = r;
+            r = t;
+        }
+        x = (l << half) | r;
+    } while (x >= m);
+    return x;
+}
+
+// Fills the carrier offsets (relative to the payload base) of the 8 bits of
+// the payload byte starting at bit k. k is byte aligned, so all 8 bits share
+// one run and one block.
+static void scatter_byte_positions(const stego_scatter_t *scatter, size_t k, size_t positions[8])
+{
+    size_t full = scatter->nblocks * SCATTER_BLOCK_BITS;
+    if (k >= full)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            positions[j] = full + feistel_permute(scatter, k + j - full, scatter->domain - full, SCATTER_TWEAK_TAIL);
+        }
+        return;
+    }
+
+    size_t run = k / SCATTER_CHUNK_BITS;
+    size_t block = run % scatter->nblocks;
+    size_t slot = (run / scatter->nblocks) * SCATTER_CHUNK_BITS + k % SCATTER_CHUNK_BITS;
+    size_t block_base = feistel_permute(scatter, block, scatter->nblocks, SCATTER_TWEAK_BLOCKS) * SCATTER_BLOCK_BITS;
+    for (int j = 0; j < 8; j++)
+    {
+        positions[j] = block_base + feistel_permute(scatter, slot + j, SCATTER_BLOCK_BITS, block);
+    }
+}
+
+// The payload is a byte stream stored MSB first, one bit per channel byte.
+// Payload bit k lives at carrier bit base + k (or base + scatter_position(k)
+// for scattered images); `start` is the first payload bit of this stream,
+// which lets several mounted files share one layout. The keystream follows the
+// position in the whole layout, so no two files are encrypted with the same one. Sequential bit positions
+// map 1:1 onto channel bytes, so the bulk loops index the image buffer
+// directly instead of going through embed_bit/extract_bit.
+typedef struct
+{
+    unsigned char *data;
+    size_t max_bits;
+    size_t base;
+    size_t start;
+    const stego_cipher_t *cipher;
+    const stego_scatter_t *scatter;
+    uint32_t *crc; // plaintext CRC32C, accumulated as bytes pass through (NULL to skip)
+} stego_payload_t;
+
+static int payload_check_range(const stego_payload_t *payload, size_t offset, size_t len)
+{
+    if (payload->base + payload->start + (offset + len) * 8 > payload->max_bits)
+    {
+        stego_error("Payload range %zu+%zu exceeds carrier capacity\n", offset, len);
+        return -1;
+    }
+    return 0;
+}
+
+static int payload_write(const stego_payload_t *payload, size_t offset, const unsigned char *src, size_t len)
+{
+    if (payload_check_range(payload, offset, len) != 0)
+        return -1;
+
+    int encrypted = payload->cipher && payload->cipher->enabled;
+    int scattered = payload->scatter && payload->scatter->enabled;
+    unsigned char *base = payload->data + payload->base;
+    size_t bit = payload->start + offset * 8;
+    size_t stream = bit / 8;
+    uint32_t ks[16];
+    while (len > 0)
+    {
+        size_t in_block = stream % 64;
+        size_t n = 64 - in_block < len ? 64 - in_block : len;
+        if (encrypted)
+            chacha20_block(payload->cipher, stream / 64, ks);
+        if (payload->crc)
+            *payload->crc = crc32c_update(*payload->crc, src, n);
+
+        for (size_t i = 0; i < n; i++, bit += 8)
+        {
+            unsigned byte = src[i];
+            if (encrypted)
+                byte ^= (ks[(in_block + i) >> 2] >> (((in_block + i) & 3) * 8)) & 0xFF;
+            if (scattered)
+            {
+                size_t positions[8];
+                scatter_byte_positions(payload->scatter, bit, positions);
+                for (int j = 0; j < 8; j++)
+                {
+                    base[positions[j]] = (base[positions[j]] & 0xFE) | ((byte >> (7 - j)) & 1);
+                }
+            }
+            else
+            {
+                unsigned char *dst = base + bit;
+                for (int j = 0; j < 8; j++)
+                {
+                    dst[j] = (dst[j] & 0xFE) | ((byte >> (7 - j)) & 1);
+                }
+            }
+        }
+
+        src += n;
+        stream += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int payload_read(const stego_payload_t *payload, size_t offset, unsigned char *dst, size_t len)
+{
+    if (payload_check_range(payload, offset, len) != 0)
+        return -1;
+
+    int encrypted = payload->cipher && payload->cipher->enabled;
+    int scattered = payload->scatter && payload->scatter->enabled;
+    const unsigned char *base = payload->data + payload->base;
+    size_t bit = payload->start + offset * 8;
+    size_t stream = bit / 8;
+    uint32_t ks[16];
+    while (len > 0)
+    {
+        size_t in_block = stream % 64;
+        size_t n = 64 - in_block < len ? 64 - in_block : len;
+        if (encrypted)
+            chacha20_block(payload->cipher, stream / 64, ks);
+
+        for (size_t i = 0; i < n; i++, bit += 8)
+        {
+            unsigned byte = 0;
+            if (scattered)
+            {
+                size_t positions[8];
+                scatter_byte_positions(payload->scatter, bit, positions);
+                for (int j = 0; j < 8; j++)
+                {
+                    byte = (byte << 1) | (base[positions[j]] & 1);
+                }
+            }
+            else
+            {
+                const unsigned char *src = base + bit;
+                for (int j = 0; j < 8; j++)
+                {
+                    byte = (byte << 1) | (src[j] & 1);
+                }
+            }
+            if (encrypted)
+                byte ^= (ks[(in_block + i) >> 2] >> (((in_block + i) & 3) * 8)) & 0xFF;
+            dst[i] = byte;
+        }
+        if (payload->crc)
+            *payload->crc = crc32c_update(*payload->crc, dst, n);
+
+        dst += n;
+        stream += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Reads a whole stream, for images and payloads arriving on stdin
+static unsigned char *read_stream(FILE *f, size_t *len)
+{
+    size_t capacity = 1 << 20;
+    unsigned char *buf = stego_malloc(capacity);
+    *len = 0;
+    while (buf)
+    {
+        *len += fread(buf + *len, 1, capacity - *len, f);
+        if (*len < capacity)
+            break;
+        unsigned char *grown = stego_realloc(buf, capacity * 2);
+        if (!grown)
+            stego_free(buf);
+        buf = grown;
+        capacity *= 2;
+    }
+    if (!buf || ferror(f))
+    {
+        stego_error("Failed to read from stdin\n");
+        stego_free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+// Decodes an image file straight from a read-only mapping, so the decoder
+// reads the page cache (shared by every job on the same cover) instead of
+// refilling stb's small stdio buffer. Returns NULL with *mapped = 0 when the
+// file cannot be mapped (pipes, empty or huge files) so the caller can fall
+// back to stbi_load.
+static unsigned char *load_image_mapped(const char *path, int *width, int *height, int *mapped)
+{
+    *mapped = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size > INT_MAX)
+    {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    *mapped = 1;
+
+    // PNG is inflated front to back: read ahead aggressively
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    madvise(map, st.st_size, MADV_WILLNEED);
+    int channels;
+    unsigned char *image_data = stbi_load_from_memory(map, st.st_size, width, height, &channels, 3);
+    munmap(map, st.st_size);
+    return image_data;
+}
+
+// Decodes an image to packed RGB; "-" reads it from stdin
+static unsigned char *load_image(const char *path, int *width, int *height)
+{
+    int channels;
+    stage_frame_t frame;
+    if (strcmp(path, "-") != 0)
+    {
+        int mapped;
+        stage_begin(&frame, STAGE_DECODE);
+        unsigned char *image_data = load_image_mapped(path, width, height, &mapped);
+        if (!mapped)
+            image_data = stbi_load(path, width, height, &channels, 3);
+        stage_end(&frame);
+        if (!image_data)
+            stego_error("Cannot load %s: %s\n", path, stbi_failure_reason());
+        return image_data;
+    }
+
+    size_t len;
+    stage_begin(&frame, STAGE_READ);
+    unsigned char *buf = read_stream(stdin, &len);
+    stage_end(&frame);
+    if (!buf)
+        return NULL;
+    stage_begin(&frame, STAGE_DECODE);
+    unsigned char *image_data = len <= INT_MAX ? stbi_load_from_memory(buf, len, width, height, &channels, 3) : NULL;
+    stage_end(&frame);
+    if (!image_data)
+        stego_error("Cannot decode image from stdin: %s\n", stbi_failure_reason());
+    stego_free(buf);
+    return image_data;
+}
+
+static void write_to_stdout(void *context, void *data, int size)
+{
+    stage_frame_t frame;
+    stage_begin(&frame, STAGE_WRITE);
+    if (fwrite(data, 1, size, stdout) != (size_t)size)
+        *(int *)context = 1;
+    stage_end(&frame);
+    stats_count_output(size);
+}
+
+// Knobs whose best value depends on the machine. The defaults suit most
+// hosts; `autotune` measures this one and saves a profile that the CLI loads
+// at startup.
+typedef struct
+{
+    int threads;     // workers for pool scans and parity rebuilds, 0 for one per CPU
+    size_t io_block; // bytes per write of a stego image, a multiple of WRITE_ALIGN
+    size_t band;     // bytes of each stripe the parity kernels work on at a time
+    int png_level;   // stb deflate effort for written PNGs, 5 (fastest) to 9
+} stego_tuning_t;
+
+#define WRITE_BLOCK_SIZE (1 << 20)
+#define WRITE_ALIGN 4096
+#define PARITY_BAND_SIZE 65536
+
+static stego_tuning_t stego_tuning = {0, WRITE_BLOCK_SIZE, PARITY_BAND_SIZE, 8};
+
+#ifndef STEGO_LIBRARY
+static int tuned_threads(int limit)
+{
+    long cpus = stego_tuning.threads ? stego_tuning.threads : sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : cpus > limit ? limit : cpus;
+}
+#endif
+
+typedef struct
+{
+    int fd;
+    int direct;
+    off_t offset;
+    int failed;
+} image_writer_t;
+
+static int write_all(int fd, const unsigned char *p, size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// stb hands over the finished PNG in one call, so its size is known up front:
+// the file is preallocated in one extent and written in large blocks, through
+// an aligned bounce buffer for O_DIRECT. The unaligned tail of an O_DIRECT
+// file goes through the page cache.
+static void write_to_file(void *context, void *data, int size)
+{
+    image_writer_t *w = context;
+    const unsigned char *p = data;
+    size_t len = size;
+    stage_frame_t frame;
+    stage_begin(&frame, STAGE_WRITE);
+    // Not every filesystem can preallocate, but one that is out of space fails
+    // here rather than halfway through the image
+    if (fallocate(w->fd, 0, w->offset, len) != 0 && errno == ENOSPC)
+        w->failed = 1;
+
+    unsigned char *block = NULL;
+    if (w->direct && (w->offset % WRITE_ALIGN || posix_memalign((void **)&block, WRITE_ALIGN, stego_tuning.io_block)))
+        w->direct = 0;
+    size_t direct_len = w->direct ? len & ~(size_t)(WRITE_ALIGN - 1) : 0;
+    size_t done = 0;
+    while (done < direct_len && !w->failed)
+    {
+        size_t n = direct_len - done < stego_tuning.io_block ? direct_len - done : stego_tuning.io_block;
+        memcpy(block, p + done, n);
+        w->failed = write_all(w->fd, block, n, w->offset + done) != 0;
+        done += n;
+    }
+    free(block);
+    if (w->direct && done < len)
+    {
+        fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_DIRECT);
+        w->direct = 0;
+    }
+    while (done < len && !w->failed)
+    {
+        size_t n = len - done < stego_tuning.io_block ? len - done : stego_tuning.io_block;
+        w->failed = write_all(w->fd, p + done, n, w->offset + done) != 0;
+        done += n;
+    }
+    w->offset += len;
+    stage_end(&frame);
+    stats_count_output(len);
+}
+
+// Makes a rename into the directory holding `path` durable; best effort
+static void fsync_parent(const char *path)
+{
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash == dir)
+        dir[1] = '\0';
+    else if (slash)
+        *slash = '\0';
+    else
+        strcpy(dir, ".");
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// Encodes RGB pixels as PNG; "-" streams it to stdout. Files are written to a
+// temporary name next to the target, synced and renamed over it, so readers
+// never see a partial image and neither a failed write nor a crash leaves
+// anything but the old file or the complete new one.
+static int write_image(const char *path, const unsigned char *image_data, int width, int height, int direct_io)
+{
+    stage_frame_t frame;
+    if (strcmp(path, "-") == 0)
+    {
+        int failed = 0;
+        stage_begin(&frame, STAGE_ENCODE);
+        int ok = stbi_write_png_to_func(write_to_stdout, &failed, width, height, 3, image_data, width * 3);
+        stage_end(&frame);
+        if (!ok || failed || fflush(stdout) != 0)
+        {
+            stego_error("Failed to write image to stdout\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    static unsigned tmp_counter;
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%ld.%u.tmp", path, (long)getpid(),
+             __atomic_add_fetch(&tmp_counter, 1, __ATOMIC_RELAXED));
+    image_writer_t w = {open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666), 0, 0, 0};
+    if (w.fd < 0)
+    {
+        stego_error("Failed to create %s: %s\n", tmp, strerror(errno));
+        return 1;
+    }
+    if (direct_io && fcntl(w.fd, F_SETFL, fcntl(w.fd, F_GETFL) | O_DIRECT) == 0)
+        w.direct = 1;
+
+    stage_begin(&frame, STAGE_ENCODE);
+    int ok = stbi_write_png_to_func(write_to_file, &w, width, height, 3, image_data, width * 3) && !w.failed;
+    stage_end(&frame);
+    stage_begin(&frame, STAGE_WRITE);
+    ok = ok && fsync(w.fd) == 0;
+    ok = close(w.fd) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if (ok)
+        fsync_parent(path);
+    stage_end(&frame);
+    if (!ok)
+    {
+        stego_error("Failed to write %s\n", path);
+        unlink(tmp);
+        return 1;
+    }
+    return 0;
+}
+
+static int embed_payload_bits(unsigned char *image_data, int width, int height, const char *cover_name,
+                              const unsigned char *file_data, size_t file_size, const file_metadata_t *base,
+                              const stego_options_t *opts)
+{
+    size_t max_bits = (size_t)width * height * 3;
+    size_t max_capacity = max_bits / 8;
+    stego_info("Image capacity: %zu bytes\n", max_capacity);
+
+    file_metadata_t metadata = *base;
+    metadata.magic = STEGO_MAGIC_V2;
+    metadata.flags |= STEGO_FLAG_CHECKSUM;
+    metadata.file_size = file_size;
+    metadata.checksum = 0;
+
+    if (opts->scatter && !opts->passphrase)
+    {
+        stego_error("--scatter needs a passphrase to key the layout\n");
+        return 1;
+    }
+
+    stego_cipher_t cipher = {0};
+    if (opts->passphrase)
+    {
+        metadata.flags |= STEGO_FLAG_ENCRYPTED | (opts->scatter ? STEGO_FLAG_SCATTER : 0);
+        if (random_bytes(metadata.salt, STEGO_SALT_LENGTH) != 0)
+        {
+            stego_error("Failed to generate salt\n");
+            return 1;
+        }
+        cipher_init(&cipher, opts->passphrase, metadata.salt);
+    }
+
+    size_t stream_size = file_size;
+    if (opts->ecc_parity)
+    {
+        metadata.flags |= STEGO_FLAG_ECC;
+        metadata.ecc_parity = opts->ecc_parity;
+        stream_size = ecc_encoded_size(file_size, opts->ecc_parity);
+    }
+
+    // Check if file fits in image after the header
+    if (file_size > UINT32_MAX || header_bits(&metadata) + stream_size * 8 > max_bits)
+    {
+        stego_error("File too large for image %s\n", cover_name);
+        return 1;
+    }
+
+    stego_info("Embedding file of size: %zu bytes\n", file_size);
+
+    const unsigned char *stream = file_data;
+    unsigned char *encoded = NULL;
+    if (metadata.flags & STEGO_FLAG_ECC)
+    {
+        encoded = stego_malloc(stream_size);
+        if (!encoded || ecc_encode(file_data, file_size, metadata.ecc_parity, encoded, &metadata.checksum) != 0)
+        {
+            stego_free(encoded);
+            return 1;
+        }
+        stream = encoded;
+    }
+
+    // Payload in one pass (checksummed and encrypted on the fly), then the
+    // header, which has a fixed size and so can carry the finished checksum
+    size_t position = header_bits(&metadata);
+    stego_scatter_t scatter = {0};
+    if (metadata.flags & STEGO_FLAG_SCATTER)
+        scatter_init(&scatter, &cipher, max_bits - position);
+    stego_payload_t payload = {image_data, max_bits, position, 0, &cipher, &scatter,
+                               encoded ? NULL : &metadata.checksum};
+    payload_write(&payload, 0, stream, stream_size);
+    write_metadata(image_data, width, height, &metadata);
+
+    stego_free(encoded);
+    stats_count_carrier(file_size, position + stream_size * 8, max_bits);
+    return 0;
+}
+
+// Hides data in decoded cover pixels, in place. `base` supplies the extension
+// and stripe fields; flags, salt and checksum are filled in here.
+static int embed_payload(unsigned char *image_data, int width, int height, const char *cover_name,
+                         const unsigned char *file_data, size_t file_size, const file_metadata_t *base,
+                         const stego_options_t *opts)
+{
+    stage_frame_t frame;
+    stage_begin(&frame, STAGE_EMBED);
+    int r = embed_payload_bits(image_data, width, height, cover_name, file_data, file_size, base, opts);
+    stage_end(&frame);
+    return r;
+}
+
+// Hides data in cover_image and writes the result to output
+static int hide_buffer(const char *cover_image, const char *output, const unsigned char *file_data,
+                       size_t file_size, const file_metadata_t *base, const stego_options_t *opts)
+{
+    int width, height;
+    unsigned char *image_data = load_image(cover_image, &width, &height);
+    if (!image_data)
+        return 1;
+
+    int r = embed_payload(image_data, width, height, cover_image, file_data, file_size, base, opts);
+    if (r == 0)
+        r = write_image(output, image_data, width, height, opts->direct_io);
+    stbi_image_free(image_data);
+    return r;
+}
+
+// Payload bytes a hide_buffer() call with these options can fit in the image
+static size_t payload_capacity(int width, int height, const file_metadata_t *base, const stego_options_t *opts)
+{
+    file_metadata_t metadata = *base;
+    metadata.magic = STEGO_MAGIC_V2;
+    metadata.flags |= STEGO_FLAG_CHECKSUM;
+    if (opts->passphrase)
+        metadata.flags |= STEGO_FLAG_ENCRYPTED;
+    if (opts->ecc_parity)
+        metadata.flags |= STEGO_FLAG_ECC;
+    size_t max_bits = (size_t)width * height * 3;
+    size_t header = header_bits(&metadata);
+    size_t bytes = max_bits > header ? (max_bits - header) / 8 : 0;
+    if (opts->ecc_parity)
+        bytes = bytes / RS_CODEWORD * RS_DATA(opts->ecc_parity);
+    return bytes < UINT32_MAX ? bytes : UINT32_MAX;
+}
+
+static int decode_payload_bits(unsigned char *image_data, int width, int height, const stego_options_t *opts,
+                               file_metadata_t *metadata, unsigned char **file_data)
+{
+    // Read and verify magic number and header
+    size_t position = 0;
+    if (read_metadata(image_data, width, height, metadata, &position) != 0)
+    {
+        stego_error("Invalid steganographic image\n");
+        return 1;
+    }
+
+    size_t file_size = metadata->file_size;
+    size_t stream_size = (metadata->flags & STEGO_FLAG_ECC) ? ecc_encoded_size(file_size, metadata->ecc_parity)
+                                                            : file_size;
+    size_t max_bits = (size_t)width * height * 3;
+    if (position + stream_size * 8 > max_bits)
+    {
+        stego_error("Invalid file size: %zu\n", file_size);
+        return 1;
+    }
+
+    stego_cipher_t cipher = {0};
+    if (metadata->flags & STEGO_FLAG_ENCRYPTED)
+    {
+        if (!opts->passphrase)
+        {
+            stego_error("Image is encrypted, a passphrase is required\n");
+            return 1;
+        }
+        cipher_init(&cipher, opts->passphrase, metadata->salt);
+    }
+
+    stego_scatter_t scatter = {0};
+    if (metadata->flags & STEGO_FLAG_SCATTER)
+        scatter_init(&scatter, &cipher, max_bits - position);
+
+    stego_info("Extracting file of size: %zu bytes\n", file_size);
+
+    unsigned char *data = heap_malloc(file_size ? file_size : 1); // handed to the caller, never in an arena
+    if (!data)
+        return 1;
+    uint32_t checksum = 0;
+    stego_payload_t payload = {image_data, max_bits, position, 0, &cipher, &scatter, NULL};
+    if (metadata->flags & STEGO_FLAG_ECC)
+    {
+        unsigned char *stream = stego_malloc(stream_size);
+        if (!stream)
+        {
+            stego_free(data);
+            return 1;
+        }
+        payload_read(&payload, 0, stream, stream_size);
+        long corrected = ecc_decode(stream, file_size, metadata->ecc_parity, data, &checksum);
+        stego_free(stream);
+        if (corrected < 0)
+        {
+            stego_error("Payload is damaged beyond what ECC can repair%s\n",
+                        (metadata->flags & STEGO_FLAG_ENCRYPTED) ? " (corrupt image or wrong passphrase)" : "");
+            stego_free(data);
+            return 1;
+        }
+        if (corrected > 0)
+            stego_info("Corrected %ld damaged bytes\n", corrected);
+    }
+    else
+    {
+        payload.crc = &checksum;
+        payload_read(&payload, 0, data, file_size);
+    }
+
+    if ((metadata->flags & STEGO_FLAG_CHECKSUM) && checksum != metadata->checksum)
+    {
+        stego_error("Checksum mismatch: header %08x, payload %08x%s\n", metadata->checksum, checksum,
+                (metadata->flags & STEGO_FLAG_ENCRYPTED) ? " (corrupt image or wrong passphrase)" : "");
+        stego_free(data);
+        return 1;
+    }
+
+    stats_count_carrier(file_size, position + stream_size * 8, max_bits);
+    *file_data = data;
+    return 0;
+}
+
+// Decodes, decrypts, repairs and checksums the payload of decoded image
+// pixels. On success *file_data holds metadata->file_size bytes owned by the
+// caller; the pixels are left to the caller as well.
+static int decode_payload(unsigned char *image_data, int width, int height, const stego_options_t *opts,
+                          file_metadata_t *metadata, unsigned char **file_data)
+{
+    stage_frame_t frame;
+    stage_begin(&frame, STAGE_EXTRACT);
+    int r = decode_payload_bits(image_data, width, height, opts, metadata, file_data);
+    stage_end(&frame);
+    return r;
+}
+
+// libstego API, see stego.h. Each call installs the context's allocator for
+// the calling thread and restores the previous one on return.
+struct stego_ctx
+{
+    stego_allocator_t allocator;
+    stego_options_t opts;
+    char *passphrase;
+    size_t arena_reserve; // 0: no arena
+};
+
+// Arenas for contexts that enable them live one per calling thread and are
+// unmapped when the thread exits
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+static void arena_key_init(void)
+{
+    pthread_key_create(&arena_key, arena_destroy);
+}
+
+typedef struct
+{
+    const stego_allocator_t *allocator;
+    stego_arena_t *arena;
+} api_scope_t;
+
+static api_scope_t api_enter(const stego_ctx_t *ctx)
+{
+    api_scope_t saved = {stego_allocator, stego_arena};
+    stego_allocator = &ctx->allocator;
+    stego_arena = NULL;
+    if (ctx->arena_reserve)
+    {
+        pthread_once(&arena_key_once, arena_key_init);
+        stego_arena = pthread_getspecific(arena_key);
+        if (!stego_arena)
+        {
+            stego_arena = arena_create(ctx->arena_reserve, ctx->opts.huge_pages);
+            pthread_setspecific(arena_key, stego_arena);
+        }
+    }
+    return saved;
+}
+
+static void api_leave(api_scope_t saved)
+{
+    if (stego_arena)
+        arena_reset(stego_arena);
+    stego_allocator = saved.allocator;
+    stego_arena = saved.arena;
+}
+
+static void *libc_malloc(void *user, size_t size)
+{
+    (void)user;
+    return malloc(size);
+}
+
+static void *libc_realloc(void *user, void *ptr, size_t size)
+{
+    (void)user;
+    return realloc(ptr, size);
+}
+
+static void libc_free(void *user, void *ptr)
+{
+    (void)user;
+    free(ptr);
+}
+
+stego_ctx_t *stego_ctx_new(const stego_allocator_t *allocator)
+{
+    stego_allocator_t a = {libc_malloc, libc_realloc, libc_free, NULL};
+    if (allocator)
+        a = *allocator;
+    stego_ctx_t *ctx = (a.malloc)(a.user, sizeof(*ctx));
+    if (!ctx)
+    {
+        stego_error("Out of memory\n");
+        return NULL;
+    }
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->allocator = a;
+    return ctx;
+}
+
+void stego_ctx_free(stego_ctx_t *ctx)
+{
+    if (!ctx)
+        return;
+    stego_ctx_set_passphrase(ctx, NULL);
+    (ctx->allocator.free)(ctx->allocator.user, ctx);
+}
+
+int stego_ctx_set_passphrase(stego_ctx_t *ctx, const char *passphrase)
+{
+    if (ctx->passphrase)
+    {
+        memset(ctx->passphrase, 0, strlen(ctx->passphrase));
+        (ctx->allocator.free)(ctx->allocator.user, ctx->passphrase);
+        ctx->passphrase = NULL;
+        ctx->opts.passphrase = NULL;
+    }
+    if (!passphrase || !passphrase[0])
+        return 0;
+
+    size_t len = strlen(passphrase) + 1;
+    ctx->passphrase = (ctx->allocator.malloc)(ctx->allocator.user, len);
+    if (!ctx->passphrase)
+    {
+        stego_error("Out of memory\n");
+        return 1;
+    }
+    memcpy(ctx->passphrase, passphrase, len);
+    ctx->opts.passphrase = ctx->passphrase;
+    return 0;
+}
+
+int stego_ctx_set_scatter(stego_ctx_t *ctx, int scatter)
+{
+    ctx->opts.scatter = scatter != 0;
+    return 0;
+}
+
+int stego_ctx_set_arena(stego_ctx_t *ctx, size_t reserve, int huge_pages)
+{
+    ctx->arena_reserve = reserve;
+    ctx->opts.huge_pages = huge_pages != 0;
+    return 0;
+}
+
+int stego_ctx_set_ecc(stego_ctx_t *ctx, int parity)
+{
+    if (parity != 0 && (parity < 2 || parity > RS_MAX_PARITY || (parity & 1)))
+    {
+        stego_error("ECC parity must be 0 or an even number between 2 and %d\n", RS_MAX_PARITY);
+        return 1;
+    }
+    ctx->opts.ecc_parity = parity;
+    return 0;
+}
+
+static void fill_info(stego_info_t *info, const file_metadata_t *metadata, int has_payload, int width, int height,
+                      const stego_options_t *opts)
+{
+    file_metadata_t base = {0};
+    memset(info, 0, sizeof(*info));
+    info->has_payload = has_payload;
+    if (has_payload)
+    {
+        info->flags = metadata->flags;
+        info->file_size = metadata->file_size;
+        memcpy(info->extension, metadata->extension, metadata->ext_length);
+    }
+    info->capacity = payload_capacity(width, height, &base, opts);
+}
+
+static void extension_metadata(const char *extension, file_metadata_t *base)
+{
+    memset(base, 0, sizeof(*base));
+    if (extension)
+    {
+        size_t len = strlen(extension);
+        base->ext_length = len < sizeof(base->extension) - 1 ? len : sizeof(base->extension) - 1;
+        memcpy(base->extension, extension, base->ext_length);
+    }
+}
+
+static unsigned char *load_image_memory(const void *image, size_t image_size, int *width, int *height)
+{
+    int channels;
+    stage_frame_t frame;
+    stage_begin(&frame, STAGE_DECODE);
+    unsigned char *image_data =
+        image_size <= INT_MAX ? stbi_load_from_memory(image, image_size, width, height, &channels, 3) : NULL;
+    stage_end(&frame);
+    if (!image_data)
+        stego_error("Cannot decode image: %s\n", stbi_failure_reason());
+    return image_data;
+}
+
+// Shared by stego_extract and stego_extract_memory; takes ownership of the pixels
+static int extract_pixels(const stego_ctx_t *ctx, unsigned char *image_data, int width, int height, void **data,
+                          size_t *size, stego_info_t *info)
+{
+    if (!image_data)
+        return 1;
+    file_metadata_t metadata;
+    unsigned char *payload = NULL;
+    int r = decode_payload(image_data, width, height, &ctx->opts, &metadata, &payload);
+    if (r == 0)
+    {
+        *data = payload;
+        *size = metadata.file_size;
+        if (info)
+            fill_info(info, &metadata, 1, width, height, &ctx->opts);
+    }
+    stbi_image_free(image_data);
+    return r;
+}
+
+int stego_hide(const stego_ctx_t *ctx, const char *cover, const char *output, const void *data, size_t size,
+               const char *extension)
+{
+    file_metadata_t base;
+    extension_metadata(extension, &base);
+
+    api_scope_t saved = api_enter(ctx);
+    int r = hide_buffer(cover, output, data, size, &base, &ctx->opts);
+    api_leave(saved);
+    return r;
+}
+
+int stego_hide_memory(const stego_ctx_t *ctx, const void *cover, size_t cover_size, const void *data, size_t size,
+                      const char *extension, void **png, size_t *png_size)
+{
+    file_metadata_t base;
+    extension_metadata(extension, &base);
+
+    api_scope_t saved = api_enter(ctx);
+    int width, height, r = 1;
+    unsigned char *image_data = load_image_memory(cover, cover_size, &width, &height);
+    if (image_data && embed_payload(image_data, width, height, "in memory", data, size, &base, &ctx->opts) == 0)
+    {
+        // stb builds the PNG in one buffer from our allocator; hand it over as is
+        // unless it came from the arena
+        int len;
+        stage_frame_t frame;
+        stage_begin(&frame, STAGE_ENCODE);
+        unsigned char *out = stbi_write_png_to_mem(image_data, width * 3, width, height, 3, &len);
+        stage_end(&frame);
+        if (out && arena_owns(stego_arena, out))
+        {
+            // Arena memory is reclaimed when the call returns
+            unsigned char *copy = heap_malloc(len);
+            if (copy)
+                memcpy(copy, out, len);
+            stego_free(out);
+            out = copy;
+        }
+        if (out)
+        {
+            *png = out;
+            *png_size = len;
+            r = 0;
+        }
+        else
+        {
+            stego_error("Failed to encode PNG\n");
+        }
+    }
+    stbi_image_free(image_data);
+    api_leave(saved);
+    return r;
+}
+
+int stego_extract(const stego_ctx_t *ctx, const char *image, void **data, size_t *size, stego_info_t *info)
+{
+    api_scope_t saved = api_enter(ctx);
+    int width, height;
+    unsigned char *image_data = load_image(image, &width, &height);
+    int r = extract_pixels(ctx, image_data, width, height, data, size, info);
+    api_leave(saved);
+    return r;
+}
+
+int stego_extract_memory(const stego_ctx_t *ctx, const void *image, size_t image_size, void **data, size_t *size,
+                         stego_info_t *info)
+{
+    api_scope_t saved = api_enter(ctx);
+    int width, height;
+    unsigned char *image_data = load_image_memory(image, image_size, &width, &height);
+    int r = extract_pixels(ctx, image_data, width, height, data, size, info);
+    api_leave(saved);
+    return r;
+}
+
+int stego_probe(const stego_ctx_t *ctx, const char *image, stego_info_t *info)
+{
+    api_scope_t saved = api_enter(ctx);
+
+    int width, height, r = 1;
+    unsigned char *image_data = load_image(image, &width, &height);
+    if (image_data)
+    {
+        file_metadata_t metadata;
+        size_t position;
+        int has_payload = read_metadata(image_data, width, height, &metadata, &position) == 0;
+        fill_info(info, &metadata, has_payload, width, height, &ctx->opts);
+        stbi_image_free(image_data);
+        r = 0;
+    }
+
+    api_leave(saved);
+    return r;
+}
+
+void stego_buffer_free(const stego_ctx_t *ctx, void *data)
+{
+    (ctx->allocator.free)(ctx->allocator.user, data);
+}
+
+const char *stego_last_error(void)
+{
+    return stego_error_message;
+}
+
+#ifndef STEGO_LIBRARY
+static int load_payload(const char *stego_image, const stego_options_t *opts, file_metadata_t *metadata,
+                        unsigned char **file_data)
+{
+    int width, height;
+    unsigned char *image_data = load_image(stego_image, &width, &height);
+    if (!image_data)
+        return 1;
+
+    int r = decode_payload(image_data, width, height, opts, metadata, file_data);
+    stbi_image_free(image_data);
+    return r;
+}
+
+// Lazy decoding for the mount. A PNG in the common layout (8-bit gray or RGB,
+// with or without alpha, not interlaced) is not decoded up front:
+// stego_fs.image_data is reserved address space the size of the RGB image,
+// and bands of rows are inflated into it the first time a read or write
+// touches them, so a mount only pays for the header rows. zlib only moves
+// forward, so the inflate state is checkpointed at each band boundary it
+// passes and a band dropped from the cache is decoded again from its own
+// checkpoint. Clean bands beyond FS_BAND_CACHE_BYTES are released least
+// recently used first; written bands stay until the image is saved. Other
+// images are decoded whole by stbi, as before.
+#define FS_BAND_BYTES ((size_t)1 << 20)        // decoded size a band is cut to
+#define FS_BAND_CACHE_BYTES ((size_t)64 << 20) // clean bands kept resident
+#define FS_HEADER_BYTES 1024                   // carrier bytes behind the longest header
+
+enum
+{
+    BAND_ABSENT,
+    BAND_CLEAN,
+    BAND_DIRTY
+};
+
+typedef struct
+{
+    z_stream strm;
+    const unsigned char *chunk_end; // end of the IDAT data zlib is reading
+    unsigned char *prior;           // previous unfiltered scanline
+} png_checkpoint_t;
+
+struct png_bands
+{
+    unsigned char *map; // the PNG file, NULL when there is no source to decode again from
+    size_t map_size;
+    int width;
+    int height;
+    int channels;
+    size_t stride; // source scanline bytes, without the filter byte
+    int band_rows;
+    size_t band_bytes; // decoded RGB bytes of a full band
+    int bands;
+    png_checkpoint_t **checkpoints; // at the first row of bands [0, checkpointed)
+    int checkpointed;
+    uint8_t *state;
+    uint64_t *used; // LRU ticks
+    uint64_t tick;
+    int clean;          // resident bands that were not written
+    unsigned char *row; // filter byte + scanline
+};
+
+static uint32_t png_be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Points the stream at the next IDAT chunk after the one it finished
+static int png_next_idat(const png_bands_t *png, png_checkpoint_t *cp)
+{
+    const unsigned char *p = cp->chunk_end + 4, *end = png->map + png->map_size; // skip the CRC
+    while (end - p >= 8)
+    {
+        uint32_t len = png_be32(p);
+        if (len > (size_t)(end - p) - 8)
+            return -1;
+        if (memcmp(p + 4, "IDAT", 4) != 0)
+            return -1;
+        cp->strm.next_in = (unsigned char *)p + 8;
+        cp->strm.avail_in = len;
+        cp->chunk_end = p + 8 + len;
+        if (len)
+            return 0;
+        p = cp->chunk_end + 4;
+    }
+    return -1;
+}
+
+static int png_paeth(int a, int b, int c)
+{
+    int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Inflates and unfilters `rows` scanlines; `out` (NULL to skip) receives them as RGB
+static int png_inflate_rows(png_bands_t *png, png_checkpoint_t *cp, int rows, unsigned char *out)
+{
+    int bpp = png->channels;
+    for (int y = 0; y < rows; y++)
+    {
+        cp->strm.next_out = png->row;
+        cp->strm.avail_out = 1 + png->stride;
+        while (cp->strm.avail_out)
+        {
+            if (!cp->strm.avail_in && png_next_idat(png, cp) != 0)
+                return -1;
+            int r = inflate(&cp->strm, Z_NO_FLUSH);
+            if ((r != Z_OK && r != Z_BUF_ERROR && r != Z_STREAM_END) || (r == Z_STREAM_END && cp->strm.avail_out))
+                return -1;
+        }
+
+        unsigned char *cur = png->row + 1, *prior = cp->prior;
+        for (size_t i = 0; i < png->stride; i++)
+        {
+            int a = i >= (size_t)bpp ? cur[i - bpp] : 0, b = prior[i], c = i >= (size_t)bpp ? prior[i - bpp] : 0;
+            switch (png->row[0])
+            {
+            case 0:
+                break;
+            case 1:
+                cur[i] += a;
+                break;
+            case 2:
+                cur[i] += b;
+                break;
+            case 3:
+                cur[i] += (a + b) >> 1;
+                break;
+            case 4:
+                cur[i] += png_paeth(a, b, c);
+                break;
+            default:
+                return -1;
+            }
+        }
+        memcpy(prior, cur, png->stride);
+
+        if (!out)
+            continue;
+        // Alpha is dropped and gray spread over RGB, as stbi does for 3 channels
+        unsigned char *rgb = out + (size_t)y * png->width * 3;
+        for (int x = 0; x < png->width; x++)
+        {
+            const unsigned char *px = cur + (size_t)x * bpp;
+            int gray = bpp < 3;
+            rgb[x * 3] = px[0];
+            rgb[x * 3 + 1] = px[gray ? 0 : 1];
+            rgb[x * 3 + 2] = px[gray ? 0 : 2];
+        }
+    }
+    return 0;
+}
+
+// Checkpoints live on the heap and are never moved: zlib keeps a pointer
+// back to its z_stream
+static void png_checkpoint_free(png_checkpoint_t *cp)
+{
+    if (!cp)
+        return;
+    inflateEnd(&cp->strm);
+    free(cp->prior);
+    free(cp);
+}
+
+static png_checkpoint_t *png_checkpoint_copy(const png_bands_t *png, png_checkpoint_t *src)
+{
+    png_checkpoint_t *cp = calloc(1, sizeof(*cp));
+    if (!cp || !(cp->prior = malloc(png->stride)) || inflateCopy(&cp->strm, &src->strm) != Z_OK)
+    {
+        if (cp)
+            free(cp->prior);
+        free(cp);
+        return NULL;
+    }
+    memcpy(cp->prior, src->prior, png->stride);
+    cp->chunk_end = src->chunk_end;
+    return cp;
+}
+
+static void png_bands_unmap(png_bands_t *png)
+{
+    for (int b = 0; b < png->checkpointed; b++)
+        png_checkpoint_free(png->checkpoints[b]);
+    png->checkpointed = 0;
+    if (png->map)
+        munmap(png->map, png->map_size);
+    png->map = NULL;
+}
+
+// Maps the PNG at `path` and readies a stream at its first IDAT chunk; fails
+// for layouts only stbi handles and, when reopening after a save, for an
+// image that no longer matches the one being decoded
+static int png_bands_map(png_bands_t *png, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 8 + 25 + 12)
+    {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    png->map = map;
+    png->map_size = st.st_size;
+
+    // Signature, then IHDR: 8-bit depth, gray/RGB/GA/RGBA, deflate, no interlace
+    const unsigned char *p = png->map, *end = png->map + png->map_size;
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    static const int channels[7] = {1, 0, 3, 0, 2, 0, 4};
+    if (memcmp(p, signature, 8) != 0 || png_be32(p + 8) != 13 || memcmp(p + 12, "IHDR", 4) != 0 || p[24] != 8 ||
+        p[25] > 6 || !channels[p[25]] || p[26] || p[27] || p[28])
+        return -1;
+    uint32_t width = png_be32(p + 16), height = png_be32(p + 20);
+    if (width == 0 || height == 0 || width > (1 << 24) || height > (1 << 24))
+        return -1;
+    if (png->bands && (png->width != (int)width || png->height != (int)height || png->channels != channels[p[25]]))
+        return -1;
+    if (!png->bands)
+    {
+        png->width = width;
+        png->height = height;
+        png->channels = channels[p[25]];
+        png->stride = (size_t)width * png->channels;
+        size_t row_bytes = (size_t)width * 3;
+        png->band_rows = row_bytes >= FS_BAND_BYTES ? 1 : FS_BAND_BYTES / row_bytes;
+        png->band_bytes = png->band_rows * row_bytes;
+        png->bands = (png->height + png->band_rows - 1) / png->band_rows;
+        png->checkpoints = calloc(png->bands, sizeof(*png->checkpoints));
+        png->state = calloc(png->bands, 1);
+        png->used = calloc(png->bands, sizeof(uint64_t));
+        png->row = malloc(1 + png->stride);
+        if (!png->checkpoints || !png->state || !png->used || !png->row)
+            return -1;
+    }
+
+    // The stream starts in the first IDAT chunk
+    png_checkpoint_t *cp = calloc(1, sizeof(*cp));
+    if (!cp)
+        return -1;
+    cp->chunk_end = p + 8 + 8 + 13; // end of the IHDR data
+    while (cp->chunk_end + 12 <= end && memcmp(cp->chunk_end + 8, "IDAT", 4) != 0)
+    {
+        uint32_t len = png_be32(cp->chunk_end + 4);
+        if (len > (size_t)(end - cp->chunk_end) - 12)
+            break;
+        cp->chunk_end += 12 + len;
+    }
+    if (!(cp->prior = calloc(1, png->stride)) || png_next_idat(png, cp) != 0 || inflateInit(&cp->strm) != Z_OK)
+    {
+        free(cp->prior);
+        free(cp);
+        return -1;
+    }
+    png->checkpoints[0] = cp;
+    png->checkpointed = 1;
+    return 0;
+}
+
+static void png_bands_close(png_bands_t *png)
+{
+    if (!png)
+        return;
+    png_bands_unmap(png);
+    free(png->checkpoints);
+    free(png->state);
+    free(png->used);
+    free(png->row);
+    free(png);
+}
+
+static png_bands_t *png_bands_open(const char *path, int *width, int *height)
+{
+    png_bands_t *png = calloc(1, sizeof(*png));
+    if (!png || png_bands_map(png, path) != 0)
+    {
+        png_bands_close(png);
+        return NULL;
+    }
+    *width = png->width;
+    *height = png->height;
+    return png;
+}
+
+// Inflates band `b` from its checkpoint, into `image` unless it is resident,
+// and checkpoints the band after it if the stream got no further before
+static int png_band_inflate(png_bands_t *png, unsigned char *image, int b)
+{
+    png_checkpoint_t *work = png_checkpoint_copy(png, png->checkpoints[b]);
+    if (!work)
+        return -1;
+    int rows = png->height - b * png->band_rows < png->band_rows ? png->height - b * png->band_rows : png->band_rows;
+    int store = png->state[b] == BAND_ABSENT;
+    if (png_inflate_rows(png, work, rows, store ? image + b * png->band_bytes : NULL) != 0)
+    {
+        png_checkpoint_free(work);
+        return -1;
+    }
+    if (store)
+    {
+        png->state[b] = BAND_CLEAN;
+        png->clean++;
+    }
+    png->used[b] = ++png->tick;
+    if (b + 1 == png->checkpointed && b + 1 < png->bands)
+        png->checkpoints[png->checkpointed++] = work;
+    else
+        png_checkpoint_free(work);
+    return 0;
+}
+
+static int png_band_decode(png_bands_t *png, unsigned char *image, int b)
+{
+    stage_frame_t frame;
+    stage_begin(&frame, STAGE_DECODE);
+    int r = 0;
+    // Bands past the furthest checkpoint are reached by decoding forward, and kept
+    while (r == 0 && png->checkpointed <= b)
+        r = png_band_inflate(png, image, png->checkpointed - 1);
+    if (r == 0 && png->state[b] == BAND_ABSENT)
+        r = png_band_inflate(png, image, b);
+    stage_end(&frame);
+    return r;
+}
+
+// Releases the least recently used clean bands outside [keep_from, keep_to]
+// until the cache is back within its budget
+static void png_bands_trim(png_bands_t *png, unsigned char *image, int keep_from, int keep_to)
+{
+    int budget = FS_BAND_CACHE_BYTES / png->band_bytes > 2 ? FS_BAND_CACHE_BYTES / png->band_bytes : 2;
+    size_t page = sysconf(_SC_PAGESIZE);
+    while (png->map && png->clean > budget)
+    {
+        int victim = -1;
+        for (int b = 0; b < png->bands; b++)
+            if (png->state[b] == BAND_CLEAN && (b < keep_from || b > keep_to) &&
+                (victim < 0 || png->used[b] < png->used[victim]))
+                victim = b;
+        if (victim < 0)
+            return;
+        // Only whole pages inside the band; the ones it shares with its
+        // neighbours stay
+        uintptr_t from = (uintptr_t)(image + victim * png->band_bytes);
+        uintptr_t to = from + png->band_bytes;
+        from = (from + page - 1) & ~(page - 1);
+        to &= ~(page - 1);
+        if (to > from)
+            madvise((void *)from, to - from, MADV_DONTNEED);
+        png->state[victim] = BAND_ABSENT;
+        png->clean--;
+    }
+}
+
+// Makes carrier bytes [from, to) resident; `dirty` pins them until the next save
+static int fs_carrier_load(size_t from, size_t to, int dirty)
+{
+    png_bands_t *png = stego_fs.bands;
+    if (!png || from >= to)
+        return 0;
+    int first = from / png->band_bytes, last = (to - 1) / png->band_bytes;
+    last = last < png->bands ? last : png->bands - 1;
+    for (int b = first; b <= last; b++)
+    {
+        if (png->state[b] == BAND_ABSENT && png_band_decode(png, stego_fs.image_data, b) != 0)
+        {
+            fprintf(stderr, "Failed to decode rows %d-%d of %s\n", b * png->band_rows,
+                    (b + 1) * png->band_rows - 1, stego_fs.image_path);
+            return -EIO;
+        }
+        png->used[b] = ++png->tick;
+        if (dirty && png->state[b] == BAND_CLEAN)
+        {
+            png->state[b] = BAND_DIRTY;
+            png->clean--;
+        }
+    }
+    png_bands_trim(png, stego_fs.image_data, first, last);
+    return 0;
+}
+
+// Only once a save has replaced the image: every band is resident and
+// matches the new file, which later evictions decode from. If that file
+// cannot be mapped back or is not complete up to its IEND chunk, the bands
+// stay resident and nothing is evicted again
+static void fs_bands_saved(void)
+{
+    png_bands_t *png = stego_fs.bands;
+    png_bands_unmap(png);
+    memset(png->state, BAND_CLEAN, png->bands);
+    png->clean = png->bands;
+    if (png_bands_map(png, stego_fs.image_path) != 0 ||
+        memcmp(png->map + png->map_size - 12, "\0\0\0\0IEND", 8) != 0)
+    {
+        png_bands_unmap(png);
+        fprintf(stderr, "Cannot read back %s; keeping the whole image in memory\n", stego_fs.image_path);
+        return;
+    }
+    png_bands_trim(png, stego_fs.image_data, -1, -1);
+}
+
+// The carrier bytes behind payload bytes [offset, offset + len) of `file`:
+// consecutive for plain images, anywhere for scattered or ECC interleaved ones
+static int fs_payload_load(const stego_file_t *file, size_t offset, size_t len, int dirty)
+{
+    size_t total = (size_t)stego_fs.width * stego_fs.height * 3;
+    if (stego_fs.metadata.flags & (STEGO_FLAG_SCATTER | STEGO_FLAG_ECC))
+        return fs_carrier_load(0, total, dirty);
+    size_t from = file->offset + offset * 8, to = from + len * 8;
+    return fs_carrier_load(from, to < total ? to : total, dirty);
+}
+
+// Decodes the header rows of a PNG and leaves the rest for fs_carrier_load();
+// other images are decoded in full
+static unsigned char *fs_load_image(const char *path)
+{
+    stego_fs.bands = strcmp(path, "-") != 0 ? png_bands_open(path, &stego_fs.width, &stego_fs.height) : NULL;
+    if (!stego_fs.bands)
+        return load_image(path, &stego_fs.width, &stego_fs.height);
+    size_t size = (size_t)stego_fs.width * stego_fs.height * 3;
+    void *image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (image == MAP_FAILED)
+    {
+        png_bands_close(stego_fs.bands);
+        stego_fs.bands = NULL;
+        return load_image(path, &stego_fs.width, &stego_fs.height);
+    }
+    stego_fs.image_data = image;
+    if (fs_carrier_load(0, size < FS_HEADER_BYTES ? size : FS_HEADER_BYTES, 0) != 0)
+    {
+        munmap(image, size);
+        png_bands_close(stego_fs.bands);
+        stego_fs.bands = NULL;
+        return NULL;
+    }
+    return image;
+}
+
+static void fs_free_image(void)
+{
+    if (!stego_fs.bands)
+    {
+        stbi_image_free(stego_fs.image_data);
+        return;
+    }
+    munmap(stego_fs.image_data, (size_t)stego_fs.width * stego_fs.height * 3);
+    png_bands_close(stego_fs.bands);
+    stego_fs.bands = NULL;
+}
+
+static stego_payload_t stego_fs_payload(const stego_file_t *file)
+{
+    size_t base = header_bits(&stego_fs.metadata);
+    stego_payload_t payload = {stego_fs.image_data, (size_t)stego_fs.width * stego_fs.height * 3,
+                               base, file->offset - base, &stego_fs.cipher, &stego_fs.scatter, NULL};
+    return payload;
+}
+
+// Files are runs of the payload stream, [offset, offset + size * 8) in carrier
+// bits. New files go to the first free spot, and before a file grows into
+// others either it or they move to the first gap that holds them, so no two
+// files share carrier bytes and space freed by unlink is used again.
+static size_t fs_used_end(void)
+{
+    size_t end = header_bits(&stego_fs.metadata);
+    for (size_t i = 0; i < stego_fs.file_count; i++)
+    {
+        size_t e = stego_fs.files[i].offset + stego_fs.files[i].size * 8;
+        end = e > end ? e : end;
+    }
+    return end;
+}
+
+// A file other than `self` with bytes in carrier bits [from, to), or NULL
+static stego_file_t *fs_range_owner(const stego_file_t *self, size_t from, size_t to)
+{
+    for (size_t i = 0; i < stego_fs.file_count; i++)
+    {
+        stego_file_t *f = &stego_fs.files[i];
+        if (f != self && f->size && f->offset < to && f->offset + f->size * 8 > from)
+            return f;
+    }
+    return NULL;
+}
+
+// The lowest carrier bit from which `bytes` (at least one) bytes hold no other file
+static size_t fs_find_room(const stego_file_t *self, size_t bytes)
+{
+    size_t at = header_bits(&stego_fs.metadata);
+    const stego_file_t *f;
+    while ((f = fs_range_owner(self, at, at + (bytes ? bytes : 1) * 8)))
+        at = f->offset + f->size * 8;
+    return at;
+}
+
+// Copies the contents of `file` to carrier bit `offset`; its id, and so its
+// cached pages, stay valid. The caller holds the lock.
+static int fs_file_move(stego_file_t *file, size_t offset)
+{
+    unsigned char *buf = malloc(file->size ? file->size : 1);
+    if (!buf)
+        return -ENOMEM;
+    stego_payload_t payload = stego_fs_payload(file);
+    int r = fs_payload_load(file, 0, file->size, 0) != 0 || payload_read(&payload, 0, buf, file->size) != 0 ? -EIO : 0;
+    size_t old = file->offset;
+    file->offset = offset;
+    payload = stego_fs_payload(file);
+    if (r == 0 && fs_payload_load(file, 0, file->size, 1) != 0)
+        r = -EIO;
+    if (r == 0 && payload_write(&payload, 0, buf, file->size) != 0)
+        r = -ENOSPC;
+    if (r != 0)
+        file->offset = old;
+    free(buf);
+    return r;
+}
+
+// Whichever copies fewer bytes moves: the file, or the files in its way
+static int fs_file_grow(stego_file_t *file, size_t new_size)
+{
+    size_t from = file->offset, to = file->offset + new_size * 8, blocking = 0;
+    if (new_size <= file->size || !fs_range_owner(file, from, to))
+        return 0;
+    for (size_t i = 0; i < stego_fs.file_count; i++)
+    {
+        const stego_file_t *f = &stego_fs.files[i];
+        if (f != file && f->size && f->offset < to && f->offset + f->size * 8 > from)
+            blocking += f->size;
+    }
+    if (blocking >= file->size)
+        return fs_file_move(file, fs_find_room(file, new_size));
+
+    // The file claims its new range while the others find room elsewhere
+    size_t size = file->size;
+    file->size = new_size;
+    stego_file_t *f;
+    int r = 0;
+    while (r == 0 && (f = fs_range_owner(file, from, to)))
+        r = fs_file_move(f, fs_find_room(f, f->size));
+    file->size = size;
+    return r;
+}
+
+// Moves `file` to just after the header, where extract finds a payload,
+// moving any file in the way to the end first
+static int fs_file_rehome(stego_file_t *file)
+{
+    size_t base = header_bits(&stego_fs.metadata);
+    if (file->offset == base)
+        return 0;
+    for (size_t i = 0; i < stego_fs.file_count; i++)
+    {
+        stego_file_t *f = &stego_fs.files[i];
+        int r = f != file && f->size && f->offset < base + file->size * 8 ? fs_file_move(f, fs_used_end()) : 0;
+        if (r != 0)
+            return r;
+    }
+    return fs_file_move(file, base);
+}
+
+// ECC images are read codeword by codeword so mounted reads are corrected too
+static int stego_fs_read_ecc(const stego_file_t *file, unsigned char *buf, size_t size, size_t offset)
+{
+    gf_init();
+    int nsym = stego_fs.metadata.ecc_parity;
+    size_t k = RS_DATA(nsym);
+    size_t ncw = ecc_codewords(file->size, nsym);
+    stego_payload_t payload = stego_fs_payload(file);
+    uint8_t cw[RS_CODEWORD];
+    if (fs_payload_load(file, 0, file->size, 0) != 0)
+        return -EIO;
+    for (size_t c = offset / k; c * k < offset + size; c++)
+    {
+        for (int t = 0; t < RS_CODEWORD; t++)
+        {
+            if (payload_read(&payload, t * ncw + c, &cw[t], 1) != 0)
+                return -EIO;
+        }
+        if (rs_decode_block(cw, nsym) < 0)
+            return -EIO;
+
+        size_t from = c * k > offset ? c * k : offset;
+        size_t to = (c + 1) * k < offset + size ? (c + 1) * k : offset + size;
+        memcpy(buf + (from - offset), cw + (from - c * k), to - from);
+    }
+    return 0;
+}
+
+// Mount statistics. Every operation is timed into per-thread counters and
+// log2 latency histograms that only their own thread writes, so recording
+// never takes a lock or bounces a shared cache line; readers sum all blocks.
+// Blocks of exited threads are handed to new ones with their counts intact.
+// The totals, save timings and waits on stego_fs.mutex are served as the
+// read-only file /.stego_stats.
+#define FS_STATS_NAME ".stego_stats"
+#define FS_HIST_BUCKETS 36 // bucket b holds latencies in [2^b, 2^(b+1)) ns; the last one is open-ended
+
+typedef enum
+{
+    FS_OP_LOOKUP,
+    FS_OP_GETATTR,
+    FS_OP_SETATTR,
+    FS_OP_READDIR,
+    FS_OP_OPEN,
+    FS_OP_CREATE,
+    FS_OP_WRITE,
+    FS_OP_READ,
+    FS_OP_RELEASE,
+    FS_OP_UNLINK,
+    FS_OP_SAVE,      // save_filesystem
+    FS_OP_LOCK_WAIT, // contended acquisitions of stego_fs.mutex
+    FS_OP_COUNT
+} fs_op_t;
+
+static const char *const fs_op_names[FS_OP_COUNT] = {"lookup", "getattr", "setattr", "readdir", "open",
+                                                     "create", "write",   "read",    "release", "unlink",
+                                                     "save",   "lockwait"};
+
+typedef struct fs_stats
+{
+    struct fs_stats *next;
+    int in_use;
+    uint64_t calls[FS_OP_COUNT];
+    uint64_t errors[FS_OP_COUNT];
+    uint64_t total_ns[FS_OP_COUNT];
+    uint64_t max_ns[FS_OP_COUNT];
+    uint64_t hist[FS_OP_COUNT][FS_HIST_BUCKETS];
+} __attribute__((aligned(64))) fs_stats_t;
+
+static fs_stats_t *fs_stats_list;
+static __thread fs_stats_t *fs_stats_mine;
+static pthread_key_t fs_stats_key;
+static pthread_once_t fs_stats_once = PTHREAD_ONCE_INIT;
+
+static void fs_stats_release(void *arg)
+{
+    __atomic_store_n(&((fs_stats_t *)arg)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void fs_stats_key_init(void)
+{
+    pthread_key_create(&fs_stats_key, fs_stats_release);
+}
+
+static fs_stats_t *fs_stats_get(void)
+{
+    if (fs_stats_mine)
+        return fs_stats_mine;
+    pthread_once(&fs_stats_once, fs_stats_key_init);
+    fs_stats_t *s;
+    for (s = __atomic_load_n(&fs_stats_list, __ATOMIC_ACQUIRE); s; s = s->next)
+    {
+        int idle = 0;
+        if (__atomic_compare_exchange_n(&s->in_use, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (!s)
+    {
+        if (posix_memalign((void **)&s, 64, sizeof(*s)) != 0)
+            return NULL;
+        memset(s, 0, sizeof(*s));
+        s->in_use = 1;
+        s->next = __atomic_load_n(&fs_stats_list, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&fs_stats_list, &s->next, s, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(fs_stats_key, s);
+    fs_stats_mine = s;
+    return s;
+}
+
+static uint64_t fs_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Single writer per block: relaxed load and store, no locked instructions
+static inline void fs_stat_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static void fs_stats_record(fs_op_t op, uint64_t start, int result)
+{
+    fs_stats_t *s = fs_stats_get();
+    if (!s)
+        return;
+    uint64_t ns = fs_now_ns() - start;
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    fs_stat_add(&s->calls[op], 1);
+    fs_stat_add(&s->errors[op], result < 0);
+    fs_stat_add(&s->total_ns[op], ns);
+    fs_stat_add(&s->hist[op][bucket < FS_HIST_BUCKETS ? bucket : FS_HIST_BUCKETS - 1], 1);
+    if (ns > __atomic_load_n(&s->max_ns[op], __ATOMIC_RELAXED))
+        __atomic_store_n(&s->max_ns[op], ns, __ATOMIC_RELAXED);
+}
+
+// Locks the filesystem, timing the wait when another thread holds it
+static void fs_lock(void)
+{
+    if (pthread_mutex_trylock(&stego_fs.mutex) == 0)
+        return;
+    uint64_t start = fs_now_ns();
+    pthread_mutex_lock(&stego_fs.mutex);
+    fs_stats_record(FS_OP_LOCK_WAIT, start, 0);
+}
+
+// A mount can't recompute ECC or cross-image parity, and a stripe or chunk
+// store image only makes sense together with its set, so those are read-only
+static int fs_read_only(void)
+{
+    return (stego_fs.metadata.flags &
+            (STEGO_FLAG_ECC | STEGO_FLAG_STRIPED | STEGO_FLAG_PARITY | STEGO_FLAG_CHUNKED)) != 0;
+}
+
+// Sequential read-ahead. Every file opened for reading gets a handle in
+// fi->fh that follows where its reader is. Once reads arrive back to back, a
+// helper thread decodes the next window of the file into the handle's buffer
+// and the following reads are a memcpy. It decodes in chunks so other
+// operations get the lock in between, and the window doubles each time one is
+// consumed, as the kernel's read-ahead does. A buffer remembers the file
+// version it was decoded from and is dropped once a write or truncate moves it.
+#define FS_READAHEAD_MIN (128 * 1024)
+#define FS_READAHEAD_MAX (4 * 1024 * 1024)
+#define FS_READAHEAD_CHUNK (256 * 1024) // decoded per hold of stego_fs.mutex
+#define FS_READAHEAD_STREAK 2           // back-to-back reads before reading ahead
+
+typedef struct fs_handle
+{
+    struct fs_handle *next; // in the helper's queue
+    pthread_mutex_t lock;   // taken after stego_fs.mutex, never before
+    pthread_cond_t filled;
+    uint64_t file;      // stego_file_t.id
+    unsigned char *buf; // decoded bytes [buf_offset, buf_offset + buf_len)
+    size_t buf_offset;
+    size_t buf_len;
+    size_t buf_cap;
+    uint64_t version;
+    size_t next_offset; // where a sequential reader continues
+    int streak;
+    size_t window;
+    size_t ahead_offset; // the range handed to the helper
+    size_t ahead_len;
+    int inflight;
+    int queued;
+} fs_handle_t;
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+    fs_handle_t *head;
+    fs_handle_t *tail;
+    fs_handle_t *current; // being decoded into, so release waits for it
+    pthread_t thread;
+    int running;
+    int stop;
+} fs_readahead = {
+    .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER};
+
+static uint64_t fs_readahead_hits, fs_readahead_bytes;
+
+static stego_file_t *fs_lookup(const char *name)
+{
+    for (size_t i = 0; i < stego_fs.file_count; i++)
+    {
+        if (strcmp(name, stego_fs.files[i].name) == 0)
+            return &stego_fs.files[i];
+    }
+    return NULL;
+}
+
+// By id, which is what inodes and handles carry; at most MAX_FILES compares
+static stego_file_t *fs_file(uint64_t id)
+{
+    for (size_t i = 0; i < stego_fs.file_count; i++)
+    {
+        if (stego_fs.files[i].id == id)
+            return &stego_fs.files[i];
+    }
+    return NULL;
+}
+
+// Decodes `size` bytes of a file at `offset`; the caller holds the lock
+static int fs_file_extract(const stego_file_t *file, unsigned char *buf, size_t size, size_t offset)
+{
+    if (stego_fs.metadata.flags & STEGO_FLAG_ECC)
+        return stego_fs_read_ecc(file, buf, size, offset);
+    if (fs_payload_load(file, offset, size, 0) != 0)
+        return -EIO;
+    stego_payload_t payload = stego_fs_payload(file);
+    return payload_read(&payload, offset, buf, size);
+}
+
+static fs_handle_t *fs_handle_new(uint64_t file)
+{
+    fs_handle_t *h = calloc(1, sizeof(*h));
+    if (!h)
+        return NULL;
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_cond_init(&h->filled, NULL);
+    h->file = file;
+    h->window = FS_READAHEAD_MIN;
+    return h;
+}
+
+static void fs_handle_free(fs_handle_t *h)
+{
+    if (!h)
+        return;
+    pthread_mutex_lock(&fs_readahead.lock);
+    if (h->queued)
+    {
+        fs_handle_t **link = &fs_readahead.head, *prev = NULL;
+        while (*link != h)
+            prev = *link, link = &(*link)->next;
+        *link = h->next;
+        if (fs_readahead.tail == h)
+            fs_readahead.tail = prev;
+    }
+    while (fs_readahead.current == h)
+        pthread_cond_wait(&fs_readahead.idle, &fs_readahead.lock);
+    pthread_mutex_unlock(&fs_readahead.lock);
+    pthread_cond_destroy(&h->filled);
+    pthread_mutex_destroy(&h->lock);
+    free(h->buf);
+    free(h);
+}
+
+// Appends decoded bytes to the buffer, first dropping what the reader has
+// already passed; h->lock is held
+static int fs_handle_append(fs_handle_t *h, const unsigned char *data, size_t len)
+{
+    if (h->buf_len + len > h->buf_cap)
+    {
+        size_t passed = h->next_offset > h->buf_offset ? h->next_offset - h->buf_offset : 0;
+        passed = passed < h->buf_len ? passed : h->buf_len;
+        if (passed)
+        {
+            memmove(h->buf, h->buf + passed, h->buf_len - passed);
+            h->buf_offset += passed;
+            h->buf_len -= passed;
+        }
+    }
+    if (h->buf_len + len > h->buf_cap)
+    {
+        size_t cap = h->buf_len + len > 2 * h->window ? h->buf_len + len : 2 * h->window;
+        unsigned char *buf = realloc(h->buf, cap);
+        if (!buf)
+            return -1;
+        h->buf = buf;
+        h->buf_cap = cap;
+    }
+    memcpy(h->buf + h->buf_len, data, len);
+    h->buf_len += len;
+    return 0;
+}
+
+static void fs_readahead_fill(fs_handle_t *h)
+{
+    unsigned char *chunk = malloc(FS_READAHEAD_CHUNK);
+    pthread_mutex_lock(&h->lock);
+    size_t offset = h->ahead_offset, end = h->ahead_offset + h->ahead_len;
+    uint64_t version = h->version;
+    pthread_mutex_unlock(&h->lock);
+
+    while (chunk && offset < end)
+    {
+        size_t n = end - offset < FS_READAHEAD_CHUNK ? end - offset : FS_READAHEAD_CHUNK;
+        fs_lock();
+        stego_file_t *file = fs_file(h->file);
+        int r = file && file->version == version && offset + n <= file->size
+                    ? fs_file_extract(file, chunk, n, offset)
+                    : -1;
+        pthread_mutex_lock(&h->lock);
+        // A write, or a read elsewhere in the file, may have reset the buffer meanwhile
+        int ok = r == 0 && h->version == version && h->buf_offset + h->buf_len == offset &&
+                 fs_handle_append(h, chunk, n) == 0;
+        pthread_cond_broadcast(&h->filled);
+        pthread_mutex_unlock(&h->lock);
+        pthread_mutex_unlock(&stego_fs.mutex);
+        if (!ok)
+            break;
+        __atomic_fetch_add(&fs_readahead_bytes, n, __ATOMIC_RELAXED);
+        offset += n;
+    }
+
+    pthread_mutex_lock(&h->lock);
+    h->inflight = 0;
+    pthread_cond_broadcast(&h->filled);
+    pthread_mutex_unlock(&h->lock);
+    free(chunk);
+}
+
+static void *fs_readahead_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&fs_readahead.lock);
+    while (!fs_readahead.stop)
+    {
+        fs_handle_t *h = fs_readahead.head;
+        if (!h)
+        {
+            pthread_cond_wait(&fs_readahead.wake, &fs_readahead.lock);
+            continue;
+        }
+        fs_readahead.head = h->next;
+        if (!fs_readahead.head)
+            fs_readahead.tail = NULL;
+        h->queued = 0;
+        fs_readahead.current = h;
+        pthread_mutex_unlock(&fs_readahead.lock);
+        fs_readahead_fill(h);
+        pthread_mutex_lock(&fs_readahead.lock);
+        fs_readahead.current = NULL;
+        pthread_cond_broadcast(&fs_readahead.idle);
+    }
+    pthread_mutex_unlock(&fs_readahead.lock);
+    return NULL;
+}
+
+static void fs_readahead_start(void)
+{
+    fs_readahead.stop = 0;
+    fs_readahead.running = pthread_create(&fs_readahead.thread, NULL, fs_readahead_main, NULL) == 0;
+}
+
+static void fs_readahead_stop(void)
+{
+    pthread_mutex_lock(&fs_readahead.lock);
+    int running = fs_readahead.running;
+    fs_readahead.running = 0;
+    fs_readahead.stop = 1;
+    pthread_cond_signal(&fs_readahead.wake);
+    pthread_mutex_unlock(&fs_readahead.lock);
+    if (running)
+        pthread_join(fs_readahead.thread, NULL);
+    for (fs_handle_t *h = fs_readahead.head; h; h = h->next)
+        h->queued = 0;
+    fs_readahead.head = fs_readahead.tail = NULL;
+}
+
+// Hands the helper the window after the buffer once the reader is within half
+// a window of its end; stego_fs.mutex and h->lock are held
+static void fs_readahead_schedule(fs_handle_t *h, const stego_file_t *file)
+{
+    if (h->inflight)
+        return;
+    if (h->buf_offset > h->next_offset || h->buf_offset + h->buf_len < h->next_offset)
+    {
+        // The reader left the buffer behind; start again where it is
+        h->buf_offset = h->next_offset;
+        h->buf_len = 0;
+    }
+    size_t end = h->buf_offset + h->buf_len;
+    if (end >= file->size || end - h->next_offset >= h->window / 2)
+        return;
+
+    pthread_mutex_lock(&fs_readahead.lock);
+    if (fs_readahead.running)
+    {
+        h->ahead_offset = end;
+        h->ahead_len = file->size - end < h->window ? file->size - end : h->window;
+        h->inflight = 1;
+        h->window = h->window < FS_READAHEAD_MAX ? h->window * 2 : FS_READAHEAD_MAX;
+        h->next = NULL;
+        h->queued = 1;
+        if (fs_readahead.tail)
+            fs_readahead.tail->next = h;
+        else
+            fs_readahead.head = h;
+        fs_readahead.tail = h;
+        pthread_cond_signal(&fs_readahead.wake);
+    }
+    pthread_mutex_unlock(&fs_readahead.lock);
+}
+
+// Before taking the lock: if the helper is decoding the range a read wants,
+// waiting for it beats decoding the same bytes twice
+static void fs_readahead_wait(fs_handle_t *h, size_t offset, size_t size)
+{
+    pthread_mutex_lock(&h->lock);
+    while (h->inflight && offset >= h->ahead_offset && offset < h->ahead_offset + h->ahead_len &&
+           offset + size > h->buf_offset + h->buf_len)
+        pthread_cond_wait(&h->filled, &h->lock);
+    pthread_mutex_unlock(&h->lock);
+}
+
+// Serves a read from the handle's buffer when it holds the range, and keeps
+// reading ahead of a sequential reader. Returns 1 on a hit; the lock is held.
+static int fs_readahead_read(fs_handle_t *h, const stego_file_t *file, unsigned char *buf, size_t size,
+                             size_t offset)
+{
+    pthread_mutex_lock(&h->lock);
+    if (h->version != file->version)
+    {
+        h->version = file->version;
+        h->buf_len = 0;
+    }
+    int hit = offset >= h->buf_offset && offset + size <= h->buf_offset + h->buf_len;
+    if (hit)
+    {
+        memcpy(buf, h->buf + (offset - h->buf_offset), size);
+        __atomic_fetch_add(&fs_readahead_hits, 1, __ATOMIC_RELAXED);
+    }
+    h->streak = hit || offset == h->next_offset ? h->streak + 1 : 0;
+    h->next_offset = offset + size;
+    if (h->streak >= FS_READAHEAD_STREAK)
+        fs_readahead_schedule(h, file);
+    else if (h->streak == 0 && !h->inflight)
+        h->window = FS_READAHEAD_MIN;
+    pthread_mutex_unlock(&h->lock);
+    return hit;
+}
+
+// Cache of decoded payload pages. Hot files are re-read far more often than
+// they change, and every read otherwise re-extracts 8 carrier bytes per
+// payload byte. Pages are keyed by (file id, page number) and kept in LRU
+// order, all under stego_fs.mutex; writes, truncates and unlinks drop the
+// pages they touch. Free slots sit at the cold end, so they are used first.
+#define FS_PAGE_SIZE (64 * 1024)
+#define FS_PAGE_CACHE_BYTES (32 * 1024 * 1024)
+#define FS_PAGE_SLOTS (FS_PAGE_CACHE_BYTES / FS_PAGE_SIZE)
+#define FS_PAGE_BUCKETS (2 * FS_PAGE_SLOTS)
+
+typedef struct
+{
+    uint64_t file; // stego_file_t.id; 0 for a free slot
+    size_t page;
+    size_t len; // bytes decoded; short for the last page of a file
+    int hash_next;
+    int lru_prev;
+    int lru_next;
+    unsigned char *data;
+} fs_page_t;
+
+static struct
+{
+    fs_page_t slots[FS_PAGE_SLOTS];
+    int buckets[FS_PAGE_BUCKETS];
+    int head; // most recently used
+    int tail;
+    uint64_t hits;
+    uint64_t misses;
+} fs_pages;
+
+static void fs_pages_init(void)
+{
+    for (int i = 0; i < FS_PAGE_BUCKETS; i++)
+        fs_pages.buckets[i] = -1;
+    for (int i = 0; i < FS_PAGE_SLOTS; i++)
+    {
+        fs_pages.slots[i] = (fs_page_t){0, 0, 0, -1, i - 1, i + 1 < FS_PAGE_SLOTS ? i + 1 : -1, NULL};
+    }
+    fs_pages.head = 0;
+    fs_pages.tail = FS_PAGE_SLOTS - 1;
+}
+
+static void fs_pages_free(void)
+{
+    for (int i = 0; i < FS_PAGE_SLOTS; i++)
+    {
+        free(fs_pages.slots[i].data);
+        fs_pages.slots[i].data = NULL;
+    }
+}
+
+static int *fs_page_bucket(uint64_t file, size_t page)
+{
+    uint64_t h = (file * 0x9E3779B97F4A7C15ULL) ^ (page * 0xC2B2AE3D27D4EB4FULL);
+    return &fs_pages.buckets[(h >> 32) % FS_PAGE_BUCKETS];
+}
+
+static void fs_page_lru_remove(int i)
+{
+    fs_page_t *p = &fs_pages.slots[i];
+    if (p->lru_prev >= 0)
+        fs_pages.slots[p->lru_prev].lru_next = p->lru_next;
+    else
+        fs_pages.head = p->lru_next;
+    if (p->lru_next >= 0)
+        fs_pages.slots[p->lru_next].lru_prev = p->lru_prev;
+    else
+        fs_pages.tail = p->lru_prev;
+}
+
+// Links slot i at the hot end, or at the cold end when `cold`
+static void fs_page_lru_insert(int i, int cold)
+{
+    fs_page_t *p = &fs_pages.slots[i];
+    if (cold)
+    {
+        p->lru_prev = fs_pages.tail;
+        p->lru_next = -1;
+        if (fs_pages.tail >= 0)
+            fs_pages.slots[fs_pages.tail].lru_next = i;
+        else
+            fs_pages.head = i;
+        fs_pages.tail = i;
+    }
+    else
+    {
+        p->lru_prev = -1;
+        p->lru_next = fs_pages.head;
+        if (fs_pages.head >= 0)
+            fs_pages.slots[fs_pages.head].lru_prev = i;
+        else
+            fs_pages.tail = i;
+        fs_pages.head = i;
+    }
+}
+
+static int fs_page_find(uint64_t file, size_t page)
+{
+    for (int i = *fs_page_bucket(file, page); i >= 0; i = fs_pages.slots[i].hash_next)
+    {
+        if (fs_pages.slots[i].file == file && fs_pages.slots[i].page == page)
+            return i;
+    }
+    return -1;
+}
+
+// Unhashes slot i and moves it to the cold end as free
+static void fs_page_release(int i)
+{
+    fs_page_t *p = &fs_pages.slots[i];
+    if (p->file)
+    {
+        int *link = fs_page_bucket(p->file, p->page);
+        while (*link != i)
+            link = &fs_pages.slots[*link].hash_next;
+        *link = p->hash_next;
+        p->file = 0;
+    }
+    fs_page_lru_remove(i);
+    fs_page_lru_insert(i, 1);
+}
+
+// Drops a file's pages first..last (inclusive)
+static void fs_pages_drop(uint64_t file, size_t first, size_t last)
+{
+    if (last - first < FS_PAGE_SLOTS)
+    {
+        for (size_t page = first; page <= last; page++)
+        {
+            int i = fs_page_find(file, page);
+            if (i >= 0)
+                fs_page_release(i);
+        }
+        return;
+    }
+    for (int i = 0; i < FS_PAGE_SLOTS; i++)
+    {
+        fs_page_t *p = &fs_pages.slots[i];
+        if (p->file == file && p->page >= first && p->page <= last)
+            fs_page_release(i);
+    }
+}
+
+// Returns the slot holding `page` of the file with at least `need` bytes,
+// decoding it into the coldest slot on a miss; -1 on a decode error
+static int fs_page_get(const stego_file_t *file, size_t page, size_t need)
+{
+    int i = fs_page_find(file->id, page);
+    if (i >= 0 && fs_pages.slots[i].len >= need)
+    {
+        __atomic_fetch_add(&fs_pages.hits, 1, __ATOMIC_RELAXED);
+        fs_page_lru_remove(i);
+        fs_page_lru_insert(i, 0);
+        return i;
+    }
+    __atomic_fetch_add(&fs_pages.misses, 1, __ATOMIC_RELAXED);
+    if (i < 0)
+        i = fs_pages.tail;
+    fs_page_release(i);
+
+    fs_page_t *p = &fs_pages.slots[i];
+    if (!p->data && !(p->data = malloc(FS_PAGE_SIZE)))
+        return -1;
+    size_t start = page * FS_PAGE_SIZE;
+    p->len = file->size - start < FS_PAGE_SIZE ? file->size - start : FS_PAGE_SIZE;
+    if (fs_file_extract(file, p->data, p->len, start) != 0)
+        return -1;
+
+    p->file = file->id;
+    p->page = page;
+    int *bucket = fs_page_bucket(file->id, page);
+    p->hash_next = *bucket;
+    *bucket = i;
+    fs_page_lru_remove(i);
+    fs_page_lru_insert(i, 0);
+    return i;
+}
+
+// Serves a read through the cache; the range lies within the file
+static int fs_pages_read(const stego_file_t *file, unsigned char *buf, size_t size, size_t offset)
+{
+    while (size > 0)
+    {
+        size_t page = offset / FS_PAGE_SIZE, in_page = offset % FS_PAGE_SIZE;
+        size_t n = FS_PAGE_SIZE - in_page < size ? FS_PAGE_SIZE - in_page : size;
+        int i = fs_page_get(file, page, in_page + n);
+        if (i < 0)
+            return -EIO;
+        memcpy(buf, fs_pages.slots[i].data + in_page, n);
+        buf += n;
+        offset += n;
+        size -= n;
+    }
+    return 0;
+}
+
+// Latency below which a fraction `q` of the op's calls completed, from the
+// histogram: the upper edge of the bucket holding that rank
+static double fs_stats_quantile_us(const uint64_t *hist, uint64_t calls, double q)
+{
+    uint64_t rank = (uint64_t)(q * calls + 0.5), seen = 0;
+    for (int b = 0; b < FS_HIST_BUCKETS; b++)
+    {
+        seen += hist[b];
+        if (seen >= rank && seen > 0)
+            return ((uint64_t)2 << b) / 1e3;
+    }
+    return 0;
+}
+
+// Renders the summed counters as text into a malloc'd buffer
+static char *fs_stats_render(size_t *len)
+{
+    fs_stats_t sum;
+    memset(&sum, 0, sizeof(sum));
+    int threads = 0;
+    for (fs_stats_t *s = __atomic_load_n(&fs_stats_list, __ATOMIC_ACQUIRE); s; s = s->next, threads++)
+    {
+        for (int op = 0; op < FS_OP_COUNT; op++)
+        {
+            sum.calls[op] += __atomic_load_n(&s->calls[op], __ATOMIC_RELAXED);
+            sum.errors[op] += __atomic_load_n(&s->errors[op], __ATOMIC_RELAXED);
+            sum.total_ns[op] += __atomic_load_n(&s->total_ns[op], __ATOMIC_RELAXED);
+            uint64_t max = __atomic_load_n(&s->max_ns[op], __ATOMIC_RELAXED);
+            sum.max_ns[op] = max > sum.max_ns[op] ? max : sum.max_ns[op];
+            for (int b = 0; b < FS_HIST_BUCKETS; b++)
+                sum.hist[op][b] += __atomic_load_n(&s->hist[op][b], __ATOMIC_RELAXED);
+        }
+    }
+
+    size_t cap = 16384, n = 0;
+    char *out = malloc(cap);
+    if (!out)
+        return NULL;
+#define FS_STATS_PRINTF(...) \
+    n += snprintf(out + n, n < cap ? cap - n : 0, __VA_ARGS__)
+    FS_STATS_PRINTF("threads %d\n\n%-9s %10s %8s %10s %10s %10s %10s %12s\n", threads, "op", "calls", "errors",
+                    "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+    for (int op = 0; op < FS_OP_COUNT; op++)
+    {
+        uint64_t calls = sum.calls[op];
+        FS_STATS_PRINTF("%-9s %10llu %8llu %10.1f %10.1f %10.1f %10.1f %12.1f\n", fs_op_names[op],
+                        (unsigned long long)calls, (unsigned long long)sum.errors[op],
+                        calls ? sum.total_ns[op] / 1e3 / calls : 0.0, fs_stats_quantile_us(sum.hist[op], calls, 0.5),
+                        fs_stats_quantile_us(sum.hist[op], calls, 0.9),
+                        fs_stats_quantile_us(sum.hist[op], calls, 0.99), sum.max_ns[op] / 1e3);
+    }
+    FS_STATS_PRINTF("\nreadahead %llu hits, %llu bytes decoded ahead\n",
+                    (unsigned long long)__atomic_load_n(&fs_readahead_hits, __ATOMIC_RELAXED),
+                    (unsigned long long)__atomic_load_n(&fs_readahead_bytes, __ATOMIC_RELAXED));
+    FS_STATS_PRINTF("page cache %llu hits, %llu misses\n",
+                    (unsigned long long)__atomic_load_n(&fs_pages.hits, __ATOMIC_RELAXED),
+                    (unsigned long long)__atomic_load_n(&fs_pages.misses, __ATOMIC_RELAXED));
+    FS_STATS_PRINTF("\nhistograms (bucket upper bound in us: count)\n");
+    for (int op = 0; op < FS_OP_COUNT; op++)
+    {
+        if (!sum.calls[op])
+            continue;
+        FS_STATS_PRINTF("%-9s", fs_op_names[op]);
+        for (int b = 0; b < FS_HIST_BUCKETS; b++)
+        {
+            if (sum.hist[op][b])
+                FS_STATS_PRINTF(" %g:%llu", ((uint64_t)2 << b) / 1e3, (unsigned long long)sum.hist[op][b]);
+        }
+        FS_STATS_PRINTF("\n");
+    }
+#undef FS_STATS_PRINTF
+    if (n >= cap)
+        n = cap - 1; // cut short; a dozen ops never come close
+    *len = n;
+    return out;
+}
+
+// Mounted writes reuse the keystream of the bytes they replace, so before each
+// save the payload in use is decrypted, a fresh salt drawn and everything
+// encrypted (and scattered) again under the new key. The caller has made the
+// whole carrier resident and pinned it.
+static int fs_rekey(void)
+{
+    file_metadata_t *metadata = &stego_fs.metadata;
+    size_t base = header_bits(metadata), total = (size_t)stego_fs.width * stego_fs.height * 3;
+    size_t used = (fs_used_end() - base) / 8;
+    unsigned char *plain = malloc(used ? used : 1);
+    if (!plain)
+        return -1;
+    stego_payload_t payload = {stego_fs.image_data, total, base, 0, &stego_fs.cipher, &stego_fs.scatter, NULL};
+    int r = payload_read(&payload, 0, plain, used);
+    if (r == 0)
+        r = random_bytes(metadata->salt, STEGO_SALT_LENGTH);
+    if (r == 0)
+    {
+        cipher_init(&stego_fs.cipher, stego_fs.passphrase, metadata->salt);
+        if (metadata->flags & STEGO_FLAG_SCATTER)
+            scatter_init(&stego_fs.scatter, &stego_fs.cipher, total - base);
+        r = payload_write(&payload, 0, plain, used);
+    }
+    memset(plain, 0, used);
+    free(plain);
+    return r;
+}
+
+static void save_filesystem() {
+    if (!stego_fs.dirty) return;
+    uint64_t start = fs_now_ns();
+
+    // The encoder needs every row, and the file is about to be overwritten;
+    // rekeying rewrites every row, so then they stay pinned until it is
+    file_metadata_t *metadata = &stego_fs.metadata;
+    int encrypted = (metadata->flags & STEGO_FLAG_ENCRYPTED) != 0;
+    if (fs_carrier_load(0, (size_t)stego_fs.width * stego_fs.height * 3, encrypted) != 0)
+        return;
+    // Only the first file is saved, as the image's payload
+    if (stego_fs.file_count > 0 && fs_file_rehome(&stego_fs.files[0]) != 0)
+    {
+        fprintf(stderr, "No room to save %s; the changes are still pending\n", stego_fs.image_path);
+        fs_stats_record(FS_OP_SAVE, start, -EIO);
+        return;
+    }
+    if (encrypted && fs_rekey() != 0)
+    {
+        fprintf(stderr, "Failed to re-encrypt %s; the changes are still pending\n", stego_fs.image_path);
+        fs_stats_record(FS_OP_SAVE, start, -EIO);
+        return;
+    }
+
+    metadata->file_size = stego_fs.file_count > 0 ? stego_fs.files[0].size : 0;
+
+    // Writes land at arbitrary offsets, so the checksum is recomputed from the
+    // carrier (ECC images are read-only and keep theirs)
+    if ((metadata->flags & STEGO_FLAG_CHECKSUM) && !(metadata->flags & STEGO_FLAG_ECC))
+    {
+        metadata->checksum = 0;
+        if (stego_fs.file_count > 0)
+        {
+            unsigned char chunk[4096];
+            stego_payload_t payload = stego_fs_payload(&stego_fs.files[0]);
+            payload.crc = &metadata->checksum;
+            for (size_t off = 0; off < metadata->file_size; off += sizeof(chunk))
+            {
+                size_t n = metadata->file_size - off < sizeof(chunk) ? metadata->file_size - off : sizeof(chunk);
+                payload_read(&payload, off, chunk, n);
+            }
+        }
+    }
+    write_metadata(stego_fs.image_data, stego_fs.width, stego_fs.height, metadata);
+
+    // The image may be the only copy of the payload: replace it atomically,
+    // and on failure keep it dirty so the next save tries again
+    if (write_image(stego_fs.image_path, stego_fs.image_data, stego_fs.width, stego_fs.height, 0) != 0)
+    {
+        fprintf(stderr, "Failed to save %s; the changes are still pending\n", stego_fs.image_path);
+        fs_stats_record(FS_OP_SAVE, start, -EIO);
+        return;
+    }
+    // The bands may be evicted again now that a complete file backs them
+    if (stego_fs.bands)
+        fs_bands_saved();
+    stego_fs.dirty = 0;
+    fs_stats_record(FS_OP_SAVE, start, 0);
+}
+
+static void *stego_init(struct fuse_conn_info *conn)
+{
+    pthread_mutex_init(&stego_fs.mutex, NULL);
+    fs_pages_init();
+    fs_readahead_start();
+    return NULL;
+}
+
+static void stego_destroy(void *private_data)
+{
+    fs_readahead_stop();
+    fs_lock();
+    save_filesystem();
+    fs_free_image();
+    fs_pages_free();
+    free(stego_fs.image_path);
+    pthread_mutex_unlock(&stego_fs.mutex);
+    pthread_mutex_destroy(&stego_fs.mutex);
+}
+
+// Inode numbers. The root and the stats file have fixed ones; a file's is
+// derived from its id, which is never reused, so an inode the kernel still
+// remembers after an unlink can only miss and never reach a newer file.
+// That is also why forget has nothing to release.
+#define FS_STATS_INO 2
+#define FS_INO(file) ((fuse_ino_t)(file)->id + 2)
+
+static stego_file_t *fs_inode(fuse_ino_t ino)
+{
+    return ino > FS_STATS_INO ? fs_file(ino - 2) : NULL;
+}
+
+static void fs_file_attr(const stego_file_t *file, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = FS_INO(file);
+    stbuf->st_mode = file->mode;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = file->size;
+    stbuf->st_mtime = file->mtime;
+}
+
+static int stego_getattr(fuse_ino_t ino, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = ino;
+
+    if (ino == FUSE_ROOT_ID)
+    {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+        return 0;
+    }
+    if (ino == FS_STATS_INO)
+    {
+        size_t len = 0;
+        free(fs_stats_render(&len));
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = len;
+        stbuf->st_mtime = time(NULL);
+        return 0;
+    }
+
+    fs_lock();
+    stego_file_t *file = fs_inode(ino);
+    if (file)
+        fs_file_attr(file, stbuf);
+    pthread_mutex_unlock(&stego_fs.mutex);
+    return file ? 0 : -ENOENT;
+}
+
+static int stego_lookup(fuse_ino_t parent, const char *name, struct stat *stbuf)
+{
+    if (parent != FUSE_ROOT_ID)
+        return -ENOENT;
+    if (strcmp(name, FS_STATS_NAME) == 0)
+        return stego_getattr(FS_STATS_INO, stbuf);
+
+    fs_lock();
+    stego_file_t *file = fs_lookup(name);
+    if (file)
+        fs_file_attr(file, stbuf);
+    pthread_mutex_unlock(&stego_fs.mutex);
+    return file ? 0 : -ENOENT;
+}
+
+// Applies the FUSE_SET_ATTR_* fields in to_set and returns the new attributes
+static int stego_setattr(fuse_ino_t ino, const struct stat *attr, int to_set, struct stat *stbuf)
+{
+    if (ino == FUSE_ROOT_ID || ino == FS_STATS_INO)
+        return -EACCES;
+    if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+        return -ENOSYS;
+    fs_lock();
+
+    stego_file_t *file = fs_inode(ino);
+    if (!file)
+    {
+        pthread_mutex_unlock(&stego_fs.mutex);
+        return -ENOENT;
+    }
+
+    if (to_set & FUSE_SET_ATTR_SIZE)
+    {
+        if (fs_read_only())
+        {
+            pthread_mutex_unlock(&stego_fs.mutex);
+            return -EROFS;
+        }
+        if (attr->st_size > MAX_FILE_SIZE)
+        {
+            pthread_mutex_unlock(&stego_fs.mutex);
+            return -EFBIG;
+        }
+        int r = fs_file_grow(file, attr->st_size);
+        if (r != 0)
+        {
+            pthread_mutex_unlock(&stego_fs.mutex);
+            return r;
+        }
+        file->size = attr->st_size;
+        file->mtime = time(NULL);
+        file->version = ++stego_fs.versions;
+        fs_pages_drop(file->id, file->size / FS_PAGE_SIZE, SIZE_MAX / FS_PAGE_SIZE);
+    }
+    if (to_set & FUSE_SET_ATTR_MODE)
+        file->mode = (file->mode & S_IFMT) | (attr->st_mode & ~S_IFMT);
+    if (to_set & FUSE_SET_ATTR_MTIME)
+        file->mtime = attr->st_mtime;
+#ifdef FUSE_SET_ATTR_MTIME_NOW
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+        file->mtime = time(NULL);
+#endif
+    stego_fs.dirty = 1;
+    fs_file_attr(file, stbuf);
+
+    pthread_mutex_unlock(&stego_fs.mutex);
+    return 0;
+}
+
+// Called for every directory entry with its name, inode and mode
+typedef int (*fs_fill_t)(void *ctx, const char *name, fuse_ino_t ino, mode_t mode);
+
+static int stego_readdir(fuse_ino_t ino, void *ctx, fs_fill_t fill)
+{
+    if (ino != FUSE_ROOT_ID)
+        return -ENOTDIR;
+
+    fs_lock();
+    fill(ctx, ".", FUSE_ROOT_ID, S_IFDIR);
+    fill(ctx, "..", FUSE_ROOT_ID, S_IFDIR);
+    fill(ctx, FS_STATS_NAME, FS_STATS_INO, S_IFREG);
+
+    for (size_t i = 0; i < stego_fs.file_count; i++)
+    {
+        fill(ctx, stego_fs.files[i].name, FS_INO(&stego_fs.files[i]), stego_fs.files[i].mode);
+    }
+
+    pthread_mutex_unlock(&stego_fs.mutex);
+    return 0;
+}
+
+static int stego_open(fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    // The stats file is a snapshot taken at open, read without caching
+    if (ino == FS_STATS_INO)
+    {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+        size_t len;
+        char *snapshot = fs_stats_render(&len);
+        if (!snapshot)
+            return -ENOMEM;
+        fi->fh = (uintptr_t)snapshot;
+        fi->direct_io = 1;
+        return 0;
+    }
+
+    fs_lock();
+    stego_file_t *file = fs_inode(ino);
+    uint64_t id = file ? file->id : 0;
+    pthread_mutex_unlock(&stego_fs.mutex);
+    if (!file)
+        return -ENOENT;
+
+    // Without a handle reads still work, just without read-ahead
+    if ((fi->flags & O_ACCMODE) != O_WRONLY)
+        fi->fh = (uintptr_t)fs_handle_new(id);
+    return 0;
+}
+
+static int stego_create(fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi,
+                        struct stat *stbuf)
+{
+    if (parent != FUSE_ROOT_ID)
+        return -ENOENT;
+    if (strcmp(name, FS_STATS_NAME) == 0)
+        return -EEXIST;
+    if (strlen(name) >= MAX_FILENAME_LENGTH)
+        return -ENAMETOOLONG;
+    fs_lock();
+
+    if (fs_read_only())
+    {
+        pthread_mutex_unlock(&stego_fs.mutex);
+        return -EROFS;
+    }
+
+    if (stego_fs.file_count >= MAX_FILES)
+    {
+        pthread_mutex_unlock(&stego_fs.mutex);
+        return -ENOSPC;
+    }
+
+    stego_file_t *new_file = &stego_fs.files[stego_fs.file_count];
+
+    strncpy(new_file->name, name, MAX_FILENAME_LENGTH - 1);
+    new_file->size = 0;
+    new_file->offset = fs_find_room(NULL, 0);
+    new_file->mtime = time(NULL);
+    new_file->mode = mode;
+    new_file->version = new_file->id = ++stego_fs.versions;
+    fs_file_attr(new_file, stbuf);
+
+    stego_fs.file_count++;
+    stego_fs.dirty = 1;
+
+    pthread_mutex_unlock(&stego_fs.mutex);
+    if ((fi->flags & O_ACCMODE) != O_WRONLY)
+        fi->fh = (uintptr_t)fs_handle_new(new_file->id);
+    return 0;
+}
+
+static int stego_write(fuse_ino_t ino, const char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi) {
+    if (ino == FS_STATS_INO)
+        return -EACCES;
+    fs_lock();
+
+    if (fs_read_only()) {
+        pthread_mutex_unlock(&stego_fs.mutex);
+        return -EROFS;
+    }
+    
+    stego_file_t *file = fs_inode(ino);
+    
+    if (!file) {
+        pthread_mutex_unlock(&stego_fs.mutex);
+        return -ENOENT;
+    }
+
+    int r = fs_file_grow(file, offset + size);
+    if (r == 0)
+        r = fs_payload_load(file, offset, size, 1);
+    if (r != 0) {
+        pthread_mutex_unlock(&stego_fs.mutex);
+        return r;
+    }
+
+    // Write data after the header, at the file's own payload offset
+    stego_payload_t payload = stego_fs_payload(file);
+    if (payload_write(&payload, offset, (const unsigned char *)buf, size) != 0) {
+        pthread_mutex_unlock(&stego_fs.mutex);
+        return -ENOSPC;
+    }
+
+    // Calculate new file size
+    size_t new_size = offset + size;
+    file->size = new_size > file->size ? new_size : file->size;
+    
+    file->mtime = time(NULL);
+    file->version = ++stego_fs.versions;
+    if (size > 0)
+        fs_pages_drop(file->id, offset / FS_PAGE_SIZE, (offset + size - 1) / FS_PAGE_SIZE);
+    stego_fs.dirty = 1;
+    
+    pthread_mutex_unlock(&stego_fs.mutex);
+    return size;
+}
+
+static int stego_read(fuse_ino_t ino, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    if (ino == FS_STATS_INO)
+    {
+        const char *snapshot = (const char *)(uintptr_t)fi->fh;
+        size_t len = strlen(snapshot);
+        if ((size_t)offset >= len)
+            return 0;
+        size = size < len - offset ? size : len - offset;
+        memcpy(buf, snapshot + offset, size);
+        return size;
+    }
+
+    fs_handle_t *handle = (fs_handle_t *)(uintptr_t)fi->fh;
+    if (handle)
+        fs_readahead_wait(handle, offset, size);
+    fs_lock();
+
+    stego_file_t *file = fs_inode(ino);
+
+    if (!file)
+    {
+        pthread_mutex_unlock(&stego_fs.mutex);
+        return -ENOENT;
+    }
+
+    if (offset >= file->size)
+    {
+        pthread_mutex_unlock(&stego_fs.mutex);
+        return 0;
+    }
+
+    if (offset + size > file->size)
+    {
+        size = file->size - offset;
+    }
+
+    if (handle && fs_readahead_read(handle, file, (unsigned char *)buf, size, offset))
+    {
+        pthread_mutex_unlock(&stego_fs.mutex);
+        return size;
+    }
+
+    // A sequential stream is already read ahead; sending it through the cache
+    // would only push out the pages of files that are read again
+    int r = handle && handle->streak >= FS_READAHEAD_STREAK
+                ? fs_file_extract(file, (unsigned char *)buf, size, offset)
+                : fs_pages_read(file, (unsigned char *)buf, size, offset);
+    if (r != 0)
+    {
+        pthread_mutex_unlock(&stego_fs.mutex);
+        return -EIO;
+    }
+
+    pthread_mutex_unlock(&stego_fs.mutex);
+    return size;
+}
+
+static int stego_unlink(fuse_ino_t parent, const char *name)
+{
+    if (parent != FUSE_ROOT_ID)
+        return -ENOENT;
+    if (strcmp(name, FS_STATS_NAME) == 0)
+        return -EACCES;
+    fs_lock();
+
+    if (fs_read_only())
+    {
+        pthread_mutex_unlock(&stego_fs.mutex);
+        return -EROFS;
+    }
+
+    stego_file_t *file = fs_lookup(name);
+    if (!file)
+    {
+        pthread_mutex_unlock(&stego_fs.mutex);
+        return -ENOENT;
+    }
+    size_t idx = file - stego_fs.files;
+
+    fs_pages_drop(file->id, 0, SIZE_MAX / FS_PAGE_SIZE);
+    memmove(&stego_fs.files[idx], &stego_fs.files[idx + 1],
+            (stego_fs.file_count - idx - 1) * sizeof(stego_file_t));
+
+    stego_fs.file_count--;
+    stego_fs.dirty = 1;
+
+    pthread_mutex_unlock(&stego_fs.mutex);
+    return 0;
+}
+
+static int stego_release(fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    if (ino == FS_STATS_INO)
+        free((void *)(uintptr_t)fi->fh);
+    else
+        fs_handle_free((fs_handle_t *)(uintptr_t)fi->fh);
+    fi->fh = 0;
+    return 0;
+}
+
+static int init_stego_fs(const char *image_path, const stego_options_t *opts)
+{
+    stego_fs.passphrase = opts->passphrase;
+    stego_fs.image_data = fs_load_image(image_path);
+    stego_fs.channels = 3;
+    if (!stego_fs.image_data)
+        return -1;
+
+    file_metadata_t *metadata = &stego_fs.metadata;
+    size_t position = 0;
+    if (read_metadata(stego_fs.image_data, stego_fs.width, stego_fs.height, metadata, &position) != 0)
+    {
+        // Empty but valid filesystem; files created later start after a fresh header
+        memset(metadata, 0, sizeof(*metadata));
+        metadata->magic = STEGO_MAGIC_V2;
+        metadata->flags = STEGO_FLAG_CHECKSUM;
+        if (opts->passphrase)
+        {
+            metadata->flags |= STEGO_FLAG_ENCRYPTED | (opts->scatter ? STEGO_FLAG_SCATTER : 0);
+            if (random_bytes(metadata->salt, STEGO_SALT_LENGTH) != 0)
+                return -1;
+            cipher_init(&stego_fs.cipher, opts->passphrase, metadata->salt);
+        }
+        stego_fs.file_count = 0;
+        if (metadata->flags & STEGO_FLAG_SCATTER)
+            scatter_init(&stego_fs.scatter, &stego_fs.cipher,
+                         (size_t)stego_fs.width * stego_fs.height * 3 - header_bits(metadata));
+        stego_fs.dirty = 0;
+        return 0;
+    }
+
+    if (metadata->flags & STEGO_FLAG_ENCRYPTED)
+    {
+        if (!opts->passphrase)
+        {
+            fprintf(stderr, "Image is encrypted, a passphrase is required\n");
+            return -1;
+        }
+        cipher_init(&stego_fs.cipher, opts->passphrase, metadata->salt);
+        if (metadata->flags & STEGO_FLAG_SCATTER)
+            scatter_init(&stego_fs.scatter, &stego_fs.cipher,
+                         (size_t)stego_fs.width * stego_fs.height * 3 - position);
+    }
+
+    uint32_t total_size = metadata->file_size;
+
+    // Initialize filesystem with single file if present
+    if (total_size > 0)
+    {
+        stego_fs.file_count = 1;
+        stego_fs.files[0].size = total_size;
+        stego_fs.files[0].offset = position;
+        stego_fs.files[0].mode = S_IFREG | 0644;
+        stego_fs.files[0].mtime = time(NULL);
+        stego_fs.files[0].version = stego_fs.files[0].id = ++stego_fs.versions;
+        strcpy(stego_fs.files[0].name, "hidden_file");
+    }
+    else
+    {
+        stego_fs.file_count = 0;
+    }
+
+    stego_fs.dirty = 0;
+    return 0;
+}
+
+// Every operation goes through a wrapper that feeds the mount statistics
+#define FS_TIMED(op, name, params, args)         \
+    static int timed_##name params               \
+    {                                            \
+        uint64_t start = fs_now_ns();            \
+        int r = stego_##name args;               \
+        fs_stats_record(op, start, r);           \
+        return r;                                \
+    }
+
+FS_TIMED(FS_OP_LOOKUP, lookup, (fuse_ino_t parent, const char *name, struct stat *stbuf), (parent, name, stbuf))
+FS_TIMED(FS_OP_GETATTR, getattr, (fuse_ino_t ino, struct stat *stbuf), (ino, stbuf))
+FS_TIMED(FS_OP_SETATTR, setattr, (fuse_ino_t ino, const struct stat *attr, int to_set, struct stat *stbuf),
+         (ino, attr, to_set, stbuf))
+FS_TIMED(FS_OP_READDIR, readdir, (fuse_ino_t ino, void *ctx, fs_fill_t fill), (ino, ctx, fill))
+FS_TIMED(FS_OP_OPEN, open, (fuse_ino_t ino, struct fuse_file_info *fi), (ino, fi))
+FS_TIMED(FS_OP_CREATE, create,
+         (fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi, struct stat *stbuf),
+         (parent, name, mode, fi, stbuf))
+FS_TIMED(FS_OP_WRITE, write,
+         (fuse_ino_t ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+         (ino, buf, size, offset, fi))
+FS_TIMED(FS_OP_READ, read, (fuse_ino_t ino, char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+         (ino, buf, size, offset, fi))
+FS_TIMED(FS_OP_RELEASE, release, (fuse_ino_t ino, struct fuse_file_info *fi), (ino, fi))
+FS_TIMED(FS_OP_UNLINK, unlink, (fuse_ino_t parent, const char *name), (parent, name))
+
+// Low-level FUSE entry points: run the timed operation and reply. Requests
+// carry inode numbers, so nothing is resolved from a path.
+#define FS_ATTR_TIMEOUT 1.0 // seconds; attributes only change through this mount
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    (void)userdata;
+    // Without big_writes the kernel splits writes into single pages; with it
+    // they arrive up to max_write, which libfuse sizes to its request buffer
+    conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | FUSE_CAP_ASYNC_READ);
+    stego_init(conn);
+}
+
+static void ll_destroy(void *userdata)
+{
+    stego_destroy(userdata);
+}
+
+static void ll_entry(struct fuse_entry_param *e)
+{
+    e->ino = e->attr.st_ino;
+    // The stats file grows with every operation, so its size is never cached
+    e->attr_timeout = e->entry_timeout = e->ino == FS_STATS_INO ? 0 : FS_ATTR_TIMEOUT;
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    int r = timed_lookup(parent, name, &e.attr);
+    if (r != 0)
+    {
+        fuse_reply_err(req, -r);
+        return;
+    }
+    ll_entry(&e);
+    fuse_reply_entry(req, &e);
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    (void)ino;
+    (void)nlookup;
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    (void)fi;
+    struct stat st;
+    int r = timed_getattr(ino, &st);
+    if (r != 0)
+        fuse_reply_err(req, -r);
+    else
+        fuse_reply_attr(req, &st, ino == FS_STATS_INO ? 0 : FS_ATTR_TIMEOUT);
+}
+
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+    (void)fi;
+    struct stat st;
+    int r = timed_setattr(ino, attr, to_set, &st);
+    if (r != 0)
+        fuse_reply_err(req, -r);
+    else
+        fuse_reply_attr(req, &st, FS_ATTR_TIMEOUT);
+}
+
+typedef struct
+{
+    fuse_req_t req;
+    char *buf;
+    size_t size;
+    size_t cap;
+    int error;
+} fs_dirbuf_t;
+
+static int fs_dirbuf_add(void *ctx, const char *name, fuse_ino_t ino, mode_t mode)
+{
+    fs_dirbuf_t *b = ctx;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_ino = ino;
+    st.st_mode = mode;
+    size_t len = fuse_add_direntry(b->req, NULL, 0, name, NULL, 0);
+    if (b->size + len > b->cap)
+    {
+        size_t cap = (b->size + len) * 2;
+        char *buf = realloc(b->buf, cap);
+        if (!buf)
+        {
+            b->error = ENOMEM;
+            return 1;
+        }
+        b->buf = buf;
+        b->cap = cap;
+    }
+    fuse_add_direntry(b->req, b->buf + b->size, len, name, &st, b->size + len);
+    b->size += len;
+    return 0;
+}
+
+// The listing is rebuilt per call and the slice at `off` returned; it holds
+// at most MAX_FILES entries
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    (void)fi;
+    fs_dirbuf_t b = {req, NULL, 0, 0, 0};
+    int r = timed_readdir(ino, &b, fs_dirbuf_add);
+    if (r != 0 || b.error)
+        fuse_reply_err(req, r ? -r : b.error);
+    else if ((size_t)off < b.size)
+        fuse_reply_buf(req, b.buf + off, b.size - off < size ? b.size - off : size);
+    else
+        fuse_reply_buf(req, NULL, 0);
+    free(b.buf);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    int r = timed_open(ino, fi);
+    if (r != 0)
+        fuse_reply_err(req, -r);
+    else if (fuse_reply_open(req, fi) == -ENOENT)
+        stego_release(ino, fi); // the open was interrupted, no release will follow
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    int r = timed_create(parent, name, mode, fi, &e.attr);
+    if (r != 0)
+    {
+        fuse_reply_err(req, -r);
+        return;
+    }
+    ll_entry(&e);
+    if (fuse_reply_create(req, &e, fi) == -ENOENT)
+        stego_release(e.ino, fi);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    char *buf = malloc(size ? size : 1);
+    int r = buf ? timed_read(ino, buf, size, off, fi) : -ENOMEM;
+    if (r < 0)
+        fuse_reply_err(req, -r);
+    else
+        fuse_reply_buf(req, buf, r);
+    free(buf);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off,
+                     struct fuse_file_info *fi)
+{
+    int r = timed_write(ino, buf, size, off, fi);
+    if (r < 0)
+        fuse_reply_err(req, -r);
+    else
+        fuse_reply_write(req, r);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, -timed_release(ino, fi));
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    fuse_reply_err(req, -timed_unlink(parent, name));
+}
+
+static struct fuse_lowlevel_ops stego_oper = {
+    .init = ll_init,
+    .destroy = ll_destroy,
+    .lookup = ll_lookup,
+    .forget = ll_forget,
+    .getattr = ll_getattr,
+    .setattr = ll_setattr,
+    .readdir = ll_readdir,
+    .open = ll_open,
+    .create = ll_create,
+    .read = ll_read,
+    .write = ll_write,
+    .release = ll_release,
+    .unlink = ll_unlink,
+};
+
+static unsigned char *read_secret_file(const char *secret_file, size_t *file_size)
+{
+    stage_frame_t frame;
+    if (strcmp(secret_file, "-") == 0)
+    {
+        stage_begin(&frame, STAGE_READ);
+        unsigned char *file_data = read_stream(stdin, file_size);
+        stage_end(&frame);
+        return file_data;
+    }
+
+    FILE *f = fopen(secret_file, "rb");
+    if (!f)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    *file_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    unsigned char *file_data = malloc(*file_size ? *file_size : 1);
+    stage_begin(&frame, STAGE_READ);
+    int ok = file_data && fread(file_data, 1, *file_size, f) == *file_size;
+    stage_end(&frame);
+    if (!ok)
+    {
+        fprintf(stderr, "Failed to read %s\n", secret_file);
+        free(file_data);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    return file_data;
+}
+
+static int do_hide_file(const char *cover_image, const char *secret_file, const char *output,
+                        const stego_options_t *opts)
+{
+    size_t file_size = 0;
+    unsigned char *file_data = read_secret_file(secret_file, &file_size);
+    if (!file_data)
+        return 1;
+
+    file_metadata_t metadata = {0};
+    get_metadata_extension(secret_file, metadata.extension, sizeof(metadata.extension), &metadata.ext_length);
+
+    int r = hide_buffer(cover_image, output, file_data, file_size, &metadata, opts);
+    free(file_data);
+    return r;
+}
+
+// Striping: the payload is cut into k equal data stripes (the last one may
+// be shorter) and data stripe i goes to cover i. With --parity=m the last m
+// covers carry erasure-coded parity stripes, so any k of the n = k + m images
+// rebuild the payload. Every header records the stripe index, the stripe
+// count n, the total size and a random set id tying the covers together, plus
+// m when parity is present; its file_size is the length of its own stripe.
+// Each cover is decoded, embedded and encoded by its own thread.
+typedef struct stripe_sync stripe_sync_t;
+
+typedef struct
+{
+    const char *image;
+    char output[PATH_MAX];
+    unsigned char *data;
+    size_t len;
+    file_metadata_t metadata;
+    const stego_options_t *opts;
+    const unsigned char *source; // parity jobs: the whole payload
+    size_t source_len;
+    stripe_sync_t *sync;
+    int started;
+    int done;
+    int result;
+} stripe_job_t;
+
+static size_t stripe_size(size_t total_size, int data_stripes)
+{
+    return (total_size + data_stripes - 1) / data_stripes;
+}
+
+static size_t data_stripe_length(size_t total_size, int data_stripes, int index)
+{
+    size_t unit = stripe_size(total_size, data_stripes);
+    size_t start = unit * index;
+    if (start >= total_size)
+        return 0;
+    return total_size - start < unit ? total_size - start : unit;
+}
+
+// Parity row j is a Cauchy matrix 1/(x_j + y_i), x_j = j, y_i = m + i, with
+// its columns scaled so row 0 is all ones: a single parity stripe is plain
+// XOR. Column and row scaling keep every k x k submatrix of [I; C]
+// invertible, so any k surviving stripes determine the data.
+static uint8_t parity_coef(int j, int i, int parity)
+{
+    gf_init();
+    return gf_div(gf_div(1, j ^ (parity + i)), gf_div(1, parity + i));
+}
+
+// parity_j = sum_i coef(j, i) * data_i, accumulated one cache-sized band at a
+// time across all data stripes
+static void compute_parity_stripe(const unsigned char *payload, size_t total_size, int data_stripes, int parity,
+                                  int j, unsigned char *out)
+{
+    size_t unit = stripe_size(total_size, data_stripes);
+    memset(out, 0, unit);
+    for (size_t band = 0; band < unit; band += stego_tuning.band)
+    {
+        size_t band_len = unit - band < stego_tuning.band ? unit - band : stego_tuning.band;
+        for (int i = 0; i < data_stripes; i++)
+        {
+            size_t len = data_stripe_length(total_size, data_stripes, i);
+            if (band >= len)
+                continue;
+            size_t n = len - band < band_len ? len - band : band_len;
+            gf_mul_add_region(out + band, payload + unit * i + band, parity_coef(j, i, parity), n);
+        }
+    }
+}
+
+static void *hide_stripe_worker(void *arg)
+{
+    stripe_job_t *job = arg;
+    if (job->source)
+    {
+        const file_metadata_t *m = &job->metadata;
+        int data_stripes = m->stripe_count - m->parity_count;
+        job->len = stripe_size(job->source_len, data_stripes);
+        job->data = malloc(job->len ? job->len : 1);
+        if (!job->data)
+        {
+            job->result = 1;
+            return NULL;
+        }
+        compute_parity_stripe(job->source, job->source_len, data_stripes, m->parity_count,
+                              m->stripe_index - data_stripes, job->data);
+    }
+    job->result = hide_buffer(job->image, job->output, job->data, job->len, &job->metadata, job->opts);
+    return NULL;
+}
+
+static int do_hide_striped(char *covers[], int count, const char *secret_file, const stego_options_t *opts)
+{
+    if (count > 255)
+    {
+        fprintf(stderr, "At most 255 cover images can be striped\n");
+        return 1;
+    }
+    if (opts->parity >= count)
+    {
+        fprintf(stderr, "--parity=%d needs at least %d cover images\n", opts->parity, opts->parity + 1);
+        return 1;
+    }
+    if (opts->output && strcmp(opts->output, "-") == 0)
+    {
+        fprintf(stderr, "Striped images cannot go to stdout; --output takes a directory for them\n");
+        return 1;
+    }
+
+    stripe_job_t *jobs = calloc(count, sizeof(stripe_job_t));
+    pthread_t *threads = calloc(count, sizeof(pthread_t));
+    if (!jobs || !threads)
+    {
+        fprintf(stderr, "Out of memory\n");
+        free(jobs);
+        free(threads);
+        return 1;
+    }
+
+    // Each cover becomes stego_<cover name>, in the --output directory if there is one
+    for (int i = 0; i < count; i++)
+    {
+        const char *name = get_file_name(covers[i]);
+        int n = opts->output ? snprintf(jobs[i].output, sizeof(jobs[i].output), "%s/stego_%s", opts->output, name)
+                             : snprintf(jobs[i].output, sizeof(jobs[i].output), "stego_%s", name);
+        int clash = -1;
+        for (int j = 0; j < i && clash < 0; j++)
+        {
+            if (strcmp(jobs[j].output, jobs[i].output) == 0)
+                clash = j;
+        }
+        if (n < 0 || (size_t)n >= sizeof(jobs[i].output) || clash >= 0)
+        {
+            if (clash >= 0)
+                fprintf(stderr, "%s and %s would both be written to %s\n", covers[clash], covers[i], jobs[i].output);
+            else
+                fprintf(stderr, "Output path for %s is too long\n", covers[i]);
+            free(threads);
+            free(jobs);
+            return 1;
+        }
+    }
+
+    size_t file_size = 0;
+    unsigned char *file_data = read_secret_file(secret_file, &file_size);
+    if (!file_data)
+    {
+        free(threads);
+        free(jobs);
+        return 1;
+    }
+
+    file_metadata_t base = {0};
+    get_metadata_extension(secret_file, base.extension, sizeof(base.extension), &base.ext_length);
+    base.flags = STEGO_FLAG_STRIPED | (opts->parity ? STEGO_FLAG_PARITY : 0);
+    base.stripe_count = count;
+    base.parity_count = opts->parity;
+    base.total_size = file_size;
+    if (random_bytes((uint8_t *)&base.set_id, sizeof(base.set_id)) != 0)
+    {
+        free(file_data);
+        free(threads);
+        free(jobs);
+        return 1;
+    }
+
+    // Data and parity stripes are produced concurrently, one thread per cover
+    int data_stripes = count - opts->parity;
+    size_t unit = stripe_size(file_size, data_stripes);
+    for (int i = 0; i < count; i++)
+    {
+        jobs[i].image = covers[i];
+        if (i < data_stripes)
+        {
+            jobs[i].data = file_data + (unit * i < file_size ? unit * i : file_size);
+            jobs[i].len = data_stripe_length(file_size, data_stripes, i);
+        }
+        else
+        {
+            jobs[i].source = file_data;
+            jobs[i].source_len = file_size;
+        }
+        jobs[i].metadata = base;
+        jobs[i].metadata.stripe_index = i;
+        jobs[i].opts = opts;
+        jobs[i].started = pthread_create(&threads[i], NULL, hide_stripe_worker, &jobs[i]) == 0;
+        if (!jobs[i].started)
+            hide_stripe_worker(&jobs[i]);
+    }
+
+    int r = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (jobs[i].started)
+            pthread_join(threads[i], NULL);
+        if (jobs[i].result != 0)
+        {
+            fprintf(stderr, "Stripe %d (%s) failed\n", i, covers[i]);
+            r = 1;
+        }
+        if (jobs[i].source)
+            free(jobs[i].data);
+    }
+
+    free(threads);
+    free(jobs);
+    free(file_data);
+    return r;
+}
+
+static int write_extracted_file(const char *output, const file_metadata_t *metadata,
+                                const unsigned char *file_data, size_t file_size)
+{
+    stage_frame_t frame;
+    if (strcmp(output, "-") == 0)
+    {
+        stage_begin(&frame, STAGE_WRITE);
+        int failed = fwrite(file_data, 1, file_size, stdout) != file_size || fflush(stdout) != 0;
+        stage_end(&frame);
+        stats_count_output(file_size);
+        if (failed)
+        {
+            fprintf(stderr, "Failed to write to stdout\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    uint8_t ext_length = metadata->ext_length;
+    char *full_output = malloc(strlen(output) + ext_length + 2);
+    if (ext_length > 0) {
+        sprintf(full_output, "%s.%s", output, metadata->extension);
+    } else {
+        strcpy(full_output, output);
+    }
+
+    int r = 1;
+    stage_begin(&frame, STAGE_WRITE);
+    FILE *f = fopen(full_output, "wb");
+    if (f)
+    {
+        r = fwrite(file_data, 1, file_size, f) != file_size;
+        r |= fclose(f) != 0;
+    }
+    stage_end(&frame);
+    if (r)
+        fprintf(stderr, "Failed to write %s\n", full_output);
+    else
+        stats_count_output(file_size);
+
+    free(full_output);
+    return r;
+}
+
+// Chunk store: payloads are cut into content-defined chunks and each unique
+// chunk (by SHA-256) is embedded once in a pool of cover images. A pool is a
+// directory of PNGs; fresh covers are claimed as needed and new chunks are
+// appended to packs that still have room. The file itself becomes a recipe, a
+// list of chunk digests hidden in its own cover. Pack and recipe payloads
+// both start with a kind byte and a chunk count, followed by one 36-byte
+// entry (digest, big-endian length) per chunk; packs then hold the chunk bytes.
+#define CHUNK_KIND_PACK 1
+#define CHUNK_KIND_RECIPE 2
+#define CHUNK_ENTRY_SIZE 36
+#define CHUNK_TABLE_OFFSET 5
+#define CDC_MIN_SIZE 2048
+#define CDC_MAX_SIZE 65536
+#define CDC_MASK 0xFFF8000000000000ULL // 13 bits, ~8 KiB past the minimum
+
+static uint64_t cdc_gear[256];
+static pthread_once_t cdc_once = PTHREAD_ONCE_INIT;
+
+static void cdc_init_gear(void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        cdc_gear[i] = mix64(0x6765617200000000ULL + i);
+    }
+}
+
+// Gear rolling hash: a boundary falls where the top bits of the hash, which
+// cover the last 64 bytes, are all zero, so an edit only moves nearby cuts
+static size_t cdc_next_boundary(const unsigned char *p, size_t len)
+{
+    if (len <= CDC_MIN_SIZE)
+        return len;
+    size_t max = len < CDC_MAX_SIZE ? len : CDC_MAX_SIZE;
+    uint64_t h = 0;
+    for (size_t i = CDC_MIN_SIZE; i < max; i++)
+    {
+        h = (h << 1) + cdc_gear[p[i]];
+        if (!(h & CDC_MASK))
+            return i + 1;
+    }
+    return max;
+}
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+typedef struct
+{
+    unsigned char digest[32];
+    uint32_t length;
+    int image;     // pool image holding the chunk
+    size_t offset; // of the chunk bytes within that image's payload
+} chunk_entry_t;
+
+typedef struct
+{
+    char path[PATH_MAX];
+    const stego_options_t *opts;
+    int is_pack;
+    int usable; // a fresh cover, or a pack that decoded and may be appended to
+    unsigned char *payload;
+    size_t payload_len;
+    size_t capacity; // payload bytes the image can carry
+    size_t new_count; // chunks assigned by the current store
+
+    size_t new_bytes;
+    int result;
+} pool_image_t;
+
+typedef struct
+{
+    pool_image_t *images;
+    int count;
+    int next; // scan work queue
+    chunk_entry_t *entries;
+    size_t entry_count;
+    size_t entry_capacity;
+    size_t *slots; // open addressing on the digest, entry index + 1
+    size_t slot_count;
+} chunk_pool_t;
+
+static size_t chunk_slot(const unsigned char digest[32], size_t slot_count)
+{
+    uint64_t h;
+    memcpy(&h, digest, sizeof(h));
+    return h & (slot_count - 1);
+}
+
+static chunk_entry_t *pool_lookup(const chunk_pool_t *pool, const unsigned char digest[32])
+{
+    if (!pool->slot_count)
+        return NULL;
+    for (size_t s = chunk_slot(digest, pool->slot_count); pool->slots[s]; s = (s + 1) & (pool->slot_count - 1))
+    {
+        chunk_entry_t *e = &pool->entries[pool->slots[s] - 1];
+        if (memcmp(e->digest, digest, 32) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static int pool_insert(chunk_pool_t *pool, const chunk_entry_t *entry)
+{
+    if (pool_lookup(pool, entry->digest))
+        return 0;
+    if (pool->entry_count == pool->entry_capacity)
+    {
+        size_t capacity = pool->entry_capacity ? pool->entry_capacity * 2 : 1024;
+        chunk_entry_t *entries = realloc(pool->entries, capacity * sizeof(chunk_entry_t));
+        if (!entries)
+            return 1;
+        pool->entries = entries;
+        pool->entry_capacity = capacity;
+    }
+    if ((pool->entry_count + 1) * 2 > pool->slot_count)
     {
-        if (strcmp(path, stego_fs.files[i].name) == 0)
+        size_t slot_count = pool->slot_count ? pool->slot_count * 2 : 2048;
+        size_t *slots = calloc(slot_count, sizeof(size_t));
+        if (!slots)
+            return 1;
+        for (size_t i = 0; i < pool->entry_count; i++)
         {
-            file = &stego_fs.files[i];
-            break;
+            size_t s = chunk_slot(pool->entries[i].digest, slot_count);
+            while (slots[s])
+                s = (s + 1) & (slot_count - 1);
+            slots[s] = i + 1;
         }
+        free(pool->slots);
+        pool->slots = slots;
+        pool->slot_count = slot_count;
     }
+    pool->entries[pool->entry_count] = *entry;
+    size_t s = chunk_slot(entry->digest, pool->slot_count);
+    while (pool->slots[s])
+        s = (s + 1) & (pool->slot_count - 1);
+    pool->slots[s] = ++pool->entry_count;
+    return 0;
+}
 
-    if (!file)
+// Validates a pack or recipe payload and returns its chunk count, or -1
+static long chunk_table_count(const unsigned char *payload, size_t len, int kind)
+{
+    if (len < CHUNK_TABLE_OFFSET || payload[0] != kind)
+        return -1;
+    size_t count = get_u32(payload + 1);
+    if (count > (len - CHUNK_TABLE_OFFSET) / CHUNK_ENTRY_SIZE)
+        return -1;
+    if (kind == CHUNK_KIND_PACK)
     {
-        pthread_mutex_unlock(&stego_fs.mutex);
-        return -ENOENT;
+        size_t data = CHUNK_TABLE_OFFSET + count * CHUNK_ENTRY_SIZE;
+        for (size_t i = 0; i < count; i++)
+        {
+            data += get_u32(payload + CHUNK_TABLE_OFFSET + i * CHUNK_ENTRY_SIZE + 32);
+        }
+        if (data != len)
+            return -1;
     }
+    return count;
+}
 
-    if (offset >= file->size)
+static void *scan_pool_worker(void *arg)
+{
+    chunk_pool_t *pool = arg;
+    // Each worker decodes image after image in one arena, reset in between
+    stego_arena = pool->count ? arena_create(ARENA_DEFAULT_RESERVE, pool->images[0].opts->huge_pages) : NULL;
+    for (;;)
     {
-        pthread_mutex_unlock(&stego_fs.mutex);
-        return 0;
+        int i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (i >= pool->count)
+            break;
+        pool_image_t *img = &pool->images[i];
+        int width, height;
+        unsigned char *image_data = load_image(img->path, &width, &height);
+        if (!image_data)
+            continue;
+
+        file_metadata_t metadata;
+        size_t position;
+        file_metadata_t pack = {0};
+        pack.flags = STEGO_FLAG_CHUNKED;
+        img->capacity = payload_capacity(width, height, &pack, img->opts);
+        if (read_metadata(image_data, width, height, &metadata, &position) != 0)
+        {
+            img->usable = 1; // nothing hidden here yet
+        }
+        else if (metadata.flags & STEGO_FLAG_CHUNKED)
+        {
+            img->is_pack = 1;
+            if (decode_payload(image_data, width, height, img->opts, &metadata, &img->payload) == 0)
+            {
+                img->payload_len = metadata.file_size;
+                if (chunk_table_count(img->payload, img->payload_len, CHUNK_KIND_PACK) >= 0)
+                    img->usable = 1;
+                else
+                    fprintf(stderr, "%s is not a valid chunk pack\n", img->path);
+            }
+        }
+        stbi_image_free(image_data);
+        if (stego_arena)
+            arena_reset(stego_arena);
     }
+    arena_destroy(stego_arena);
+    stego_arena = NULL;
+    return NULL;
+}
 
-    if (offset + size > file->size)
+static int png_filter(const struct dirent *d)
+{
+    size_t len = strlen(d->d_name);
+    return d->d_name[0] != '.' && len > 4 && strcasecmp(d->d_name + len - 4, ".png") == 0;
+}
+
+// Decodes every image of the pool in parallel and indexes the chunks of its
+// packs. Images that hold other payloads, or packs that fail to decode, are
+// left untouched.
+static int open_pool(const char *dir, const stego_options_t *opts, chunk_pool_t *pool)
+{
+    memset(pool, 0, sizeof(*pool));
+    struct dirent **names;
+    int n = scandir(dir, &names, png_filter, alphasort);
+    if (n < 0)
     {
-        size = file->size - offset;
+        fprintf(stderr, "Cannot read pool directory %s\n", dir);
+        return 1;
+    }
+    pool->images = calloc(n ? n : 1, sizeof(pool_image_t));
+    for (int i = 0; i < n; i++)
+    {
+        if (pool->images)
+        {
+            snprintf(pool->images[i].path, sizeof(pool->images[i].path), "%s/%s", dir, names[i]->d_name);
+            pool->images[i].opts = opts;
+        }
+        free(names[i]);
+    }
+    free(names);
+    if (!pool->images)
+        return 1;
+    pool->count = n;
+
+    int nthreads = tuned_threads(n);
+    pthread_t *threads = calloc(nthreads ? nthreads : 1, sizeof(pthread_t));
+    int started = 0;
+    while (threads && started < nthreads && pthread_create(&threads[started], NULL, scan_pool_worker, pool) == 0)
+        started++;
+    scan_pool_worker(pool);
+    for (int t = 0; t < started; t++)
+    {
+        pthread_join(threads[t], NULL);
     }
+    free(threads);
 
-    size_t current_bit = file->offset + (offset * 8);
-    for (size_t i = 0; i < size; i++)
+    for (int i = 0; i < pool->count; i++)
     {
-        buf[i] = 0;
-        for (int j = 7; j >= 0; j--)
+        const pool_image_t *img = &pool->images[i];
+        if (!img->is_pack || !img->usable)
+            continue;
+        size_t count = get_u32(img->payload + 1);
+        size_t offset = CHUNK_TABLE_OFFSET + count * CHUNK_ENTRY_SIZE;
+        for (size_t c = 0; c < count; c++)
         {
-            buf[i] |= extract_bit(stego_fs.image_data, stego_fs.width, stego_fs.height,
-                                  current_bit++)
-                      << j;
+            const unsigned char *e = img->payload + CHUNK_TABLE_OFFSET + c * CHUNK_ENTRY_SIZE;
+            chunk_entry_t entry = {{0}, get_u32(e + 32), i, offset};
+            memcpy(entry.digest, e, 32);
+            offset += entry.length;
+            if (pool_insert(pool, &entry) != 0)
+                return 1;
         }
     }
+    return 0;
+}
 
-    pthread_mutex_unlock(&stego_fs.mutex);
-    return size;
+static void close_pool(chunk_pool_t *pool)
+{
+    for (int i = 0; i < pool->count; i++)
+    {
+        free(pool->images[i].payload);
+    }
+    free(pool->images);
+    free(pool->entries);
+    free(pool->slots);
 }
 
-static int stego_unlink(const char *path)
+typedef struct
 {
-    pthread_mutex_lock(&stego_fs.mutex);
+    chunk_pool_t *pool;
+    int image;
+    size_t known; // entries from here on are new, their offsets index file_data
+    const unsigned char *file_data;
+    int result;
+} pack_job_t;
+
+// Rewrites one pool image with its old chunks plus the new ones assigned to
+// it; write_image replaces the file atomically, so a failed write never loses
+// the old pack
+static void *write_pack_worker(void *arg)
+{
+    pack_job_t *job = arg;
+    pool_image_t *img = &job->pool->images[job->image];
+    size_t old_count = img->is_pack ? get_u32(img->payload + 1) : 0;
+    size_t old_data = img->is_pack ? img->payload_len - CHUNK_TABLE_OFFSET - old_count * CHUNK_ENTRY_SIZE : 0;
+    size_t count = old_count + img->new_count;
+    size_t len = CHUNK_TABLE_OFFSET + count * CHUNK_ENTRY_SIZE + old_data + img->new_bytes;
+    unsigned char *buf = malloc(len);
+    job->result = 1;
+    if (!buf)
+        return NULL;
+
+    buf[0] = CHUNK_KIND_PACK;
+    put_u32(buf + 1, count);
+    unsigned char *table = buf + CHUNK_TABLE_OFFSET;
+    unsigned char *data = table + count * CHUNK_ENTRY_SIZE;
+    if (old_count)
+    {
+        memcpy(table, img->payload + CHUNK_TABLE_OFFSET, old_count * CHUNK_ENTRY_SIZE);
+        memcpy(data, img->payload + CHUNK_TABLE_OFFSET + old_count * CHUNK_ENTRY_SIZE, old_data);
+    }
+    table += old_count * CHUNK_ENTRY_SIZE;
+    data += old_data;
+    for (size_t c = job->known; c < job->pool->entry_count; c++)
+    {
+        const chunk_entry_t *e = &job->pool->entries[c];
+        if (e->image != job->image)
+            continue;
+        memcpy(table, e->digest, 32);
+        put_u32(table + 32, e->length);
+        memcpy(data, job->file_data + e->offset, e->length);
+        table += CHUNK_ENTRY_SIZE;
+        data += e->length;
+    }
+
+    file_metadata_t base = {0};
+    base.flags = STEGO_FLAG_CHUNKED;
+    job->result = hide_buffer(img->path, img->path, buf, len, &base, img->opts);
+    free(buf);
+    return NULL;
+}
+
+static int do_store_file(const char *pool_dir, const char *cover_image, const char *secret_file,
+                         const char *output, const stego_options_t *opts)
+{
+    size_t file_size = 0;
+    unsigned char *file_data = read_secret_file(secret_file, &file_size);
+    if (!file_data)
+        return 1;
 
-    path++;
-    size_t idx;
-    for (idx = 0; idx < stego_fs.file_count; idx++)
+    chunk_pool_t pool;
+    if (open_pool(pool_dir, opts, &pool) != 0)
+    {
+        close_pool(&pool);
+        free(file_data);
+        return 1;
+    }
+    size_t known = pool.entry_count;
+
+    // Chunk the file into the recipe; new chunks are indexed as they are met
+    // (so repeats within the file dedup too) and dealt first-fit to the pool
+    // images in order. A new entry's offset is its position in file_data.
+    pthread_once(&cdc_once, cdc_init_gear);
+    size_t max_chunks = file_size / CDC_MIN_SIZE + 1;
+    unsigned char *recipe = malloc(CHUNK_TABLE_OFFSET + max_chunks * CHUNK_ENTRY_SIZE);
+    size_t chunks = 0, reused = 0, new_bytes = 0;
+    int target = 0, r = recipe ? 0 : 1;
+    for (size_t pos = 0; pos < file_size && r == 0; chunks++)
     {
-        if (strcmp(path, stego_fs.files[idx].name) == 0)
+        chunk_entry_t entry = {{0}, cdc_next_boundary(file_data + pos, file_size - pos), -1, pos};
+        sha256_ctx_t ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, file_data + pos, entry.length);
+        sha256_final(&ctx, entry.digest);
+        unsigned char *e = recipe + CHUNK_TABLE_OFFSET + chunks * CHUNK_ENTRY_SIZE;
+        memcpy(e, entry.digest, 32);
+        put_u32(e + 32, entry.length);
+        pos += entry.length;
+
+        if (pool_lookup(&pool, entry.digest))
+        {
+            reused++;
+            continue;
+        }
+        for (; target < pool.count; target++)
+        {
+            pool_image_t *img = &pool.images[target];
+            size_t used = img->is_pack ? img->payload_len : CHUNK_TABLE_OFFSET;
+            if (img->usable && used + img->new_bytes + (img->new_count + 1) * CHUNK_ENTRY_SIZE + entry.length <=
+                                   img->capacity)
+                break;
+        }
+        if (target == pool.count)
         {
+            fprintf(stderr, "Cover pool %s is full, add more images\n", pool_dir);
+            r = 1;
             break;
         }
+        pool_image_t *img = &pool.images[target];
+        entry.image = target;
+        if (pool_insert(&pool, &entry) != 0)
+        {
+            r = 1;
+            break;
+        }
+        img->new_count++;
+        img->new_bytes += entry.length;
+        new_bytes += entry.length;
     }
 
-    if (idx == stego_fs.file_count)
+    // Every touched pool image is rewritten on its own thread
+    pack_job_t *jobs = calloc(pool.count ? pool.count : 1, sizeof(pack_job_t));
+    pthread_t *threads = calloc(pool.count ? pool.count : 1, sizeof(pthread_t));
+    int *started = calloc(pool.count ? pool.count : 1, sizeof(int));
+    if (!jobs || !threads || !started)
+        r = 1;
+    for (int i = 0; i < pool.count && r == 0; i++)
     {
-        pthread_mutex_unlock(&stego_fs.mutex);
-        return -ENOENT;
+        if (!pool.images[i].new_count)
+            continue;
+        jobs[i] = (pack_job_t){&pool, i, known, file_data, 0};
+        started[i] = pthread_create(&threads[i], NULL, write_pack_worker, &jobs[i]) == 0;
+        if (!started[i])
+            write_pack_worker(&jobs[i]);
     }
+    for (int i = 0; i < pool.count && jobs && threads && started; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        if (pool.images[i].new_count && jobs[i].result != 0)
+        {
+            fprintf(stderr, "Failed to update pool image %s\n", pool.images[i].path);
+            r = 1;
+        }
+    }
+    free(started);
+    free(threads);
+    free(jobs);
 
-    memmove(&stego_fs.files[idx], &stego_fs.files[idx + 1],
-            (stego_fs.file_count - idx - 1) * sizeof(stego_file_t));
-
-    stego_fs.file_count--;
-    stego_fs.dirty = 1;
+    if (r == 0)
+    {
+        stego_info("%zu chunks: %zu already in the pool, %zu new (%zu bytes)\n", chunks, reused,
+                   pool.entry_count - known, new_bytes);
+        recipe[0] = CHUNK_KIND_RECIPE;
+        put_u32(recipe + 1, chunks);
+        file_metadata_t base = {0};
+        base.flags = STEGO_FLAG_CHUNKED;
+        get_metadata_extension(secret_file, base.extension, sizeof(base.extension), &base.ext_length);
+        r = hide_buffer(cover_image, output, recipe, CHUNK_TABLE_OFFSET + chunks * CHUNK_ENTRY_SIZE, &base, opts);
+    }
 
-    pthread_mutex_unlock(&stego_fs.mutex);
-    return 0;
+    free(recipe);
+    close_pool(&pool);
+    free(file_data);
+    return r;
 }
 
-static int stego_truncate(const char *path, off_t size)
+// Reassembles a stored file from its recipe and the chunks in the pool
+static int extract_recipe(const file_metadata_t *metadata, const unsigned char *recipe, const char *output,
+                          const stego_options_t *opts)
 {
-    pthread_mutex_lock(&stego_fs.mutex);
-
-    path++;
-    stego_file_t *file = NULL;
+    long count = chunk_table_count(recipe, metadata->file_size, CHUNK_KIND_RECIPE);
+    if (count < 0)
+    {
+        fprintf(stderr, "Image holds a chunk pack, not a stored file\n");
+        return 1;
+    }
+    if (!opts->pool)
+    {
+        fprintf(stderr, "Image holds a chunk recipe, pass --pool=<dir>\n");
+        return 1;
+    }
 
-    for (size_t i = 0; i < stego_fs.file_count; i++)
+    chunk_pool_t pool;
+    int r = open_pool(opts->pool, opts, &pool);
+    size_t total = 0;
+    for (long c = 0; c < count && r == 0; c++)
     {
-        if (strcmp(path, stego_fs.files[i].name) == 0)
+        total += get_u32(recipe + CHUNK_TABLE_OFFSET + c * CHUNK_ENTRY_SIZE + 32);
+    }
+    unsigned char *file_data = r == 0 ? malloc(total ? total : 1) : NULL;
+    size_t pos = 0;
+    for (long c = 0; c < count && file_data; c++)
+    {
+        const unsigned char *e = recipe + CHUNK_TABLE_OFFSET + c * CHUNK_ENTRY_SIZE;
+        const chunk_entry_t *entry = pool_lookup(&pool, e);
+        if (!entry || entry->length != get_u32(e + 32))
         {
-            file = &stego_fs.files[i];
+            fprintf(stderr, "Chunk %ld of %ld is missing from the pool\n", c + 1, count);
+            r = 1;
             break;
         }
+        memcpy(file_data + pos, pool.images[entry->image].payload + entry->offset, entry->length);
+        pos += entry->length;
     }
+    if (!file_data)
+        r = 1;
+    if (r == 0)
+        r = write_extracted_file(output, metadata, file_data, total);
 
-    if (!file)
+    free(file_data);
+    close_pool(&pool);
+    return r;
+}
+
+static int do_extract_file(const char *stego_image, const char *output, const stego_options_t *opts)
+{
+    file_metadata_t metadata;
+    unsigned char *file_data = NULL;
+    if (load_payload(stego_image, opts, &metadata, &file_data) != 0)
+        return 1;
+
+    if (metadata.flags & STEGO_FLAG_STRIPED)
     {
-        pthread_mutex_unlock(&stego_fs.mutex);
-        return -ENOENT;
+        fprintf(stderr, "Image holds stripe %d of %d, pass all stripe images\n",
+                metadata.stripe_index + 1, metadata.stripe_count);
+        free(file_data);
+        return 1;
     }
+    if (metadata.flags & STEGO_FLAG_CHUNKED)
+    {
+        int r = extract_recipe(&metadata, file_data, output, opts);
+        free(file_data);
+        return r;
+    }
+
+    int r = write_extracted_file(output, &metadata, file_data, metadata.file_size);
+    free(file_data);
+    return r;
+}
+
+struct stripe_sync
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int pending;
+};
+
+static void *extract_stripe_worker(void *arg)
+{
+    stripe_job_t *job = arg;
+    job->result = load_payload(job->image, job->opts, &job->metadata, &job->data);
 
-    if (size > MAX_FILE_SIZE)
+    // Survivors feed the parity decoder, which wants every stripe unit sized
+    const file_metadata_t *m = &job->metadata;
+    if (job->result == 0 && (m->flags & STEGO_FLAG_PARITY) && m->parity_count < m->stripe_count)
     {
-        pthread_mutex_unlock(&stego_fs.mutex);
-        return -EFBIG;
+        size_t unit = stripe_size(m->total_size, m->stripe_count - m->parity_count);
+        if (m->file_size < unit)
+        {
+            unsigned char *padded = realloc(job->data, unit);
+            if (padded)
+            {
+                memset(padded + m->file_size, 0, unit - m->file_size);
+                job->data = padded;
+            }
+            else
+            {
+                job->result = 1;
+            }
+        }
     }
 
-    file->size = size;
-    file->mtime = time(NULL);
-    stego_fs.dirty = 1;
+    pthread_mutex_lock(&job->sync->lock);
+    job->done = 1;
+    job->sync->pending--;
+    pthread_cond_broadcast(&job->sync->changed);
+    pthread_mutex_unlock(&job->sync->lock);
+    return NULL;
+}
 
-    pthread_mutex_unlock(&stego_fs.mutex);
+// A rebuild: k survivor stripes, the missing data stripes, and the rows of the
+// inverted survivor matrix that produce them. Threads split the stripe into
+// byte ranges; within a range they walk cache-sized bands so the output band
+// stays hot while every survivor is folded into it.
+typedef struct
+{
+    int survivors;
+    const unsigned char *surv_data[255];
+    int missing;
+    int missing_index[255];
+    unsigned char *missing_data[255];
+    uint8_t (*rows)[255];
+    size_t from;
+    size_t to;
+} rebuild_job_t;
+
+static void *rebuild_worker(void *arg)
+{
+    rebuild_job_t *job = arg;
+    for (size_t band = job->from; band < job->to; band += stego_tuning.band)
+    {
+        size_t n = job->to - band < stego_tuning.band ? job->to - band : stego_tuning.band;
+        for (int d = 0; d < job->missing; d++)
+        {
+            memset(job->missing_data[d] + band, 0, n);
+            for (int s = 0; s < job->survivors; s++)
+            {
+                gf_mul_add_region(job->missing_data[d] + band, job->surv_data[s] + band, job->rows[d][s], n);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Gauss-Jordan inversion of a k x k matrix over GF(256); returns -1 if singular
+static int gf_invert_matrix(uint8_t (*m)[255], uint8_t (*inv)[255], int k)
+{
+    for (int i = 0; i < k; i++)
+    {
+        memset(inv[i], 0, k);
+        inv[i][i] = 1;
+    }
+    for (int c = 0; c < k; c++)
+    {
+        int p = c;
+        while (p < k && m[p][c] == 0)
+            p++;
+        if (p == k)
+            return -1;
+        if (p != c)
+        {
+            for (int j = 0; j < k; j++)
+            {
+                uint8_t t = m[c][j];
+                m[c][j] = m[p][j];
+                m[p][j] = t;
+                t = inv[c][j];
+                inv[c][j] = inv[p][j];
+                inv[p][j] = t;
+            }
+        }
+        uint8_t scale = gf_div(1, m[c][c]);
+        for (int j = 0; j < k; j++)
+        {
+            m[c][j] = gf_mul(m[c][j], scale);
+            inv[c][j] = gf_mul(inv[c][j], scale);
+        }
+        for (int r = 0; r < k; r++)
+        {
+            uint8_t f = m[r][c];
+            if (r == c || f == 0)
+                continue;
+            for (int j = 0; j < k; j++)
+            {
+                m[r][j] ^= gf_mul(f, m[c][j]);
+                inv[r][j] ^= gf_mul(f, inv[c][j]);
+            }
+        }
+    }
     return 0;
 }
 
-static int stego_utimens(const char *path, const struct timespec tv[2])
+typedef struct
 {
-    pthread_mutex_lock(&stego_fs.mutex);
+    int started;
+    int threads;
+    pthread_t tids[64];
+    rebuild_job_t jobs[64];
+    uint8_t rows[255][255];
+    uint8_t matrix[255][255];
+    uint8_t inverse[255][255];
+    unsigned char *outputs[255];
+} rebuild_t;
+
+// Called with the sync lock held whenever a stripe finishes. Once the missing
+// data stripes are known and k survivors are in, the rebuild is started on
+// its own threads and runs while the remaining stripe images still decode.
+// Returns 1 when a rebuild was started or none is needed, -1 when the set
+// cannot be recovered, 0 to wait for more stripes.
+static int plan_rebuild(stripe_job_t *jobs, int count, int pending, rebuild_t *rb)
+{
+    const file_metadata_t *ref = NULL;
+    for (int i = 0; i < count && !ref; i++)
+    {
+        if (jobs[i].done && jobs[i].result == 0 && (jobs[i].metadata.flags & STEGO_FLAG_STRIPED))
+            ref = &jobs[i].metadata;
+    }
+    if (!ref)
+        return pending ? 0 : -1;
+
+    int n = ref->stripe_count, m = ref->parity_count, k = n - m;
+    stripe_job_t *avail[255] = {0};
+    int failed[255] = {0};
+    int navail = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const file_metadata_t *meta = &jobs[i].metadata;
+        if (!jobs[i].done || !(meta->flags & STEGO_FLAG_STRIPED) || meta->set_id != ref->set_id ||
+            meta->stripe_count != n || meta->parity_count != m || meta->total_size != ref->total_size ||
+            meta->stripe_index >= n)
+            continue;
+        if (jobs[i].result != 0)
+        {
+            failed[meta->stripe_index] = 1;
+        }
+        else if (!avail[meta->stripe_index])
+        {
+            avail[meta->stripe_index] = &jobs[i];
+            navail++;
+        }
+    }
 
-    path++;
-    stego_file_t *file = NULL;
+    int missing = 0;
+    for (int d = 0; d < k; d++)
+    {
+        if (avail[d])
+            continue;
+        if (!failed[d] && pending)
+            return 0; // may still arrive
+        missing++;
+    }
+    if (missing == 0)
+        return 1;
+    if (navail < k)
+    {
+        if (!pending)
+            fprintf(stderr, "%d of %d stripes are missing and the set has %d parity stripe(s)\n", n - navail, n, m);
+        return pending ? 0 : -1;
+    }
 
-    for (size_t i = 0; i < stego_fs.file_count; i++)
+    // Survivor rows of the generator [I; C], data stripes first
+    rebuild_job_t plan = {0};
+    for (int i = 0; i < n && plan.survivors < k; i++)
     {
-        if (strcmp(path, stego_fs.files[i].name) == 0)
+        if (!avail[i])
+            continue;
+        for (int c = 0; c < k; c++)
         {
-            file = &stego_fs.files[i];
-            break;
+            rb->matrix[plan.survivors][c] = i < k ? (i == c) : parity_coef(i - k, c, m);
         }
+        plan.surv_data[plan.survivors++] = avail[i]->data;
     }
+    if (gf_invert_matrix(rb->matrix, rb->inverse, k) != 0)
+        return -1;
 
-    if (!file)
+    size_t unit = stripe_size(ref->total_size, k);
+    for (int d = 0; d < k; d++)
     {
-        pthread_mutex_unlock(&stego_fs.mutex);
-        return -ENOENT;
+        if (avail[d])
+            continue;
+        rb->outputs[d] = calloc(unit ? unit : 1, 1);
+        if (!rb->outputs[d])
+            return -1;
+        memcpy(rb->rows[plan.missing], rb->inverse[d], k);
+        plan.missing_index[plan.missing] = d;
+        plan.missing_data[plan.missing++] = rb->outputs[d];
     }
+    plan.rows = rb->rows;
 
-    file->mtime = tv[1].tv_sec;
-    stego_fs.dirty = 1;
-
-    pthread_mutex_unlock(&stego_fs.mutex);
-    return 0;
+    rb->threads = tuned_threads(64);
+    size_t share = (unit + rb->threads - 1) / rb->threads;
+    for (int t = 0; t < rb->threads; t++)
+    {
+        rb->jobs[t] = plan;
+        rb->jobs[t].from = share * t < unit ? share * t : unit;
+        rb->jobs[t].to = share * (t + 1) < unit ? share * (t + 1) : unit;
+        if (pthread_create(&rb->tids[t], NULL, rebuild_worker, &rb->jobs[t]) != 0)
+        {
+            rebuild_worker(&rb->jobs[t]);
+            rb->tids[t] = pthread_self();
+        }
+    }
+    rb->started = 1;
+    fprintf(stderr, "Rebuilding %d missing stripe(s) from parity\n", plan.missing);
+    return 1;
 }
 
-static int stego_chmod(const char *path, mode_t mode)
+// Images may be given in any order; the stripe index in each header places it.
+// With parity, lost or corrupt images (checksum or decode failures) are
+// rebuilt from any k survivors.
+static int do_extract_striped(char *images[], int count, const char *output, const stego_options_t *opts)
 {
-    pthread_mutex_lock(&stego_fs.mutex);
+    stripe_sync_t sync = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, count};
+    stripe_job_t *jobs = calloc(count, sizeof(stripe_job_t));
+    pthread_t *threads = calloc(count, sizeof(pthread_t));
+    rebuild_t *rb = calloc(1, sizeof(rebuild_t));
+    if (!jobs || !threads || !rb)
+    {
+        fprintf(stderr, "Out of memory\n");
+        free(rb);
+        free(threads);
+        free(jobs);
+        return 1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        jobs[i].image = images[i];
+        jobs[i].opts = opts;
+        jobs[i].sync = &sync;
+        jobs[i].started = pthread_create(&threads[i], NULL, extract_stripe_worker, &jobs[i]) == 0;
+        if (!jobs[i].started)
+            extract_stripe_worker(&jobs[i]);
+    }
+
+    int plan = 0;
+    pthread_mutex_lock(&sync.lock);
+    for (;;)
+    {
+        if (plan == 0)
+            plan = plan_rebuild(jobs, count, sync.pending, rb);
+        if (sync.pending == 0)
+            break;
+        pthread_cond_wait(&sync.changed, &sync.lock);
+    }
+    pthread_mutex_unlock(&sync.lock);
 
-    path++;
-    stego_file_t *file = NULL;
+    for (int i = 0; i < count; i++)
+    {
+        if (jobs[i].started)
+            pthread_join(threads[i], NULL);
+    }
+    if (rb->started)
+    {
+        for (int t = 0; t < rb->threads; t++)
+        {
+            if (!pthread_equal(rb->tids[t], pthread_self()))
+                pthread_join(rb->tids[t], NULL);
+        }
+    }
 
-    for (size_t i = 0; i < stego_fs.file_count; i++)
+    int r = plan < 0 ? 1 : 0;
+    const file_metadata_t *first = NULL;
+    stripe_job_t *ordered[255] = {0};
+    for (int i = 0; i < count && r == 0; i++)
     {
-        if (strcmp(path, stego_fs.files[i].name) == 0)
+        const file_metadata_t *m = &jobs[i].metadata;
+        if (jobs[i].result != 0)
         {
-            file = &stego_fs.files[i];
+            if (rb->started)
+                fprintf(stderr, "Skipping %s, its stripe is rebuilt from parity\n", images[i]);
+            continue;
+        }
+        if (!first)
+            first = m;
+        if (!(m->flags & STEGO_FLAG_STRIPED) || m->set_id != first->set_id || m->total_size != first->total_size ||
+            m->stripe_count != first->stripe_count || m->parity_count != first->parity_count ||
+            m->stripe_index >= m->stripe_count)
+        {
+            fprintf(stderr, "%s is not part of this stripe set\n", images[i]);
+            r = 1;
+            break;
+        }
+        int data_stripes = m->stripe_count - m->parity_count;
+        if (m->stripe_index < data_stripes &&
+            m->file_size != data_stripe_length(m->total_size, data_stripes, m->stripe_index))
+        {
+            fprintf(stderr, "%s has a stripe of unexpected size\n", images[i]);
+            r = 1;
             break;
         }
+        ordered[m->stripe_index] = &jobs[i];
     }
+    if (!first)
+        r = 1;
 
-    if (!file)
+    if (r == 0)
     {
-        pthread_mutex_unlock(&stego_fs.mutex);
-        return -ENOENT;
+        int data_stripes = first->stripe_count - first->parity_count;
+        size_t total = first->total_size;
+        size_t unit = stripe_size(total, data_stripes);
+        unsigned char *file_data = malloc(total ? total : 1);
+        for (int i = 0; i < data_stripes && file_data; i++)
+        {
+            const unsigned char *src = ordered[i] ? ordered[i]->data : rb->outputs[i];
+            if (!src)
+            {
+                fprintf(stderr, "Stripe %d of %d is missing\n", i + 1, first->stripe_count);
+                r = 1;
+                break;
+            }
+            memcpy(file_data + unit * i, src, data_stripe_length(total, data_stripes, i));
+        }
+        if (r == 0)
+            r = file_data ? write_extracted_file(output, first, file_data, total) : 1;
+        free(file_data);
     }
 
-    file->mode = mode;
-    stego_fs.dirty = 1;
+    for (int i = 0; i < count; i++)
+    {
+        free(jobs[i].data);
+    }
+    for (int i = 0; i < 255; i++)
+    {
+        free(rb->outputs[i]);
+    }
+    free(rb);
+    free(threads);
+    free(jobs);
+    return r;
+}
 
-    pthread_mutex_unlock(&stego_fs.mutex);
+static int do_verify_file(const char *stego_image, const stego_options_t *opts)
+{
+    file_metadata_t metadata;
+    unsigned char *file_data = NULL;
+    if (load_payload(stego_image, opts, &metadata, &file_data) != 0)
+        return 1;
+    free(file_data);
+
+    if (!(metadata.flags & STEGO_FLAG_CHECKSUM))
+    {
+        fprintf(stderr, "Image has no checksum, payload cannot be verified\n");
+        return 1;
+    }
+    printf("Payload OK: %u bytes, crc32c %08x\n", metadata.file_size, metadata.checksum);
     return 0;
 }
 
-static int init_stego_fs(const char *image_path)
+static int do_mount_point(int argc, char *argv[], const stego_options_t *opts)
 {
-    stego_fs.image_data = stbi_load(image_path, &stego_fs.width, &stego_fs.height, &stego_fs.channels, 3);
-    if (!stego_fs.image_data)
-        return -1;
+    if (argc < 4)
+    {
+        fprintf(stderr, "Usage: %s mount <image_path> <mount_point> [FUSE options]\n", argv[0]);
+        return 1;
+    }
 
-    size_t position = 0;
-    uint32_t magic = 0;
-    for (int i = 31; i >= 0; i--)
+    stego_fs.image_path = realpath(argv[2], NULL);
+    if (!stego_fs.image_path)
     {
-        magic |= (extract_bit(stego_fs.image_data, stego_fs.width, stego_fs.height, position++) << i);
+        fprintf(stderr, "Invalid image path\n");
+        return 1;
     }
 
-    if (magic != 0x5354454)
+    if (init_stego_fs(stego_fs.image_path, opts) != 0)
     {
-        stego_fs.file_count = 0;
-        stego_fs.total_data_size = position;
-        stego_fs.dirty = 0;
-        return 0; // Empty but valid filesystem
+        fprintf(stderr, "Failed to initialize filesystem\n");
+        free(stego_fs.image_path);
+        return 1;
     }
 
-    uint32_t total_size = 0;
-    for (int i = 31; i >= 0; i--)
+    // Adjust FUSE arguments
+    char **fuse_argv = malloc((argc - 1) * sizeof(char *));
+    fuse_argv[0] = argv[0];
+    fuse_argv[1] = argv[3]; // mount point
+    for (int i = 4; i < argc; i++)
     {
-        total_size |= (extract_bit(stego_fs.image_data, stego_fs.width, stego_fs.height, position++) << i);
+        fuse_argv[i - 2] = argv[i];
     }
 
-    uint8_t ext_length = 0;
-    for (int i = 7; i >= 0; i--)
+    // -f, -d and -s are handled here as fuse_main would; the session runs
+    // one thread per outstanding request unless -s asks for a single one
+    struct fuse_args args = FUSE_ARGS_INIT(argc - 2, fuse_argv);
+    char *mountpoint = NULL;
+    int multithreaded = 0, foreground = 0, ret = 1;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == 0 && mountpoint)
     {
-        ext_length |= (extract_bit(stego_fs.image_data, stego_fs.width, stego_fs.height, position++) << i);
+        struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+        if (ch)
+        {
+            struct fuse_session *se = fuse_lowlevel_new(&args, &stego_oper, sizeof(stego_oper), NULL);
+            if (se)
+            {
+                if (fuse_set_signal_handlers(se) == 0)
+                {
+                    fuse_session_add_chan(se, ch);
+                    fuse_daemonize(foreground);
+                    ret = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                    fuse_remove_signal_handlers(se);
+                    fuse_session_remove_chan(ch);
+                }
+                fuse_session_destroy(se);
+            }
+            fuse_unmount(mountpoint, ch);
+        }
     }
 
-    // Skip extension
-    position += ext_length * 8;
+    free(mountpoint);
+    fuse_opt_free_args(&args);
+    free(fuse_argv);
+    return ret != 0;
+}
 
-    // Initialize filesystem with single file if present
-    if (total_size > 0)
-    {
-        stego_fs.file_count = 1;
-        stego_fs.files[0].size = total_size;
-        stego_fs.files[0].offset = position;
-        stego_fs.files[0].mode = S_IFREG | 0644;
-        stego_fs.files[0].mtime = time(NULL);
-        strcpy(stego_fs.files[0].name, "hidden_file");
-    }
-    else
+// Strips the --options this tool understands from argv, leaving the positional
+// arguments (and any FUSE options) in place
+static void parse_options(int *argc, char *argv[], stego_options_t *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    int out = 1;
+    for (int i = 1; i < *argc; i++)
     {
-        stego_fs.file_count = 0;
+        if (strncmp(argv[i], "--passphrase=", 13) == 0)
+        {
+            opts->passphrase = argv[i] + 13;
+        }
+        else if (strcmp(argv[i], "--scatter") == 0)
+        {
+            opts->scatter = 1;
+        }
+        else if (strncmp(argv[i], "--ecc=", 6) == 0)
+        {
+            opts->ecc_parity = atoi(argv[i] + 6);
+            if (opts->ecc_parity < 2 || opts->ecc_parity > RS_MAX_PARITY || (opts->ecc_parity & 1))
+            {
+                fprintf(stderr, "--ecc takes an even number of parity bytes between 2 and %d\n", RS_MAX_PARITY);
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "--output=", 9) == 0)
+        {
+            opts->output = argv[i] + 9;
+        }
+        else if (strcmp(argv[i], "--huge-pages") == 0)
+        {
+            opts->huge_pages = 1;
+        }
+        else if (strcmp(argv[i], "--direct-io") == 0)
+        {
+            opts->direct_io = 1;
+        }
+        else if (strcmp(argv[i], "--perf") == 0)
+        {
+            opts->perf = 1;
+        }
+        else if (strncmp(argv[i], "--trace=", 8) == 0)
+        {
+            opts->trace = argv[i] + 8;
+        }
+        else if (strncmp(argv[i], "--stats=", 8) == 0)
+        {
+            if (strcmp(argv[i] + 8, "json") != 0)
+            {
+                fprintf(stderr, "--stats supports json only\n");
+                exit(1);
+            }
+            opts->stats = 1;
+        }
+        else if (strncmp(argv[i], "--pool=", 7) == 0)
+        {
+            opts->pool = argv[i] + 7;
+        }
+        else if (strncmp(argv[i], "--parity=", 9) == 0)
+        {
+            opts->parity = atoi(argv[i] + 9);
+            if (opts->parity < 1 || opts->parity > 254)
+            {
+                fprintf(stderr, "--parity takes a number of parity images between 1 and 254\n");
+                exit(1);
+            }
+        }
+        else
+        {
+            argv[out++] = argv[i];
+        }
     }
+    argv[out] = NULL;
+    *argc = out;
 
-    stego_fs.total_data_size = position + (total_size * 8);
-    stego_fs.dirty = 0;
-    return 0;
+    if (!opts->passphrase)
+        opts->passphrase = getenv("STEGO_PASSPHRASE");
+    if (opts->passphrase && opts->passphrase[0] == '\0')
+        opts->passphrase = NULL;
 }
 
-static struct fuse_operations stego_oper = {
-    .init = stego_init,
-    .destroy = stego_destroy,
-    .getattr = stego_getattr,
-    .readdir = stego_readdir,
-    .open = stego_open,
-    .create = stego_create,
-    .write = stego_write,
-    .read = stego_read,
-    .unlink = stego_unlink,
-    .truncate = stego_truncate, // Add if not present
-    .utimens = stego_utimens,   // Add if not present
-    .chmod = stego_chmod,       // Add if not present
-};
-
-void write_metadata(size_t *position, const file_metadata_t *metadata)
+// Stage totals from --perf, on stderr so piped output stays clean
+static void print_stage_profile(void)
 {
-    write_bits(metadata->file_size, 32, position);
-    write_bits(metadata->ext_length, 8, position);
-    for (int i = 0; i < metadata->ext_length; i++)
+#ifdef __linux__
+    int counters = perf_counting;
+#else
+    int counters = 0;
+#endif
+    fprintf(stderr, "\n%-8s %6s %10s", "stage", "calls", "wall ms");
+    if (counters)
+        fprintf(stderr, " %14s %14s %5s %12s %7s %12s %7s", "cycles", "instructions", "IPC", "cache-miss", "/kinst",
+                "branch-miss", "/kinst");
+    fprintf(stderr, "\n");
+    for (int s = 0; s < STAGE_COUNT; s++)
     {
-        write_bits(metadata->extension[i], 8, position);
+        const uint64_t *t = stage_totals[s];
+        if (!stage_calls[s])
+            continue;
+        fprintf(stderr, "%-8s %6llu %10.3f", stage_names[s], (unsigned long long)stage_calls[s], t[PERF_WALL_NS] / 1e6);
+        if (!counters)
+        {
+            fprintf(stderr, "\n");
+            continue;
+        }
+        double kinst = t[PERF_INSTRUCTIONS] / 1000.0;
+        fprintf(stderr, " %14llu %14llu %5.2f %12llu %7.2f %12llu %7.2f\n", (unsigned long long)t[PERF_CYCLES],
+                (unsigned long long)t[PERF_INSTRUCTIONS],
+                t[PERF_CYCLES] ? (double)t[PERF_INSTRUCTIONS] / t[PERF_CYCLES] : 0.0,
+                (unsigned long long)t[PERF_CACHE_MISSES], kinst ? t[PERF_CACHE_MISSES] / kinst : 0.0,
+                (unsigned long long)t[PERF_BRANCH_MISSES], kinst ? t[PERF_BRANCH_MISSES] / kinst : 0.0);
     }
 }
 
-static void read_metadata(size_t *position, file_metadata_t *metadata)
+// --trace: the per-thread event buffers as Chrome trace-event JSON, for
+// chrome://tracing or Perfetto. Times are microseconds from trace start.
+static const char *trace_path;
+static uint64_t trace_start_ns;
+
+static void write_trace(void)
 {
-    metadata->file_size = read_bits(32, position);
-    metadata->ext_length = read_bits(8, position);
-    for (int i = 0; i < metadata->ext_length; i++)
+    FILE *f = fopen(trace_path, "w");
+    if (!f)
     {
-        metadata->extension[i] = read_bits(8, position);
+        fprintf(stderr, "Cannot write trace %s: %s\n", trace_path, strerror(errno));
+        return;
     }
-    metadata->extension[metadata->ext_length] = '\0';
+    long pid = getpid();
+    size_t dropped = 0;
+    const char *sep = "";
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (trace_buffer_t *b = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); b; b = b->next)
+    {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%ld,\"args\":{\"name\":\"%s %ld\"}}",
+                sep, pid, b->tid, b->tid == pid ? "main" : "worker", b->tid);
+        sep = ",\n";
+        size_t count = __atomic_load_n(&b->count, __ATOMIC_ACQUIRE);
+        for (size_t i = 0; i < count; i++)
+        {
+            const trace_event_t *e = &b->events[i];
+            fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":%ld}",
+                    stage_names[e->stage], (e->begin_ns - trace_start_ns) / 1e3, (e->end_ns - e->begin_ns) / 1e3, pid,
+                    b->tid);
+        }
+        dropped += b->dropped;
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0)
+        fprintf(stderr, "Cannot write trace %s\n", trace_path);
+    if (dropped)
+        fprintf(stderr, "Trace buffers were full, %zu events dropped\n", dropped);
 }
 
-static int do_hide_file(const char *cover_image, const char *secret_file, const char *output)
-{
-    int width, height, channels;
-    unsigned char *image_data = stbi_load(cover_image, &width, &height, &channels, 3);
-    if (!image_data)
-        return 1;
+static double stats_start;
 
-    size_t max_capacity = (width * height * 3) / 8;
-    printf("Image capacity: %zu bytes\n", max_capacity);
+static double monotonic_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    FILE *f = fopen(secret_file, "rb");
-    if (!f)
+// --stats=json: one object per run on a single line. It goes to stdout, with
+// the progress lines moved to stderr, unless stdout carries the image or file.
+static void print_run_stats(FILE *out, const char *command, int status)
+{
+    double wall = monotonic_seconds() - stats_start;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    stage_stats_t *st = &stage_stats;
+
+    fprintf(out, "{\"command\":\"%s\",\"status\":%d,\"wall_ms\":%.3f,\"stages\":{", command, status, wall * 1e3);
+    const char *sep = "";
+    for (int s = 0; s < STAGE_COUNT; s++)
     {
-        stbi_image_free(image_data);
-        return 1;
+        if (!stage_calls[s])
+            continue;
+        fprintf(out, "%s\"%s\":{\"calls\":%llu,\"wall_ms\":%.3f}", sep, stage_names[s],
+                (unsigned long long)stage_calls[s], stage_totals[s][PERF_WALL_NS] / 1e6);
+        sep = ",";
     }
+    fprintf(out, "},\"images\":%llu,\"payload_bytes\":%llu,\"bits_per_second\":%.0f,\"peak_rss_kb\":%ld,",
+            (unsigned long long)st->images, (unsigned long long)st->payload_bytes,
+            wall > 0 ? st->payload_bytes * 8 / wall : 0.0, usage.ru_maxrss);
+    fprintf(out, "\"carrier_bytes\":%llu,\"carrier_used_bytes\":%llu,\"utilization\":%.4f,\"output_bytes\":%llu}\n",
+            (unsigned long long)(st->carrier_bits / 8), (unsigned long long)((st->used_bits + 7) / 8),
+            st->carrier_bits ? (double)st->used_bits / st->carrier_bits : 0.0, (unsigned long long)st->output_bytes);
+    fflush(out);
+}
 
-    fseek(f, 0, SEEK_END);
-    size_t file_size = ftell(f);
-    fseek(f, 0, SEEK_SET);
+// Machine profile: key=value lines written by `autotune` and read at startup.
+// STEGO_PROFILE overrides the default location under the XDG config dir.
+#define TUNING_PROFILE_VERSION 1
 
-    // Check if file fits in image
-    if (file_size > max_capacity - 64)
-    { // Reserve space for metadata
-        fprintf(stderr, "File too large for image\n");
-        fclose(f);
-        stbi_image_free(image_data);
+static int tuning_profile_path(char *path, size_t size)
+{
+    const char *env = getenv("STEGO_PROFILE");
+    if (env && *env)
+        snprintf(path, size, "%s", env);
+    else if ((env = getenv("XDG_CONFIG_HOME")) && *env)
+        snprintf(path, size, "%s/steganography/profile", env);
+    else if ((env = getenv("HOME")) && *env)
+        snprintf(path, size, "%s/.config/steganography/profile", env);
+    else
         return 1;
-    }
-
-    printf("Embedding file of size: %zu bytes\n", file_size);
+    return 0;
+}
 
-    unsigned char *file_data = malloc(file_size);
-    fread(file_data, 1, file_size, f);
-    fclose(f);
+static void apply_tuning(const stego_tuning_t *tuning)
+{
+    stego_tuning = *tuning;
+    stbi_write_png_compression_level = tuning->png_level;
+}
 
-    size_t position = 0;
-    // Write magic number for validation
-    uint32_t magic = 0x5354454; // "STEG"
-    for (int i = 31; i >= 0; i--)
+// A missing profile leaves the defaults; values out of range are ignored, and
+// the thread count only holds on a machine with the CPU count it was tuned on;
+// elsewhere the default of 0, one thread per online CPU, stays
+static void load_tuning_profile(void)
+{
+    char path[PATH_MAX];
+    FILE *f = tuning_profile_path(path, sizeof(path)) == 0 ? fopen(path, "r") : NULL;
+    if (!f)
+        return;
+    stego_tuning_t tuning = stego_tuning;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN), tuned_cpus = cpus;
+    int version = 0;
+    char line[256], key[32];
+    unsigned long long value;
+    while (fgets(line, sizeof(line), f))
     {
-        embed_bit(image_data, width, height, position++, (magic >> i) & 1);
+        if (sscanf(line, "%31[^=]=%llu", key, &value) != 2)
+            continue;
+        if (strcmp(key, "version") == 0)
+            version = value;
+        else if (strcmp(key, "cpus") == 0)
+            tuned_cpus = value;
+        else if (strcmp(key, "threads") == 0 && value >= 1 && value <= 1024)
+            tuning.threads = value;
+        else if (strcmp(key, "io_block") == 0 && value >= WRITE_ALIGN && value <= (64 << 20) &&
+                 value % WRITE_ALIGN == 0)
+            tuning.io_block = value;
+        else if (strcmp(key, "band") == 0 && value >= 4096 && value <= (16 << 20))
+            tuning.band = value;
+        else if (strcmp(key, "png_level") == 0 && value >= 5 && value <= 9)
+            tuning.png_level = value;
     }
-
-    // Write file size
-    for (int i = 31; i >= 0; i--)
+    fclose(f);
+    if (version != TUNING_PROFILE_VERSION)
+        return;
+    if (tuned_cpus != cpus)
     {
-        embed_bit(image_data, width, height, position++, (file_size >> i) & 1);
+        fprintf(stderr, "%s was tuned on %ld CPUs, not %ld; keeping one thread per CPU, run autotune again\n",
+                path, tuned_cpus, cpus);
+        tuning.threads = stego_tuning.threads;
     }
+    apply_tuning(&tuning);
+}
 
-    // Write extension
-    uint8_t ext_length = 0;
-    char extension[11] = {0};
-    get_metadata_extension(secret_file, extension, sizeof(extension), &ext_length);
-
-    for (int i = 7; i >= 0; i--)
+static int save_tuning_profile(const char *path, const stego_tuning_t *tuning)
+{
+    // Create the config directories of the default location
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/'))
     {
-        embed_bit(image_data, width, height, position++, (ext_length >> i) & 1);
+        *slash = '\0';
+        mkdir(dir, 0755);
+        *slash = '/';
     }
 
-    for (int i = 0; i < ext_length; i++)
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+    FILE *f = fopen(tmp, "w");
+    if (!f)
     {
-        for (int j = 7; j >= 0; j--)
-        {
-            embed_bit(image_data, width, height, position++, (extension[i] >> j) & 1);
-        }
+        fprintf(stderr, "Failed to create %s: %s\n", tmp, strerror(errno));
+        return 1;
     }
-
-    // Write file data
-    for (size_t i = 0; i < file_size; i++)
+    fprintf(f, "# Written by `steganography autotune`; run it again after moving to other hardware\n");
+    fprintf(f, "version=%d\ncpus=%ld\n", TUNING_PROFILE_VERSION, sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(f, "threads=%d\nio_block=%zu\nband=%zu\npng_level=%d\n", tuning->threads, tuning->io_block,
+            tuning->band, tuning->png_level);
+    if (fclose(f) != 0 || rename(tmp, path) != 0)
     {
-        for (int j = 7; j >= 0; j--)
-        {
-            embed_bit(image_data, width, height, position++, (file_data[i] >> j) & 1);
-        }
+        fprintf(stderr, "Failed to write %s\n", path);
+        unlink(tmp);
+        return 1;
     }
-
-    stbi_write_png(output, width, height, 3, image_data, width * 3);
-
-    free(file_data);
-    stbi_image_free(image_data);
     return 0;
 }
 
-static int do_extract_file(const char *stego_image, const char *output)
+#define TUNE_WIDTH 1024
+#define TUNE_HEIGHT 1024
+#define TUNE_IO_BYTES ((size_t)32 << 20)
+#define TUNE_MARGIN 0.95 // a smaller setting wins if it reaches this share of the best rate
+
+static uint64_t tune_rand(uint64_t *state)
 {
-    int width, height, channels;
-    unsigned char *image_data = stbi_load(stego_image, &width, &height, &channels, 3);
-    if (!image_data)
-        return 1;
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
 
-    size_t position = 0;
+// A cover that looks like a stego image to deflate: smooth gradients with
+// random low bits
+static void tune_fill_cover(unsigned char *pixels, uint64_t seed)
+{
+    for (int y = 0; y < TUNE_HEIGHT; y++)
+        for (int x = 0; x < TUNE_WIDTH; x++)
+            for (int c = 0; c < 3; c++)
+                pixels[((size_t)y * TUNE_WIDTH + x) * 3 + c] = ((x * (c + 1) + y * (3 - c)) >> 3 & 0xFE) |
+                                                              (tune_rand(&seed) & 1);
+}
 
-    // Read and verify magic number
-    uint32_t magic = 0;
-    for (int i = 31; i >= 0; i--)
+typedef struct
+{
+    unsigned char *pixels;
+    const unsigned char *data;
+    size_t len;
+    int rounds;
+} tune_embed_job_t;
+
+// The embed and extract kernels over one cover, as a stripe or pool worker runs them
+static void *tune_embed_worker(void *arg)
+{
+    tune_embed_job_t *job = arg;
+    stego_payload_t payload = {job->pixels, (size_t)TUNE_WIDTH * TUNE_HEIGHT * 3, 0, 0, NULL, NULL, NULL};
+    unsigned char *out = malloc(job->len);
+    for (int r = 0; out && r < job->rounds; r++)
     {
-        magic |= (extract_bit(image_data, width, height, position++) << i);
+        payload_write(&payload, 0, job->data, job->len);
+        payload_read(&payload, 0, out, job->len);
     }
+    free(out);
+    return NULL;
+}
 
-    if (magic != 0x5354454)
-    {
-        fprintf(stderr, "Invalid steganographic image\n");
-        stbi_image_free(image_data);
-        return 1;
-    }
+// Payload MB/s through the kernels with `threads` workers on their own covers
+static double tune_embed_rate(tune_embed_job_t *jobs, int threads)
+{
+    pthread_t tids[256];
+    double start = monotonic_seconds();
+    int started = 0;
+    while (started < threads && pthread_create(&tids[started], NULL, tune_embed_worker, &jobs[started]) == 0)
+        started++;
+    for (int t = 0; t < started; t++)
+        pthread_join(tids[t], NULL);
+    double elapsed = monotonic_seconds() - start;
+    return started == threads ? 2.0 * threads * jobs[0].rounds * jobs[0].len / elapsed / 1e6 : 0.0;
+}
 
-    // Read file size
-    size_t file_size = 0;
-    for (int i = 31; i >= 0; i--)
+static int tune_threads(const unsigned char *data, size_t len)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus < 1 ? 1 : cpus > 256 ? 256 : cpus;
+    tune_embed_job_t *jobs = calloc(max_threads, sizeof(*jobs));
+    if (!jobs)
+        return 1;
+    int ready = 0;
+    while (ready < max_threads &&
+           (jobs[ready].pixels = malloc((size_t)TUNE_WIDTH * TUNE_HEIGHT * 3)) != NULL)
     {
-        file_size |= ((size_t)extract_bit(image_data, width, height, position++) << i);
+        tune_fill_cover(jobs[ready].pixels, ready + 1);
+        jobs[ready] = (tune_embed_job_t){jobs[ready].pixels, data, len, 1};
+        ready++;
     }
-
-    size_t max_capacity = (width * height * 3) / 8;
-    if (file_size > max_capacity - 64)
+    max_threads = ready;
+    if (!max_threads)
     {
-        fprintf(stderr, "Invalid file size: %zu\n", file_size);
-        stbi_image_free(image_data);
+        free(jobs);
         return 1;
     }
 
-    printf("Extracting file of size: %zu bytes\n", file_size);
+    // Size the rounds so one worker runs for about a fifth of a second
+    double rate = tune_embed_rate(jobs, 1);
+    int rounds = rate > 0 ? (int)(0.2 * rate * 1e6 / (2.0 * len)) + 1 : 1;
+    for (int t = 0; t < max_threads; t++)
+        jobs[t].rounds = rounds;
 
-    // Continue with extension and data extraction
-    uint8_t ext_length = 0;
-    for (int i = 7; i >= 0; i--)
+    // 1, 2, 4, ... and every CPU
+    int best = 1, counts[16], n = 0;
+    double best_rate = 0.0, rates[16];
+    for (int threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads)
     {
-        ext_length |= (extract_bit(image_data, width, height, position++) << i);
+        counts[n] = threads;
+        rates[n] = tune_embed_rate(jobs, threads);
+        printf("  embed+extract %4d thread(s) %10.1f MB/s\n", threads, rates[n]);
+        if (rates[n] > best_rate)
+            best_rate = rates[n];
+        n++;
+        if (threads == max_threads)
+            break;
     }
+    // The fewest workers that come close to the best aggregate rate
+    for (int i = n - 1; i >= 0; i--)
+        if (rates[i] >= TUNE_MARGIN * best_rate)
+            best = counts[i];
+    for (int t = 0; t < ready; t++)
+        free(jobs[t].pixels);
+    free(jobs);
+    return best;
+}
 
-    if (ext_length > 10)
+// Folds several data stripes into a parity stripe band by band, as
+// compute_parity_stripe() does
+static size_t tune_band(void)
+{
+    enum
     {
-        fprintf(stderr, "Invalid extension length\n");
-        stbi_image_free(image_data);
-        return 1;
-    }
-
-    char extension[11] = {0};
-    for (int i = 0; i < ext_length; i++) {
-        uint8_t c = 0;
-        for (int j = 7; j >= 0; j--) {
-            c |= (extract_bit(image_data, width, height, position++) << j);
+        STRIPES = 4,
+        STRIPE = 8 << 20
+    };
+    unsigned char *buf = malloc((size_t)(STRIPES + 1) * STRIPE);
+    if (!buf)
+        return stego_tuning.band;
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    for (size_t i = 0; i < (size_t)(STRIPES + 1) * STRIPE; i++)
+        buf[i] = tune_rand(&seed);
+    unsigned char *out = buf + (size_t)STRIPES * STRIPE;
+
+    size_t best = stego_tuning.band;
+    double best_rate = 0.0;
+    for (size_t band = 16 << 10; band <= (2 << 20); band *= 2)
+    {
+        double elapsed = 1e9;
+        for (int pass = 0; pass < 3; pass++)
+        {
+            double start = monotonic_seconds();
+            for (size_t b = 0; b < STRIPE; b += band)
+                for (int i = 0; i < STRIPES; i++)
+                    gf_mul_add_region(out + b, buf + (size_t)i * STRIPE + b, 0x53 + i, band);
+            double t = monotonic_seconds() - start;
+            elapsed = t < elapsed ? t : elapsed;
+        }
+        double rate = (double)STRIPES * STRIPE / elapsed / 1e6;
+        printf("  parity band %9zu bytes %10.1f MB/s\n", band, rate);
+        if (rate > best_rate / TUNE_MARGIN)
+        {
+            best = band;
+            best_rate = rate;
         }
-        extension[i] = c;
     }
+    free(buf);
+    return best;
+}
 
-    unsigned char *file_data = malloc(file_size);
-    for (size_t i = 0; i < file_size; i++)
+// Deflate effort against encode plus inflate time: the fastest level whose
+// output is within 2% of the smallest
+static int tune_png_level(void)
+{
+    unsigned char *pixels = malloc((size_t)TUNE_WIDTH * TUNE_HEIGHT * 3);
+    if (!pixels)
+        return stego_tuning.png_level;
+    tune_fill_cover(pixels, 7);
+    double times[10] = {0};
+    int sizes[10] = {0}, smallest = 0;
+    for (int level = 5; level <= 9; level++)
     {
-        file_data[i] = 0;
-        for (int j = 7; j >= 0; j--)
+        stbi_write_png_compression_level = level;
+        double start = monotonic_seconds();
+        int len;
+        unsigned char *png = stbi_write_png_to_mem(pixels, TUNE_WIDTH * 3, TUNE_WIDTH, TUNE_HEIGHT, 3, &len);
+        double encoded = monotonic_seconds();
+        int w, h, c;
+        unsigned char *decoded = png ? stbi_load_from_memory(png, len, &w, &h, &c, 3) : NULL;
+        double decoded_at = monotonic_seconds();
+        if (decoded)
         {
-            file_data[i] |= (extract_bit(image_data, width, height, position++) << j);
+            times[level] = decoded_at - start;
+            sizes[level] = len;
+            if (!smallest || len < smallest)
+                smallest = len;
+            printf("  png level %d  %9d bytes  deflate %7.1f ms  inflate %7.1f ms\n", level, len,
+                   (encoded - start) * 1e3, (decoded_at - encoded) * 1e3);
         }
+        stbi_image_free(decoded);
+        STBIW_FREE(png);
     }
+    stbi_write_png_compression_level = stego_tuning.png_level;
+    free(pixels);
+
+    int best = stego_tuning.png_level;
+    for (int level = 5; level <= 9; level++)
+        if (sizes[level] && sizes[level] <= smallest * 1.02 && (!sizes[best] || times[level] < times[best]))
+            best = level;
+    return best;
+}
 
-    char *full_output = malloc(strlen(output) + ext_length + 2);
-    if (ext_length > 0) {
-        sprintf(full_output, "%s.%s", output, extension);
-    } else {
-        strcpy(full_output, output);
-    }
-
-    FILE *f = fopen(full_output, "wb");
-    if (f)
+// Writes a scratch file in `dir` in blocks of each size, the way
+// write_to_file() writes an image, and keeps the fastest
+static size_t tune_io_block(const char *dir)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/.stego_autotune.%ld.tmp", dir, (long)getpid());
+    unsigned char *data = malloc(TUNE_IO_BYTES);
+    if (!data)
+        return stego_tuning.io_block;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < TUNE_IO_BYTES; i++)
+        data[i] = tune_rand(&seed);
+
+    size_t best = stego_tuning.io_block;
+    double best_rate = 0.0;
+    for (size_t block = 64 << 10; block <= (16 << 20); block *= 4)
     {
-        fwrite(file_data, 1, file_size, f);
-        fclose(f);
+        double elapsed = 1e9;
+        for (int pass = 0; pass < 2; pass++)
+        {
+            int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (fd < 0)
+            {
+                fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+                free(data);
+                return best;
+            }
+            double start = monotonic_seconds();
+            // Without preallocation every block size is timed the same way
+            int failed = fallocate(fd, 0, 0, TUNE_IO_BYTES) != 0 && errno == ENOSPC;
+            for (size_t done = 0; done < TUNE_IO_BYTES && !failed; done += block)
+                failed = write_all(fd, data + done, block, done) != 0;
+            failed |= fsync(fd) != 0;
+            double t = monotonic_seconds() - start;
+            close(fd);
+            unlink(path);
+            if (failed)
+            {
+                fprintf(stderr, "Failed to write %s\n", path);
+                free(data);
+                return best;
+            }
+            elapsed = t < elapsed ? t : elapsed;
+        }
+        double rate = TUNE_IO_BYTES / elapsed / 1e6;
+        printf("  write block %9zu bytes %10.1f MB/s\n", block, rate);
+        if (rate > best_rate / TUNE_MARGIN)
+        {
+            best = block;
+            best_rate = rate;
+        }
     }
-
-    free(full_output);
-    free(file_data);
-    stbi_image_free(image_data);
-    return 0;
+    free(data);
+    return best;
 }
 
-static int do_mount_point(int argc, char *argv[])
+// Measures this machine and saves the parameters later runs start with;
+// `dir` is where the write test goes, ideally where stego images will live
+static int do_autotune(const char *dir)
 {
-    if (argc < 4)
+    char path[PATH_MAX];
+    if (tuning_profile_path(path, sizeof(path)) != 0)
     {
-        fprintf(stderr, "Usage: %s mount <image_path> <mount_point> [FUSE options]\n", argv[0]);
+        fprintf(stderr, "Set HOME or STEGO_PROFILE to choose where the profile goes\n");
         return 1;
     }
+    size_t len = (size_t)TUNE_WIDTH * TUNE_HEIGHT * 3 / 8 / 2; // half the capacity, as a typical hide
+    unsigned char *data = malloc(len);
+    if (!data)
+        return 1;
+    uint64_t seed = 0x853C49E6748FEA9BULL;
+    for (size_t i = 0; i < len; i++)
+        data[i] = tune_rand(&seed);
+
+    stego_tuning_t tuning = stego_tuning;
+    printf("Tuning on %ld CPUs\n", sysconf(_SC_NPROCESSORS_ONLN));
+    tuning.threads = tune_threads(data, len);
+    free(data);
+    tuning.band = tune_band();
+    tuning.png_level = tune_png_level();
+    tuning.io_block = tune_io_block(dir);
+    printf("threads=%d io_block=%zu band=%zu png_level=%d\n", tuning.threads, tuning.io_block, tuning.band,
+           tuning.png_level);
+    if (save_tuning_profile(path, &tuning) != 0)
+        return 1;
+    printf("Saved %s\n", path);
+    return 0;
+}
 
-    stego_fs.image_path = realpath(argv[2], NULL);
-    if (!stego_fs.image_path)
+#ifndef STEGO_NO_MAIN // src/fsbench.c drives the mount without the CLI
+int main(int argc, char *argv[])
+{
+    stego_options_t opts;
+    parse_options(&argc, argv, &opts);
+    if (argc < 2 || strcmp(argv[1], "autotune") != 0)
+        load_tuning_profile();
+    if (opts.perf)
     {
-        fprintf(stderr, "Invalid image path\n");
-        return 1;
+        stage_profiling = STAGE_PROFILE_TIME | STAGE_PROFILE_COUNTERS;
+        atexit(print_stage_profile);
     }
-
-    if (init_stego_fs(stego_fs.image_path) != 0)
+    if (opts.trace)
     {
-        fprintf(stderr, "Failed to initialize filesystem\n");
-        free(stego_fs.image_path);
-        return 1;
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        trace_start_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        trace_path = opts.trace;
+        stage_profiling |= STAGE_PROFILE_TRACE;
+        atexit(write_trace);
     }
-
-    // Adjust FUSE arguments
-    char **fuse_argv = malloc((argc - 1) * sizeof(char *));
-    fuse_argv[0] = argv[0];
-    fuse_argv[1] = argv[3]; // mount point
-    for (int i = 4; i < argc; i++)
+    if (opts.stats)
     {
-        fuse_argv[i - 2] = argv[i];
+        stage_profiling |= STAGE_PROFILE_TIME;
+        stego_info_stream = stderr;
+        stats_start = monotonic_seconds();
     }
+#ifdef STEGO_ALLOC_PROFILE
+    stage_profiling |= STAGE_PROFILE_ALLOC;
+    atexit(alloc_profile_report);
+#endif
 
-    struct fuse_args args = FUSE_ARGS_INIT(argc - 2, fuse_argv);
-    int ret = fuse_main(args.argc, args.argv, &stego_oper, NULL);
-
-    free(fuse_argv);
-    return ret;
-}
-
-int main(int argc, char *argv[])
-{
     if (argc < 2)
     {
         // fprintf(stderr, "Usage: %s [hide|extract|mount] <image_path> <mount_point> [FUSE options]\n", argv[0]);
@@ -826,10 +6733,43 @@ int main(int argc, char *argv[])
         fprintf(stderr, "             <arg1> - Path to the image file.\n");
         fprintf(stderr, "             <arg2> - Path to the target directory.\n");
         fprintf(stderr, "\n");
+        fprintf(stderr, "  verify   Check the hidden payload against its checksum without writing it.\n");
+        fprintf(stderr, "           Arguments:\n");
+        fprintf(stderr, "             <arg1> - Path to the image file.\n");
+        fprintf(stderr, "\n");
+        fprintf(stderr, "  store    Deduplicate a file into a pool of cover images, hiding its recipe in an image.\n");
+        fprintf(stderr, "           Arguments:\n");
+        fprintf(stderr, "             <arg1> - Directory of PNG covers shared by stored files.\n");
+        fprintf(stderr, "             <arg2> - Path to the image file for the recipe.\n");
+        fprintf(stderr, "             <arg3> - Path to a generic file.\n");
+        fprintf(stderr, "\n");
+        fprintf(stderr, "  autotune Measure this machine and save the worker, I/O and PNG settings later runs use.\n");
+        fprintf(stderr, "           Arguments:\n");
+        fprintf(stderr, "             <arg1> - Directory for the write test (default: current directory).\n");
+        fprintf(stderr, "\n");
+        fprintf(stderr, "Options:\n");
+        fprintf(stderr, "  --passphrase=<pass>  Encrypt/decrypt the payload with ChaCha20 (or set STEGO_PASSPHRASE).\n");
+        fprintf(stderr, "  --scatter            Spread payload bits over the image in a passphrase-keyed order (hide).\n");
+        fprintf(stderr, "  --ecc=<parity>       Reed-Solomon protect the payload with <parity> bytes per 255 (hide).\n");
+        fprintf(stderr, "  --parity=<m>         Add <m> parity images to a striped hide; any <m> images may be lost.\n");
+        fprintf(stderr, "  --pool=<dir>         Chunk pool to rebuild a stored file from (extract).\n");
+        fprintf(stderr, "  --output=<path>      Where hide and store write the stego image (default stego_<image>); a\n");
+        fprintf(stderr, "                       directory for the images of a striped hide.\n");
+        fprintf(stderr, "  --direct-io          Write stego images with O_DIRECT, bypassing the page cache.\n");
+        fprintf(stderr, "  --huge-pages         Back the per-worker image arenas with huge pages (store).\n");
+        fprintf(stderr, "  --perf               Print cycles, instructions and cache/branch misses per stage at exit.\n");
+        fprintf(stderr, "  --stats=json         Print stage times, throughput, peak RSS and utilization as JSON.\n");
+        fprintf(stderr, "  --trace=<file>       Write a Chrome trace of every stage on every thread at exit.\n");
+        fprintf(stderr, "\n");
+        fprintf(stderr, "  An image or file argument of - reads stdin; an output of - writes stdout.\n");
+        fprintf(stderr, "\n");
         fprintf(stderr, "Examples:\n");
         fprintf(stderr, "  steganography hide image.png file.txt\n");
         fprintf(stderr, "  steganography extract image.png output.txt\n");
         fprintf(stderr, "  steganography mount image.png /mnt/mydir\n");
+        fprintf(stderr, "  steganography verify stego_image.png\n");
+        fprintf(stderr, "  steganography store pool/ image.png file.txt\n");
+        fprintf(stderr, "  steganography autotune /srv/images\n");
         fprintf(stderr, "\n");
         fprintf(stderr, "Note: Ensure proper permissions and valid paths for all arguments.\n");
         return 1;
@@ -837,7 +6777,7 @@ int main(int argc, char *argv[])
 
     if (strcmp("hide", argv[1]) == 0 || strcmp("-h", argv[1]) == 0)
     {
-        if (argc < 3)
+        if (argc < 4)
         {
             /* code */
             fprintf(stderr, "Usage: steganography hide <arg1> <arg2>\n");
@@ -847,23 +6787,39 @@ int main(int argc, char *argv[])
             fprintf(stderr, "             <arg1> - Path to the image file.\n");
             fprintf(stderr, "             <arg2> - Path to a generic file (executable, image, text, etc.).\n");
             fprintf(stderr, "\n");
+            fprintf(stderr, "  More than one image stripes the file across all of them (last argument is the file).\n");
+            fprintf(stderr, "\n");
             fprintf(stderr, "Examples:\n");
             fprintf(stderr, "  steganography hide image.png file.txt\n");
+            fprintf(stderr, "  steganography hide a.png b.png c.png big.bin\n");
+            fprintf(stderr, "  cat image.png | steganography hide - file.txt > stego.png\n");
             fprintf(stderr, "\n");
             fprintf(stderr, "Note: Ensure proper permissions and valid paths for all arguments.\n");
             return 1;
         }
 
+        // A cover read from stdin goes back out on stdout unless --output says otherwise
         char stego_image[256];
         snprintf(stego_image, sizeof(stego_image), "stego_%s", get_file_name(argv[2]));
+        const char *output = opts.output ? opts.output : strcmp(argv[2], "-") == 0 ? "-" : stego_image;
+        if (strcmp(argv[2], "-") == 0 && strcmp(argv[argc - 1], "-") == 0)
+        {
+            fprintf(stderr, "Only one of the cover and the file can come from stdin\n");
+            return 1;
+        }
+        if (strcmp(output, "-") == 0)
+            stego_info_stream = stderr;
         fprintf(stderr, "Starting hiding file... \n");
-        int r = do_hide_file(argv[2], argv[3], stego_image);
+        int r = argc > 4 ? do_hide_striped(argv + 2, argc - 3, argv[argc - 1], &opts)
+                         : do_hide_file(argv[2], argv[3], output, &opts);
         if (r != 0)
         {
             /* code */
             fprintf(stderr, "Finishing with error \n");
         }
         fprintf(stderr, "Done. \n");
+        if (opts.stats)
+            print_run_stats(strcmp(output, "-") == 0 ? stderr : stdout, "hide", r);
 
         return r;
         // return 0;
@@ -871,7 +6827,7 @@ int main(int argc, char *argv[])
 
     if (strcmp("extract", argv[1]) == 0 || strcmp("-e", argv[1]) == 0)
     {
-        if (argc < 3)
+        if (argc < 4)
         {
             /* code */
             fprintf(stderr, "Usage: steganography extract <arg1> <arg2>\n");
@@ -881,21 +6837,84 @@ int main(int argc, char *argv[])
             fprintf(stderr, "             <arg1> - Path to the image file.\n");
             fprintf(stderr, "             <arg2> - Name for the extracted file.\n");
             fprintf(stderr, "\n");
+            fprintf(stderr, "  Pass every stripe image of a striped file (last argument is the output name).\n");
+            fprintf(stderr, "\n");
             fprintf(stderr, "Examples:\n");
             fprintf(stderr, "  steganography extract image.png output.txt\n");
+            fprintf(stderr, "  steganography extract stego_a.png stego_b.png stego_c.png big\n");
+            fprintf(stderr, "  steganography extract - - < stego.png > file.txt\n");
             fprintf(stderr, "\n");
             fprintf(stderr, "Note: Ensure proper permissions and valid paths for all arguments.\n");
             return 1;
         }
 
+        if (strcmp(argv[argc - 1], "-") == 0)
+            stego_info_stream = stderr;
         fprintf(stderr, "Starting file extraction... \n");
-        int r = do_extract_file(argv[2], argv[3]);
+        int r = argc > 4 ? do_extract_striped(argv + 2, argc - 3, argv[argc - 1], &opts)
+                         : do_extract_file(argv[2], argv[3], &opts);
         if (r != 0)
         {
             /* code */
             fprintf(stderr, "Finishing with error \n");
         }
         fprintf(stderr, "Done. \n");
+        if (opts.stats)
+            print_run_stats(strcmp(argv[argc - 1], "-") == 0 ? stderr : stdout, "extract", r);
+        return r;
+    }
+
+    if (strcmp("verify", argv[1]) == 0 || strcmp("-v", argv[1]) == 0)
+    {
+        if (argc < 3)
+        {
+            fprintf(stderr, "Usage: steganography verify <arg1>\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "  verify   Check the hidden payload against its checksum without writing it.\n");
+            fprintf(stderr, "           Arguments:\n");
+            fprintf(stderr, "             <arg1> - Path to the image file.\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "Examples:\n");
+            fprintf(stderr, "  steganography verify stego_image.png\n");
+            return 1;
+        }
+
+        return do_verify_file(argv[2], &opts);
+    }
+
+    if (strcmp("store", argv[1]) == 0 || strcmp("-s", argv[1]) == 0)
+    {
+        if (argc < 5)
+        {
+            fprintf(stderr, "Usage: steganography store <arg1> <arg2> <arg3>\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "  store    Deduplicate a file into a pool of cover images, hiding its recipe in an image.\n");
+            fprintf(stderr, "           Arguments:\n");
+            fprintf(stderr, "             <arg1> - Directory of PNG covers shared by stored files.\n");
+            fprintf(stderr, "             <arg2> - Path to the image file for the recipe.\n");
+            fprintf(stderr, "             <arg3> - Path to a generic file.\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "  Extract with: steganography extract stego_image.png output --pool=<arg1>\n");
+            fprintf(stderr, "\n");
+            fprintf(stderr, "Examples:\n");
+            fprintf(stderr, "  steganography store pool/ image.png file.txt\n");
+            return 1;
+        }
+
+        char stego_image[256];
+        snprintf(stego_image, sizeof(stego_image), "stego_%s", get_file_name(argv[3]));
+        const char *output = opts.output ? opts.output : stego_image;
+        if (strcmp(output, "-") == 0)
+            stego_info_stream = stderr;
+        fprintf(stderr, "Starting file store... \n");
+        int r = do_store_file(argv[2], argv[3], argv[4], output, &opts);
+        if (r != 0)
+        {
+            fprintf(stderr, "Finishing with error \n");
+        }
+        fprintf(stderr, "Done. \n");
+        if (opts.stats)
+            print_run_stats(strcmp(output, "-") == 0 ? stderr : stdout, "store", r);
         return r;
     }
 
@@ -918,9 +6937,15 @@ int main(int argc, char *argv[])
             return 1;
         }
 
-        return do_mount_point(argc, argv);
+        return do_mount_point(argc, argv, &opts);
     }
 
+    if (strcmp("autotune", argv[1]) == 0)
+        return do_autotune(argc > 2 ? argv[2] : ".");
+
     fprintf(stderr, "Command not found <%s>.\n", argv[1]);
     return 0;
 }
+#endif // STEGO_NO_MAIN
+
+#endif // STEGO_LIBRARY
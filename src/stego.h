@@ -0,0 +1,98 @@
+#ifndef STEGO_H
+#define STEGO_H
+
+// libstego: hide, extract and probe LSB payloads in-process.
+//
+// A context holds the options for a run of calls (passphrase, scatter, ECC)
+// and the allocator used for every buffer, including image decoding. Once
+// configured a context is only read by the calls below, so it may be shared
+// by any number of threads; different contexts are fully independent.
+// Calls return 0 on success and non-zero on failure, in which case
+// stego_last_error() describes what went wrong on the calling thread.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define STEGO_API __attribute__((visibility("default")))
+#else
+#define STEGO_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Header flag bits, as reported in stego_info_t.flags
+#define STEGO_FLAG_ENCRYPTED 0x01
+#define STEGO_FLAG_SCATTER 0x02
+#define STEGO_FLAG_ECC 0x04
+#define STEGO_FLAG_CHECKSUM 0x08
+#define STEGO_FLAG_STRIPED 0x10
+#define STEGO_FLAG_PARITY 0x20
+#define STEGO_FLAG_CHUNKED 0x40 // chunk store pack or recipe
+
+typedef struct stego_ctx stego_ctx_t;
+
+typedef struct
+{
+    void *(*malloc)(void *user, size_t size);
+    void *(*realloc)(void *user, void *ptr, size_t size);
+    void (*free)(void *user, void *ptr);
+    void *user;
+} stego_allocator_t;
+
+typedef struct
+{
+    int has_payload;    // the image carries a readable header
+    uint8_t flags;      // STEGO_FLAG_* bits
+    uint32_t file_size; // payload size in bytes
+    char extension[11]; // original file extension, without the dot
+    size_t capacity;    // payload bytes a hide into this image could carry
+} stego_info_t;
+
+// `allocator` may be NULL for malloc/realloc/free; it is copied
+STEGO_API stego_ctx_t *stego_ctx_new(const stego_allocator_t *allocator);
+STEGO_API void stego_ctx_free(stego_ctx_t *ctx);
+
+// NULL or "" clears the passphrase; the string is copied
+STEGO_API int stego_ctx_set_passphrase(stego_ctx_t *ctx, const char *passphrase);
+STEGO_API int stego_ctx_set_scatter(stego_ctx_t *ctx, int scatter);
+// Gives every thread calling with this context an arena of `reserve` bytes of
+// address space (0 turns it off) that scratch buffers such as decoded pixels
+// are carved from and that is reset after each call, so a worker running
+// many jobs stops churning the heap. Arena pages are mapped directly rather
+// than taken from the allocator; `huge_pages` asks for 2 MiB pages.
+STEGO_API int stego_ctx_set_arena(stego_ctx_t *ctx, size_t reserve, int huge_pages);
+// Reed-Solomon parity bytes per 255-byte codeword: 0 (off) or even, 2..128
+STEGO_API int stego_ctx_set_ecc(stego_ctx_t *ctx, int parity);
+
+// Hides `size` bytes in `cover` and writes the PNG to `output`. Either path
+// may be "-" for stdin/stdout.
+STEGO_API int stego_hide(const stego_ctx_t *ctx, const char *cover, const char *output, const void *data,
+                         size_t size, const char *extension);
+
+// Same, from an encoded cover image in memory to a PNG in *png (*png_size
+// bytes from the context's allocator, released with stego_buffer_free())
+STEGO_API int stego_hide_memory(const stego_ctx_t *ctx, const void *cover, size_t cover_size, const void *data,
+                                size_t size, const char *extension, void **png, size_t *png_size);
+
+// On success *data holds *size bytes from the context's allocator; release
+// them with stego_buffer_free(). `info` may be NULL.
+STEGO_API int stego_extract(const stego_ctx_t *ctx, const char *image, void **data, size_t *size,
+                            stego_info_t *info);
+STEGO_API int stego_extract_memory(const stego_ctx_t *ctx, const void *image, size_t image_size, void **data,
+                                   size_t *size, stego_info_t *info);
+
+// Reads only the header: whether the image holds a payload, and its capacity
+STEGO_API int stego_probe(const stego_ctx_t *ctx, const char *image, stego_info_t *info);
+
+STEGO_API void stego_buffer_free(const stego_ctx_t *ctx, void *data);
+
+STEGO_API const char *stego_last_error(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // STEGO_H